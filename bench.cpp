@@ -0,0 +1,529 @@
+// Benchmark suite: starts a throwaway redis-server on a unix socket and measures enqueue and dequeue throughput,
+// enqueue to handler start latency, recovery and promotion cost against set size, and payload codecs.
+// Results are printed as JSON. Build and run with `make bench && ./bench`, see `./bench --help`.
+
+#include "cppq.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <csignal>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+const std::string TypeLatencyProbe = "bench:latency";
+
+struct Result {
+  std::string name;
+  std::vector<std::pair<std::string, double>> metrics;
+};
+
+std::vector<Result> results;
+
+void report(std::string name, std::vector<std::pair<std::string, double>> metrics) {
+  std::cerr << name;
+  for (auto &[key, value] : metrics)
+    std::cerr << " " << key << "=" << value;
+  std::cerr << std::endl;
+  results.push_back(Result{ std::move(name), std::move(metrics) });
+}
+
+std::string toJSON() {
+  std::ostringstream out;
+  out.precision(6);
+  out << std::fixed;
+  out << "{\"results\":[";
+  for (size_t i = 0; i < results.size(); i++) {
+    out << (i > 0 ? "," : "") << "{\"name\":" << cppq::jsonString(results[i].name);
+    for (auto &[key, value] : results[i].metrics)
+      out << "," << cppq::jsonString(key) << ":" << value;
+    out << "}";
+  }
+  out << "]}";
+  return out.str();
+}
+
+template <typename F>
+double secondsFor(F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double percentile(std::vector<double> &sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  return sorted[static_cast<size_t>(p * (sorted.size() - 1))];
+}
+
+uint64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// redis-server without persistence in a temporary directory, stopped on destruction
+class RedisServer {
+  public:
+    RedisServer(const std::string &binary) {
+      char dir[] = "/tmp/cppq-bench-XXXXXX";
+      if (mkdtemp(dir) == NULL)
+        throw std::runtime_error("Failed to create a temporary directory");
+      this->dir = dir;
+      socket = this->dir + "/redis.sock";
+
+      pid = fork();
+      if (pid == 0) {
+        execlp(
+            binary.c_str(), binary.c_str(),
+            "--port", "0", "--unixsocket", socket.c_str(), "--dir", dir, "--save", "", "--appendonly", "no",
+            (char *)NULL
+            );
+        _exit(127);
+      }
+      if (pid < 0)
+        throw std::runtime_error("Failed to start " + binary);
+
+      for (int i = 0; i < 100; i++) {
+        redisContext *c = connect();
+        if (c != NULL) {
+          redisFree(c);
+          return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+      stop();
+      throw std::runtime_error("Failed to start " + binary);
+    }
+
+    ~RedisServer() {
+      stop();
+    }
+
+    redisOptions options() const {
+      redisOptions options = {0};
+      REDIS_OPTIONS_SET_UNIX(&options, socket.c_str());
+      return options;
+    }
+
+    redisContext *connect() const {
+      redisOptions options = this->options();
+      redisContext *c = redisConnectWithOptions(&options);
+      if (c != NULL && c->err) {
+        redisFree(c);
+        return NULL;
+      }
+      return c;
+    }
+
+  private:
+    void stop() {
+      if (pid <= 0)
+        return;
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+      pid = -1;
+      unlink(socket.c_str());
+      rmdir(dir.c_str());
+    }
+
+    std::string dir;
+    std::string socket;
+    pid_t pid = -1;
+};
+
+void flush(redisContext *c) {
+  freeReplyObject(redisCommand(c, "FLUSHALL"));
+}
+
+cppq::Task newTask(size_t payloadSize = 64) {
+  return cppq::Task(TypeLatencyProbe, std::string(payloadSize, 'x'), 3);
+}
+
+void fill(redisContext *c, std::string queue, size_t count, cppq::ScheduleOptions s) {
+  for (size_t done = 0; done < count;) {
+    std::vector<cppq::Task> tasks;
+    for (; tasks.size() < 1000 && done < count; done++)
+      tasks.push_back(newTask());
+    cppq::enqueueBatch(c, std::move(tasks), queue, s);
+  }
+}
+
+void fill(redisContext *c, std::string queue, size_t count) {
+  fill(c, queue, count, cppq::ScheduleOptions{ .cron = "", .type = cppq::ScheduleType::None });
+}
+
+void benchEnqueue(redisContext *c, size_t count) {
+  flush(c);
+  double seconds = secondsFor([&] {
+    for (size_t i = 0; i < count; i++)
+      cppq::enqueue(c, newTask(), "bench");
+  });
+  report("enqueue_single", { { "tasks", count }, { "ops_per_sec", count / seconds } });
+
+  for (size_t batch : { 10, 100, 1000 }) {
+    flush(c);
+    seconds = secondsFor([&] {
+      for (size_t done = 0; done < count; done += batch) {
+        std::vector<cppq::Task> tasks;
+        for (size_t i = 0; i < batch; i++)
+          tasks.push_back(newTask());
+        cppq::enqueueBatch(c, std::move(tasks), "bench");
+      }
+    });
+    report("enqueue_batch", { { "tasks", count }, { "batch", batch }, { "ops_per_sec", count / seconds } });
+  }
+}
+
+void benchDequeue(redisContext *c, size_t count) {
+  for (size_t batch : { 1, 16, 64 }) {
+    flush(c);
+    fill(c, "bench", count);
+    size_t dequeued = 0;
+    double seconds = secondsFor([&] {
+      while (dequeued < count) {
+        size_t n = cppq::dequeue(c, "bench", batch).size();
+        if (n == 0)
+          break;
+        dequeued += n;
+      }
+    });
+    report("dequeue", { { "tasks", dequeued }, { "batch", batch }, { "ops_per_sec", dequeued / seconds } });
+  }
+}
+
+std::mutex latenciesMutex;
+std::vector<double> latenciesUs;
+
+// The payload is the enqueue time in nanoseconds since the epoch
+void HandleLatencyProbe(cppq::Task &task) {
+  double latencyUs = (nowNs() - std::stoull(task.payload)) / 1000.0;
+  const std::scoped_lock lock(latenciesMutex);
+  latenciesUs.push_back(latencyUs);
+}
+
+// Enqueues at a fixed rate into a running server and records how long each task waited for its handler
+void benchEndToEnd(const RedisServer &redis, redisContext *c, size_t count, size_t ratePerSec) {
+  flush(c);
+  cppq::registerHandler(TypeLatencyProbe, &HandleLatencyProbe);
+  std::thread([options = redis.options()] {
+    cppq::runServer(options, { { "e2e", 1 } }, 60);
+  }).detach();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  auto interval = std::chrono::nanoseconds(1000000000 / ratePerSec);
+  auto next = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; i++) {
+    std::this_thread::sleep_until(next);
+    next += interval;
+    cppq::enqueue(c, cppq::Task(TypeLatencyProbe, std::to_string(nowNs()), 3), "e2e");
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+  while (std::chrono::steady_clock::now() < deadline) {
+    {
+      const std::scoped_lock lock(latenciesMutex);
+      if (latenciesUs.size() >= count)
+        break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  const std::scoped_lock lock(latenciesMutex);
+  std::sort(latenciesUs.begin(), latenciesUs.end());
+  report("end_to_end_latency_us", {
+      { "tasks", latenciesUs.size() },
+      { "rate_per_sec", ratePerSec },
+      { "p50", percentile(latenciesUs, 0.5) },
+      { "p90", percentile(latenciesUs, 0.9) },
+      { "p99", percentile(latenciesUs, 0.99) },
+      { "p999", percentile(latenciesUs, 0.999) },
+      { "max", latenciesUs.empty() ? 0 : latenciesUs.back() }
+      });
+}
+
+// A sweep that finds nothing should not depend on how many tasks are active, returning expired ones should be
+// linear in their number only
+void benchRecovery(redisContext *c, const std::vector<size_t> &sizes) {
+  for (size_t size : sizes) {
+    flush(c);
+    fill(c, "bench", size);
+    for (size_t dequeued = 0; dequeued < size;)
+      dequeued += cppq::dequeue(c, "bench", 1000, 60 * 60 * 1000).size();
+
+    const int sweeps = 200;
+    double seconds = secondsFor([&] {
+      for (int i = 0; i < sweeps; i++)
+        cppq::recoverExpired(c, "bench");
+    });
+    report("recovery_sweep_idle", { { "active", size }, { "us_per_sweep", seconds / sweeps * 1e6 } });
+
+    freeReplyObject(redisCommand(c, "DEL cppq:bench:active cppq:bench:pending cppq:bench:stream cppq:bench:stream:entries"));
+    fill(c, "bench", size);
+    for (size_t dequeued = 0; dequeued < size;)
+      dequeued += cppq::dequeue(c, "bench", 1000, 0).size();
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+
+    uint64_t recovered = 0;
+    seconds = secondsFor([&] {
+      while (uint64_t n = cppq::recoverExpired(c, "bench", 1000, 0))
+        recovered += n;
+    });
+    report("recovery_sweep_expired", {
+        { "active", size },
+        { "recovered", recovered },
+        { "us_per_task", recovered > 0 ? seconds / recovered * 1e6 : 0 }
+        });
+  }
+}
+
+// Checking a large scheduled set with nothing due should be cheap, promoting is linear in the due tasks only
+void benchPromotion(redisContext *c, const std::vector<size_t> &sizes) {
+  for (size_t size : sizes) {
+    flush(c);
+    fill(c, "bench", size, cppq::scheduleOptions(std::chrono::system_clock::now() + std::chrono::hours(1)));
+
+    const int checks = 200;
+    double seconds = secondsFor([&] {
+      for (int i = 0; i < checks; i++)
+        cppq::promoteScheduled(c, "bench");
+    });
+    report("promotion_idle", { { "scheduled", size }, { "us_per_check", seconds / checks * 1e6 } });
+
+    const size_t due = 1000;
+    fill(c, "bench", due, cppq::scheduleOptions(std::chrono::system_clock::now() - std::chrono::seconds(1)));
+    uint64_t promoted = 0;
+    seconds = secondsFor([&] {
+      promoted = cppq::promoteScheduled(c, "bench").promoted;
+    });
+    report("promotion_due", {
+        { "scheduled", size },
+        { "promoted", promoted },
+        { "us_per_task", promoted > 0 ? seconds / promoted * 1e6 : 0 }
+        });
+  }
+}
+
+// Bulk requeue and delete of failed tasks, in the default batches of 1000
+void benchFailed(redisContext *c, const std::vector<size_t> &sizes) {
+  for (size_t size : sizes) {
+    for (const char *action : { "requeue", "delete" }) {
+      flush(c);
+      fill(c, "dlq", size);
+      freeReplyObject(redisCommand(c, "RENAME cppq:dlq:pending cppq:dlq:failed"));
+      cppq::FailedProgress done{ 0, 0, 0 };
+      double seconds = secondsFor([&] {
+        done = cppq::processFailed(c, "dlq", action, "", 0);
+      });
+      report(std::string("failed_") + action, {
+          { "failed", size },
+          { "matched", done.matched },
+          { "tasks_per_min", done.matched / seconds * 60 }
+          });
+    }
+  }
+}
+
+// Cost a worker pays per recorded value, including finding its thread's series
+void benchMetrics(size_t threads) {
+  const size_t iterations = 10000000;
+  cppq::Metrics metrics;
+  std::vector<std::thread> recorders;
+  std::atomic<uint64_t> totalNs = 0;
+  for (size_t t = 0; t < threads; t++)
+    recorders.emplace_back([&] {
+      double seconds = secondsFor([&] {
+        for (size_t i = 0; i < iterations; i++)
+          metrics.local("default", TypeLatencyProbe).record(cppq::Metric::Execution, i & 0xffff);
+      });
+      totalNs += static_cast<uint64_t>(seconds * 1e9);
+    });
+  for (auto &recorder : recorders)
+    recorder.join();
+  report("metrics_record", { { "threads", threads }, { "ns_per_record", double(totalNs) / threads / iterations } });
+}
+
+// Deterministic JSON resembling real payloads: repeated keys, short strings, numbers, some entropy
+std::string makePayload(size_t size) {
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> number(0, 1000000);
+  const char *words[] = { "delivered", "pending", "bounced", "opened", "clicked", "unsubscribed" };
+  std::string payload = "{\"events\":[";
+  for (int i = 0; payload.size() < size; i++) {
+    if (i > 0)
+      payload += ",";
+    payload += "{\"id\":" + std::to_string(i) +
+      ",\"userId\":" + std::to_string(number(rng)) +
+      ",\"status\":\"" + words[number(rng) % 6] + "\"" +
+      ",\"templateId\":\"T" + std::to_string(number(rng) % 50) + "\"" +
+      ",\"timestampMs\":" + std::to_string(1700000000000ULL + number(rng)) + "}";
+  }
+  payload += "]}";
+  return payload;
+}
+
+// Compression ratio and throughput of every compiled-in codec, build with WITH_LZ4=1 and/or WITH_ZSTD=1
+void benchCodecs() {
+  for (size_t size : { 5 * 1024, 50 * 1024, 200 * 1024 }) {
+    std::string payload = makePayload(size);
+    // Roughly 64 MB of input per measurement
+    size_t iterations = std::max<size_t>(1, (64 << 20) / payload.size());
+
+    for (auto &[id, codec] : cppq::codecs) {
+      std::string compressed;
+      double compressSeconds = secondsFor([&] {
+        for (size_t i = 0; i < iterations; i++)
+          compressed = codec->compress(payload);
+      });
+      std::string decompressed;
+      double decompressSeconds = secondsFor([&] {
+        for (size_t i = 0; i < iterations; i++)
+          decompressed = codec->decompress(compressed);
+      });
+      if (decompressed != payload)
+        throw std::runtime_error(codec->name() + " failed to round-trip");
+
+      double megabytes = double(payload.size()) * iterations / (1 << 20);
+      report("codec_" + codec->name(), {
+          { "payload_bytes", payload.size() },
+          { "compressed_bytes", compressed.size() },
+          { "ratio", double(payload.size()) / compressed.size() },
+          { "compress_mb_per_sec", megabytes / compressSeconds },
+          { "decompress_mb_per_sec", megabytes / decompressSeconds }
+          });
+    }
+  }
+}
+
+// EmbeddedBroker enqueue throughput with and without waiting for the WAL sync (producers share group commits), and
+// the cost of a dequeue and finish round with no handler in between
+void benchEmbedded(size_t count) {
+  for (bool waitForSync : { false, true }) {
+    for (size_t producers : { 1, 8 }) {
+      std::string directory = (std::filesystem::temp_directory_path() / "cppq-bench-wal").string();
+      std::filesystem::remove_all(directory);
+      cppq::EmbeddedOptions options;
+      options.waitForSync = waitForSync;
+      options.queueCapacity = count;
+      cppq::EmbeddedBroker broker(directory, { "bench" }, options);
+
+      // Synced enqueues wait a group commit each, keep those runs short
+      size_t perProducer = (waitForSync ? count / 10 : count) / producers;
+      double seconds = secondsFor([&] {
+        std::vector<std::thread> threads;
+        for (size_t p = 0; p < producers; p++)
+          threads.emplace_back([&] {
+            for (size_t i = 0; i < perProducer; i++)
+              broker.enqueue(cppq::Task{ TypeLatencyProbe, "0", 1 }, "bench");
+          });
+        for (auto &thread : threads)
+          thread.join();
+      });
+      report("embedded_enqueue", {
+          { "tasks", perProducer * producers },
+          { "producers", producers },
+          { "wait_for_sync", waitForSync },
+          { "ops_per_sec", perProducer * producers / seconds }
+          });
+
+      if (!waitForSync) {
+        size_t finished = 0;
+        seconds = secondsFor([&] {
+          while (std::optional<cppq::Delivery> delivery = broker.tryDequeue("bench")) {
+            cppq::settleTask(delivery->task, false);
+            broker.finish(std::move(delivery.value()));
+            finished++;
+          }
+        });
+        report("embedded_dequeue_finish", { { "tasks", finished }, { "ops_per_sec", finished / seconds } });
+      }
+      std::filesystem::remove_all(directory);
+    }
+  }
+}
+
+void usage() {
+  std::cerr <<
+    "usage: bench [--redis-server PATH] [--out FILE] [--quick] [--stream] [--only NAME]\n"
+    "  --redis-server PATH  redis-server binary to start (default: redis-server)\n"
+    "  --out FILE           write the JSON results to FILE instead of stdout\n"
+    "  --quick              smaller task counts and set sizes\n"
+    "  --stream             store the benchmarked queues with StreamBackend instead of lists\n"
+    "  --only NAME          run one of: enqueue, dequeue, recovery, promotion, failed, codecs, metrics,\n"
+    "                       embedded, e2e\n";
+}
+
+int main(int argc, char *argv[]) {
+  std::string redisServer = "redis-server";
+  std::string out;
+  std::string only;
+  bool quick = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--redis-server" && i + 1 < argc)
+      redisServer = argv[++i];
+    else if (arg == "--out" && i + 1 < argc)
+      out = argv[++i];
+    else if (arg == "--only" && i + 1 < argc)
+      only = argv[++i];
+    else if (arg == "--quick")
+      quick = true;
+    else if (arg == "--stream")
+      for (const char *queue : { "bench", "e2e" })
+        cppq::setQueueBackend(queue, std::make_shared<cppq::StreamBackend>());
+    else {
+      usage();
+      return arg == "--help" ? 0 : 1;
+    }
+  }
+  auto enabled = [&](const std::string &name) { return only.empty() || only == name; };
+
+  size_t count = quick ? 2000 : 20000;
+  std::vector<size_t> sizes = quick ? std::vector<size_t>{ 1000, 10000 } : std::vector<size_t>{ 1000, 10000, 100000 };
+
+  try {
+    if (enabled("codecs"))
+      benchCodecs();
+    if (enabled("metrics"))
+      for (size_t threads : { 1, 4 })
+        benchMetrics(threads);
+    if (enabled("embedded"))
+      benchEmbedded(count * 10);
+
+    RedisServer redis(redisServer);
+    redisContext *c = redis.connect();
+    if (c == NULL) {
+      std::cerr << "Failed to connect to Redis" << std::endl;
+      return 1;
+    }
+    cppq::loadScripts(c);
+
+    if (enabled("enqueue"))
+      benchEnqueue(c, count);
+    if (enabled("dequeue"))
+      benchDequeue(c, count);
+    if (enabled("recovery"))
+      benchRecovery(c, sizes);
+    if (enabled("promotion"))
+      benchPromotion(c, sizes);
+    if (enabled("failed"))
+      benchFailed(c, sizes);
+    // Last, the server it starts keeps running until the process exits
+    if (enabled("e2e"))
+      benchEndToEnd(redis, c, count / 4, 1000);
+    redisFree(c);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::string json = toJSON();
+  if (out.empty()) {
+    std::cout << json << std::endl;
+  } else {
+    std::ofstream file(out);
+    file << json << std::endl;
+  }
+  // Skips joining the detached server threads of the end-to-end run
+  std::fflush(stdout);
+  std::_Exit(0);
+}
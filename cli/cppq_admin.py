@@ -0,0 +1,557 @@
+# Helpers shared by the CLI (cli/main.py) and the web backend (web/backend/main.py) to read and control
+# queues directly in Redis, following the key and task record layouts that cppq.hpp writes
+import struct
+import json
+import math
+import time
+
+
+def decode_redis(src):
+    if isinstance(src, list):
+        rv = list()
+        for key in src:
+            rv.append(decode_redis(key))
+        return rv
+    elif isinstance(src, dict):
+        rv = dict()
+        for key in src:
+            rv[key.decode()] = decode_redis(src[key])
+        return rv
+    elif isinstance(src, bytes):
+        return src.decode()
+    else:
+        raise Exception("type not handled: " + type(src))
+
+
+TASK_STATES = ['Unknown', 'Pending', 'Scheduled', 'Active', 'Failed', 'Completed']
+
+CODECS = { 1: 'lz4', 2: 'zstd' }
+
+# Compact task record layout, the same as cppq::encodeTask: u8 version, u8 state, u8 flags, u8 reserved, then
+# version + 3 u64 fields and the u32 length prefixed type, payload, cron and result. Offsets are 0-based bytes.
+RECORD_VERSIONS = (1, 2, 3)
+RECORD_STATE_OFFSET = 1
+RECORD_RETRIED_OFFSET = 12
+RECORD_FINISHED_AT_OFFSET = 36
+RECORD_ENQUEUED_AT_OFFSET = 44
+
+
+def record_header_size(version):
+    return 4 + 8 * (version + 3)
+
+
+# The same layout for the Lua scripts below, which get positions as Lua counts them with `offset + 1`
+RECORD_LUA = """
+local recordStateOffset, recordRetriedOffset, recordFinishedAtOffset, recordEnqueuedAtOffset = %d, %d, %d, %d
+local recordHeaderSizes = { %s }
+local function recordHeaderSize(version)
+  return recordHeaderSizes[version]
+end
+""" % (RECORD_STATE_OFFSET, RECORD_RETRIED_OFFSET, RECORD_FINISHED_AT_OFFSET, RECORD_ENQUEUED_AT_OFFSET,
+       ', '.join(str(record_header_size(version)) for version in RECORD_VERSIONS))
+
+
+# Decompresses with the optional lz4/zstandard modules, or describes the data if they are missing
+def decompress(codec, data):
+    if codec == 0:
+        return data.decode()
+    try:
+        if codec == 1:
+            import lz4.block
+            (size,) = struct.unpack_from('<I', data)
+            return lz4.block.decompress(data[4:], uncompressed_size=size).decode()
+        if codec == 2:
+            import zstandard
+            return zstandard.ZstdDecompressor().decompress(data).decode()
+    except ImportError:
+        pass
+    return '<' + str(len(data)) + ' bytes compressed with ' + CODECS.get(codec, 'codec ' + str(codec)) + '>'
+
+
+def decode_task_record(record):
+    version = record[0]
+    if version not in RECORD_VERSIONS:
+        raise Exception("unsupported task record version: " + str(version))
+    header = '<BBBB' + 'Q' * (version + 3)
+    _, state, flags, _, maxRetry, retried, dequeuedAtMs, schedule, *rest = struct.unpack_from(header, record)
+    task = { 'state': TASK_STATES[state], 'maxRetry': str(maxRetry), 'retried': str(retried), 'dequeuedAtMs': str(dequeuedAtMs) }
+    if schedule:
+        task['schedule'] = str(schedule)
+    for field, value in zip(('finishedAtMs', 'enqueuedAtMs'), rest):
+        if value:
+            task[field] = str(value)
+    codecs = { 'payload': flags & 0x0f, 'result': flags >> 4 }
+    offset = record_header_size(version)
+    for field in ('type', 'payload', 'cron', 'result'):
+        (length,) = struct.unpack_from('<I', record, offset)
+        offset += 4
+        value = decompress(codecs.get(field, 0), record[offset:offset + length])
+        offset += length
+        if value or field in ('type', 'payload'):
+            task[field] = value
+    return task
+
+
+# Servers record each queue's key naming and shard count, see cppq::setKeyNaming and cppq::setQueueSharding
+def queue_layout(redisClient, queue):
+    layout = redisClient.hget('cppq:queues:layout', queue)
+    naming, shards = layout.decode().split(':') if layout else ('plain', '1')
+    return naming, int(shards)
+
+
+def key_prefix(naming, queue):
+    return 'cppq:{' + queue + '}:' if naming == 'hashtagged' else 'cppq:' + queue + ':'
+
+
+# Key prefixes of every shard of a queue, just the queue's own for unsharded ones
+def layout_prefixes(naming, shards, queue):
+    if shards <= 1:
+        return [key_prefix(naming, queue)]
+    return [key_prefix(naming, queue + '#' + str(i)) for i in range(shards)]
+
+
+def shard_prefixes(redisClient, queue):
+    return layout_prefixes(*queue_layout(redisClient, queue), queue)
+
+
+STATE_LENGTHS = (
+    ('pending', 'llen', 'pending'),
+    ('scheduled', 'zcard', 'scheduled'),
+    ('active', 'zcard', 'active'),
+    ('stream', 'xlen', 'stream'),
+    ('streamActive', 'hlen', 'stream:entries'),
+    ('completed', 'llen', 'completed'),
+    ('failed', 'llen', 'failed')
+)
+
+ROLLUP_FIELDS = ('enqueued', 'processed', 'failed', 'retried', 'handler_us')
+
+
+# Task counts and the per-minute rollups of the last `minutes` (see cppq::statsHistory) of the given queues,
+# or of all of them, with the memory their task lists and sets take if asked. Every length read is O(1), and
+# all of them are fetched in a single pipeline after one round trip for the queue list and layouts.
+def dashboard(redisClient, queues=None, minutes=60, memory=False):
+    pipe = redisClient.pipeline(transaction=False)
+    pipe.smembers('cppq:queues')
+    pipe.smembers('cppq:{queues}:paused')
+    pipe.hgetall('cppq:queues:layout')
+    registered, paused, layouts = pipe.execute()
+    priorities = dict(x.decode().rsplit(':', 1) for x in registered)
+    paused = set(x.decode() for x in paused)
+    layouts = { k.decode(): v.decode().split(':') for k, v in layouts.items() }
+    names = sorted(priorities) if queues is None else queues
+    now = int(time.time()) // 60
+    buckets = list(range(now - minutes + 1, now + 1))
+
+    prefixes = {}
+    for name in names:
+        naming, shards = layouts.get(name, ('plain', '1'))
+        prefixes[name] = layout_prefixes(naming, int(shards), name)
+        for prefix in prefixes[name]:
+            for _, command, suffix in STATE_LENGTHS:
+                getattr(pipe, command)(prefix + suffix)
+            if memory:
+                for _, _, suffix in STATE_LENGTHS:
+                    pipe.memory_usage(prefix + suffix)
+            for bucket in buckets:
+                pipe.hgetall(prefix + 'stats:' + str(bucket))
+    replies = iter(pipe.execute())
+
+    result = []
+    for name in names:
+        counts = { state: 0 for state, _, _ in STATE_LENGTHS }
+        usage = 0
+        history = [dict({ field: 0 for field in ROLLUP_FIELDS }, minuteMs=bucket * 60000) for bucket in buckets]
+        for prefix in prefixes[name]:
+            for state, _, _ in STATE_LENGTHS:
+                counts[state] += next(replies)
+            if memory:
+                usage += sum(next(replies) or 0 for _ in STATE_LENGTHS)
+            for point in history:
+                for field, value in next(replies).items():
+                    point[field.decode()] = point.get(field.decode(), 0) + int(value)
+        # Stream backed queues keep ready and leased tasks in one stream, leased ones are also in its entries hash
+        stream, streamActive = counts.pop('stream'), counts.pop('streamActive')
+        counts['pending'] += stream - streamActive
+        counts['active'] += streamActive
+        queue = dict(counts, name=name, priority=priorities.get(name), paused=name in paused, history=history)
+        if memory:
+            queue['memory'] = usage
+        result.append(queue)
+    return result
+
+
+# Parts of a state that listings go through in order on every shard, as (kind, key suffix). Stream backed queues
+# (cppq::StreamBackend) keep ready and leased tasks in one stream, leased ones are also in its entries hash.
+# Queues can have tasks in both layouts while moving between backends.
+def state_parts(state):
+    if state == 'pending':
+        return [('list', 'pending'), ('stream', 'stream')]
+    if state == 'active':
+        return [('zset', 'active'), ('entries', 'stream:entries')]
+    if state == 'scheduled':
+        return [('zset', 'scheduled')]
+    return [('list', state)]
+
+
+# One page of a task list, sorted set, stream or stream entries hash, optionally only of tasks of one type.
+# It examines at most ARGV[5] tasks, so that looking for a rare type in a huge queue cannot stall Redis, and
+# returns [position to continue from or '' at the end, uuids]. Pages of the entries hash are whole HSCAN batches.
+# KEYS = [key, stream entries], ARGV = [kind, position, count, type or '', budget, task key prefix]
+PAGE_SCRIPT = RECORD_LUA + """
+local kind, position, count, wanted, budget, prefix =
+  ARGV[1], ARGV[2], tonumber(ARGV[3]), ARGV[4], tonumber(ARGV[5]), ARGV[6]
+local found, examined = {}, 0
+
+-- The length prefixed type follows the header of compact records
+local function typeOf(key)
+  if redis.call('TYPE', key).ok == 'string' then
+    local record = redis.call('GET', key)
+    return (struct.unpack('<I4c0', record, recordHeaderSize(string.byte(record, 1)) + 1))
+  end
+  return redis.call('HGET', key, 'type')
+end
+
+local function matches(uuid)
+  return wanted == '' or typeOf(prefix .. uuid) == wanted
+end
+
+if kind == 'entries' then
+  local cursor = position == '' and '0' or position
+  repeat
+    local reply = redis.call('HSCAN', KEYS[1], cursor, 'COUNT', count)
+    cursor = reply[1]
+    for i = 1, #reply[2], 2 do
+      examined = examined + 1
+      if matches(reply[2][i]) then
+        found[#found + 1] = reply[2][i]
+      end
+    end
+  until cursor == '0' or #found >= count or examined >= budget
+  return { cursor == '0' and '' or cursor, found }
+end
+
+-- Members after position as { position after the member, uuid or false to skip it }
+local function fetch(n)
+  local members = {}
+  if kind == 'stream' then
+    local entries = redis.call('XRANGE', KEYS[1], position == '' and '-' or '(' .. position, '+', 'COUNT', n)
+    for i, entry in ipairs(entries) do
+      local uuid = entry[2][2]
+      -- Leased entries are listed as active
+      if uuid and redis.call('HEXISTS', KEYS[2], uuid) == 1 then
+        uuid = false
+      end
+      members[i] = { entry[1], uuid }
+    end
+    return members
+  end
+  local start = tonumber(position) or 0
+  local uuids = redis.call(kind == 'list' and 'LRANGE' or 'ZRANGE', KEYS[1], start, start + n - 1)
+  for i, uuid in ipairs(uuids) do
+    members[i] = { tostring(start + i), uuid }
+  end
+  return members
+end
+
+while examined < budget do
+  local n = math.min(budget - examined, wanted == '' and count - #found or 100)
+  local members = fetch(n)
+  for _, member in ipairs(members) do
+    position = member[1]
+    examined = examined + 1
+    if member[2] and matches(member[2]) then
+      found[#found + 1] = member[2]
+      if #found == count then
+        return { position, found }
+      end
+    end
+  end
+  if #members < n then
+    return { '', found }
+  end
+end
+return { position, found }
+"""
+
+
+# Records of tasks of one shard: KEYS = task keys, returns { key type, GET or HGETALL reply } for each
+TASKS_SCRIPT = """
+local tasks = {}
+for i, key in ipairs(KEYS) do
+  local kind = redis.call('TYPE', key).ok
+  if kind == 'string' then
+    tasks[i] = { kind, redis.call('GET', key) }
+  else
+    tasks[i] = { kind, redis.call('HGETALL', key) }
+  end
+end
+return tasks
+"""
+
+
+def parse_cursor(cursor):
+    shard, part, position = cursor.split(':', 2)
+    return int(shard), int(part), position
+
+
+# Cursor of the first task past the `offset` first ones. Lists and sorted sets are skipped by their O(1) lengths
+# when not filtering by type, streams and filtered listings have to be walked.
+def seek(redisClient, queue, state, offset, type):
+    prefixes = shard_prefixes(redisClient, queue)
+    parts = state_parts(state)
+    shard = part = 0
+    if not type:
+        pipe = redisClient.pipeline(transaction=False)
+        for prefix in prefixes:
+            for kind, suffix in parts:
+                { 'list': pipe.llen, 'zset': pipe.zcard, 'stream': pipe.xlen, 'entries': pipe.hlen }[kind](prefix + suffix)
+        lengths = iter(pipe.execute())
+        for shard in range(len(prefixes)):
+            for part, (kind, _) in enumerate(parts):
+                length = next(lengths)
+                if kind not in ('list', 'zset') or offset < length:
+                    if kind in ('list', 'zset'):
+                        return str(shard) + ':' + str(part) + ':' + str(offset), 0
+                    return str(shard) + ':' + str(part) + ':', offset
+                offset -= length
+        return None, 0
+    return '0:0:', offset
+
+
+# One page of the uuids of a state's tasks across the queue's shards, as (key prefix, uuid) pairs, and the cursor
+# of the next page or None after the last. Each Redis call is bounded by `budget` examined tasks, a filtered page
+# can come back short with a cursor to continue from.
+def page_tasks(redisClient, queue, state, cursor=None, count=50, type=None, offset=0, budget=1000):
+    if cursor is None:
+        cursor, offset = seek(redisClient, queue, state, offset, type)
+    while cursor is not None and offset > 0:
+        skipped, cursor = page_tasks(redisClient, queue, state, cursor, min(offset, budget), type, 0, budget)
+        offset -= len(skipped)
+    if cursor is None:
+        return [], None
+
+    prefixes = shard_prefixes(redisClient, queue)
+    parts = state_parts(state)
+    script = redisClient.register_script(PAGE_SCRIPT)
+    shard, part, position = parse_cursor(cursor)
+    found = []
+    while shard < len(prefixes) and len(found) < count:
+        prefix = prefixes[shard]
+        kind, suffix = parts[part]
+        position, uuids = script(
+            keys=[prefix + suffix, prefix + 'stream:entries'],
+            args=[kind, position, count - len(found), type or '', budget, prefix + 'task:']
+        )
+        position = position.decode()
+        found += [(prefix, uuid.decode('ascii')) for uuid in uuids]
+        if position:
+            break
+        part += 1
+        if part == len(parts):
+            shard, part = shard + 1, 0
+    if shard == len(prefixes):
+        return found, None
+    return found, str(shard) + ':' + str(part) + ':' + position
+
+
+def decode_task(kind, value):
+    if kind == b'string':
+        return decode_task_record(value)
+    fields = dict(zip(value[::2], value[1::2]))
+    for field in (b'payload', b'result'):
+        codec = int(fields.pop(field + b'Codec', b'0'))
+        if field in fields:
+            fields[field] = decompress(codec, fields[field]).encode()
+    return decode_redis(fields)
+
+
+# Details of a page of tasks, one script call per shard in one pipeline
+def get_tasks(redisClient, page):
+    script = redisClient.register_script(TASKS_SCRIPT)
+    prefixes = list(dict.fromkeys(prefix for prefix, _ in page))
+    pipe = redisClient.pipeline(transaction=False)
+    for prefix in prefixes:
+        script(keys=[prefix + 'task:' + uuid for p, uuid in page if p == prefix], client=pipe)
+    records = { prefix: iter(reply) for prefix, reply in zip(prefixes, pipe.execute()) }
+    return [dict(decode_task(*next(records[prefix])), uuid=uuid) for prefix, uuid in page]
+
+
+def get_task(redisClient, queue, uuid):
+    prefixes = shard_prefixes(redisClient, queue)
+    prefix = next((prefix for prefix in prefixes if redisClient.exists(prefix + 'task:' + uuid)), prefixes[0])
+    return get_tasks(redisClient, [(prefix, uuid)])[0]
+
+
+# Requeues (with a fresh retry budget) or deletes up to ARGV[3] tasks from the consuming end of the failed list that
+# are of type ARGV[4] ('' for any) and failed before ARGV[5] ('0' for any time), the same as cppq::failedBatchScript.
+# Tasks that do not match go back to the other end. Returns [examined, matched]: KEYS = [failed, ready],
+# ARGV = [task key prefix, 'requeue' or 'delete', limit, type, finished before ms, 'list' or 'stream', wakeup channel, nowMs]
+FAILED_BATCH_SCRIPT = RECORD_LUA + """
+local examined, matched = 0, 0
+local before = tonumber(ARGV[5])
+for i = 1, tonumber(ARGV[3]) do
+  local uuid = redis.call('RPOP', KEYS[1])
+  if not uuid then
+    break
+  end
+  examined = examined + 1
+  local key = ARGV[1] .. uuid
+  local kind = redis.call('TYPE', key).ok
+  -- Entries of deleted records are dropped
+  if kind ~= 'none' then
+    local version, type, finishedAtMs
+    if kind == 'string' then
+      local record = redis.call('GET', key)
+      version = string.byte(record, 1)
+      type = struct.unpack('<I4c0', record, recordHeaderSize(version) + 1)
+      finishedAtMs = version >= 2 and struct.unpack('<I8', record, recordFinishedAtOffset + 1) or 0
+    else
+      local fields = redis.call('HMGET', key, 'type', 'finishedAtMs')
+      type, finishedAtMs = fields[1], tonumber(fields[2]) or 0
+    end
+    if (ARGV[4] == '' or type == ARGV[4]) and (before == 0 or finishedAtMs < before) then
+      matched = matched + 1
+      if ARGV[2] == 'delete' then
+        redis.call('DEL', key)
+      else
+        if kind == 'string' then
+          -- State (1 is Pending) and retried are at fixed offsets of compact records, so is enqueuedAtMs from version 3 on
+          redis.call('SETRANGE', key, recordStateOffset, string.char(1))
+          redis.call('SETRANGE', key, recordRetriedOffset, struct.pack('<I8', 0))
+          if version >= 3 then
+            redis.call('SETRANGE', key, recordEnqueuedAtOffset, struct.pack('<I8', tonumber(ARGV[8])))
+          end
+        else
+          redis.call('HSET', key, 'state', 'Pending', 'retried', '0', 'enqueuedAtMs', ARGV[8])
+        end
+        if ARGV[6] == 'stream' then
+          redis.call('XADD', KEYS[2], '*', 'uuid', uuid)
+        else
+          redis.call('LPUSH', KEYS[2], uuid)
+        end
+      end
+    else
+      redis.call('LPUSH', KEYS[1], uuid)
+    end
+  end
+end
+if matched > 0 and ARGV[2] == 'requeue' then
+  redis.call('PUBLISH', ARGV[7], 1)
+end
+return { examined, matched }
+"""
+
+
+# Goes through the failed lists of every shard of a queue in FAILED_BATCH_SCRIPT calls of `batch_size` tasks, so that
+# Redis serves other clients between batches, and calls `progress` after each. Queues with a stream are taken to be
+# stream backed (see cppq::StreamBackend) and requeued tasks are added to the stream.
+def process_failed(redisClient, queue, action, type=None, before_ms=0, progress=None, batch_size=1000):
+    script = redisClient.register_script(FAILED_BATCH_SCRIPT)
+    prefixes = shard_prefixes(redisClient, queue)
+    pipe = redisClient.pipeline(transaction=False)
+    for prefix in prefixes:
+        pipe.llen(prefix + 'failed')
+        pipe.exists(prefix + 'stream')
+    replies = pipe.execute()
+    lengths, streamed = replies[0::2], replies[1::2]
+    done = { 'examined': 0, 'matched': 0, 'total': sum(lengths) }
+    for prefix, remaining, stream in zip(prefixes, lengths, streamed):
+        while remaining > 0:
+            examined, matched = script(
+                keys=[prefix + 'failed', prefix + ('stream' if stream else 'pending')],
+                args=[
+                    prefix + 'task:', action, min(remaining, batch_size), type or '', before_ms,
+                    'stream' if stream else 'list', prefix + 'wakeup', int(time.time() * 1000)
+                ]
+            )
+            done['examined'] += examined
+            done['matched'] += matched
+            if progress:
+                progress(done)
+            # The list shrank under us, e.g. through retention
+            if examined == 0:
+                break
+            remaining -= min(remaining, examined)
+    return done
+
+
+METRICS = ('queue_wait_us', 'execution_us', 'ack_latency_us', 'retries')
+
+OUTCOMES = ('completed', 'failed', 'requeued')
+
+
+# Smallest value of a cppq::Histogram bucket
+def bucket_lower_bound(bucket):
+    if bucket < 16:
+        return bucket
+    return (16 + bucket % 16) << (bucket // 16 - 1)
+
+
+# Largest value of a cppq::Histogram bucket
+def bucket_upper_bound(bucket):
+    return bucket_lower_bound(bucket + 1) - 1
+
+
+# Merges the snapshots that live servers write to cppq:<queue>:metrics:<server>, by task type
+def get_metrics(redisClient, queue):
+    merged = {}
+    naming, _ = queue_layout(redisClient, queue)
+    for key in redisClient.scan_iter(match=key_prefix(naming, queue) + 'metrics:*'):
+        for type, snapshot in redisClient.hgetall(key).items():
+            snapshot = json.loads(snapshot)
+            series = merged.setdefault(type.decode(), {})
+            for outcome in OUTCOMES:
+                series[outcome] = series.get(outcome, 0) + snapshot.get(outcome, 0)
+            for name in METRICS:
+                histogram = series.setdefault(name, { 'count': 0, 'sum': 0, 'max': 0, 'buckets': {} })
+                source = snapshot.get(name, {})
+                histogram['count'] += source.get('count', 0)
+                histogram['sum'] += source.get('sum', 0)
+                histogram['max'] = max(histogram['max'], source.get('max', 0))
+                for bucket, count in source.get('buckets', []):
+                    histogram['buckets'][bucket] = histogram['buckets'].get(bucket, 0) + count
+    return merged
+
+
+def quantile(histogram, q):
+    if histogram['count'] == 0:
+        return 0
+    rank = max(1, math.ceil(q * histogram['count']))
+    seen = 0
+    for bucket in sorted(histogram['buckets']):
+        seen += histogram['buckets'][bucket]
+        if seen >= rank:
+            return min(bucket_lower_bound(bucket), histogram['max'])
+    return histogram['max']
+
+
+def summarize_metrics(metrics):
+    result = {}
+    for type, series in metrics.items():
+        summary = { outcome: series[outcome] for outcome in OUTCOMES }
+        for name in METRICS:
+            histogram = series[name]
+            summary[name] = {
+                'count': histogram['count'],
+                'mean': histogram['sum'] / histogram['count'] if histogram['count'] else 0,
+                'p50': quantile(histogram, 0.5),
+                'p90': quantile(histogram, 0.9),
+                'p99': quantile(histogram, 0.99),
+                'p999': quantile(histogram, 0.999),
+                'max': histogram['max']
+            }
+        result[type] = summary
+    return result
+
+
+# Mirrors cppq::setPaused: servers cache pause state and re-read it when the version moves
+def set_paused(redisClient, queue, paused):
+    pipe = redisClient.pipeline()
+    if paused:
+        pipe.sadd('cppq:{queues}:paused', queue)
+    else:
+        pipe.srem('cppq:{queues}:paused', queue)
+    pipe.incr('cppq:{queues}:paused:version')
+    pipe.publish('cppq:queues:paused', queue)
+    pipe.execute()
@@ -1,23 +1,9 @@
 import redis
+import time
 import sys
 import argparse
-
-
-def decode_redis(src):
-    if isinstance(src, list):
-        rv = list()
-        for key in src:
-            rv.append(decode_redis(key))
-        return rv
-    elif isinstance(src, dict):
-        rv = dict()
-        for key in src:
-            rv[key.decode()] = decode_redis(src[key])
-        return rv
-    elif isinstance(src, bytes):
-        return src.decode()
-    else:
-        raise Exception("type not handled: " + type(src))
+from cppq_admin import (ROLLUP_FIELDS, decode_redis, queue_layout, shard_prefixes, dashboard, page_tasks, get_tasks,
+                        get_task, process_failed, get_metrics, summarize_metrics, set_paused)
 
 
 def main():
@@ -25,8 +11,20 @@ def main():
     parser.add_argument('--redis_uri', dest='redis_uri', default='redis://localhost')
     parser.add_argument('--queues', dest='queues', action='store_true', help='print queues, priorities, and pause status ')
     parser.add_argument('--stats', dest='stats', metavar=('QUEUE'), help='print queue statistics')
-    parser.add_argument('--list', type=str, nargs=2, help='list task UUIDs in queue', metavar=('QUEUE', 'STATE'))
+    parser.add_argument('--dashboard', dest='dashboard', action='store_true', help='print statistics and memory usage of every queue')
+    parser.add_argument('--history', type=str, nargs=2, help='print per-minute enqueued, processed, failed and retried tasks and handler time', metavar=('QUEUE', 'MINUTES'))
+    parser.add_argument('--list', type=str, nargs=2, help='list task UUIDs in queue, a page at a time', metavar=('QUEUE', 'STATE'))
+    parser.add_argument('--count', dest='count', type=int, default=100, help='page size of --list')
+    parser.add_argument('--offset', dest='offset', type=int, default=0, help='tasks to skip before the page of --list')
+    parser.add_argument('--cursor', dest='cursor', help='continue --list from the cursor it printed')
+    parser.add_argument('--type', dest='type', help='only --list tasks of this type')
+    parser.add_argument('--details', dest='details', action='store_true', help='print task details with --list')
+    parser.add_argument('--requeue-failed', dest='requeue_failed', metavar=('QUEUE'), help='requeue failed tasks (of --type only, if given)')
+    parser.add_argument('--delete-failed', dest='delete_failed', metavar=('QUEUE'), help='delete failed tasks (of --type and --older-than only, if given)')
+    parser.add_argument('--older-than', dest='older_than', type=float, metavar=('SECONDS'), help='only --delete-failed tasks that failed this long ago')
     parser.add_argument('--task', type=str, nargs=2, help='get task details', metavar=('QUEUE', 'UUID'))
+    parser.add_argument('--periodic', dest='periodic', metavar=('QUEUE'), help='list periodic task ids and their cron expressions')
+    parser.add_argument('--metrics', dest='metrics', metavar=('QUEUE'), help='print latency percentiles and outcomes by task type')
     parser.add_argument('--pause', dest='pause', metavar=('QUEUE'), help='pause a queue')
     parser.add_argument('--unpause', dest='unpause', metavar=('QUEUE'), help='unpause a queue')
 
@@ -47,33 +45,62 @@ def main():
         result = {}
         for queue in queues:
             name = queue.split(':')[0];
-            paused = redisClient.sismember('cppq:queues:paused', name)
-            result[name] = { 'priority': queue.split(':')[1], 'paused': paused }
+            paused = redisClient.sismember('cppq:{queues}:paused', name)
+            result[name] = { 'priority': queue.split(':')[1], 'paused': paused, 'shards': queue_layout(redisClient, name)[1] }
         return result
 
     if args.stats:
-        pending = redisClient.llen('cppq:' + args.stats + ':pending')
-        scheduled = redisClient.llen('cppq:' + args.stats + ':scheduled')
-        active = redisClient.llen('cppq:' + args.stats + ':active')
-        completed = redisClient.llen('cppq:' + args.stats + ':completed')
-        failed = redisClient.llen('cppq:' + args.stats + ':failed')
-        return { 'pending': pending, 'scheduled': scheduled, 'active': active, 'completed': completed, 'failed': failed }
+        stats = dashboard(redisClient, [args.stats], minutes=0)[0]
+        return { state: stats[state] for state in ('pending', 'scheduled', 'active', 'completed', 'failed') }
+
+    if args.dashboard:
+        return { queue.pop('name'): queue for queue in dashboard(redisClient, minutes=0, memory=True) }
+
+    if args.history:
+        queue, minutes = args.history
+        return [point for point in dashboard(redisClient, [queue], minutes=int(minutes))[0]['history'] if any(point[field] for field in ROLLUP_FIELDS)]
 
     if args.list:
         queue, state = args.list
-        taskUuids = [x.decode('ascii') for x in redisClient.lrange('cppq:' + queue + ':' + state, 0, -1)]
-        return taskUuids
+        page, cursor = page_tasks(redisClient, queue, state, args.cursor, args.count, args.type, args.offset)
+        tasks = get_tasks(redisClient, page) if args.details else [uuid for _, uuid in page]
+        return { 'tasks': tasks, 'cursor': cursor }
 
     if args.task:
         queue, uuid = args.task
-        return decode_redis(redisClient.hgetall('cppq:' + queue + ':task:' + uuid))
+        return get_task(redisClient, queue, uuid)
+
+    if args.periodic:
+        periodic = {}
+        for prefix in shard_prefixes(redisClient, args.periodic):
+            periodic.update(decode_redis(redisClient.hgetall(prefix + 'periodic:cron')))
+        return periodic
+
+    if args.metrics:
+        return summarize_metrics(get_metrics(redisClient, args.metrics))
+
+    if args.requeue_failed or args.delete_failed:
+        started = time.time()
+
+        def report(done):
+            rate = done['examined'] / max(time.time() - started, 1e-3) * 60
+            print('\r' + str(done['examined']) + '/' + str(done['total']) + ' examined, ' + str(done['matched']) + ' matched, ' +
+                  str(int(rate)) + ' tasks/min', end='', file=sys.stderr, flush=True)
+
+        if args.requeue_failed:
+            done = process_failed(redisClient, args.requeue_failed, 'requeue', args.type, progress=report)
+        else:
+            before_ms = max(int((time.time() - args.older_than) * 1000), 1) if args.older_than is not None else 0
+            done = process_failed(redisClient, args.delete_failed, 'delete', args.type, before_ms, progress=report)
+        print(file=sys.stderr)
+        return done
 
     if args.pause:
-        redisClient.sadd('cppq:queues:paused', args.pause)
+        set_paused(redisClient, args.pause, True)
         return args.pause
 
     if args.unpause:
-        redisClient.srem('cppq:queues:paused', args.unpause)
+        set_paused(redisClient, args.unpause, False)
         return args.unpause
 
 
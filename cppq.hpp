@@ -13,24 +13,142 @@
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <deque>
+#include <tuple>
+#include <new>
+#include <cstddef>
 #include <type_traits>
 #include <utility>
 #include <optional>
 #include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <bitset>
+#include <cctype>
+#include <cmath>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <random>
 
 #include <hiredis/hiredis.h>
+#ifdef CPPQ_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef CPPQ_WITH_ZSTD
+#include <zstd.h>
+#endif
 #include <uuid/uuid.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 namespace cppq {
   using concurrency_t = std::invoke_result_t<decltype(std::thread::hardware_concurrency)>;
 
-  // Retrofitted from https://github.com/bshoshany/thread-pool
+  // Move-only type-erased `void()` callable. Closures up to `inline_capacity` bytes are stored in place,
+  // so submitting a task does not allocate; larger ones fall back to the heap.
+  class task_function {
+    public:
+      static constexpr size_t inline_capacity = 384;
+
+      task_function() = default;
+
+      template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, task_function>>>
+        task_function(F&& f) {
+          using T = std::decay_t<F>;
+          if constexpr (sizeof(T) <= inline_capacity && alignof(T) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<T>) {
+            new (&storage) T(std::forward<F>(f));
+            ops = &inline_ops<T>;
+          } else {
+            *reinterpret_cast<T **>(&storage) = new T(std::forward<F>(f));
+            ops = &heap_ops<T>;
+          }
+        }
+
+      task_function(task_function &&other) noexcept {
+        move_from(other);
+      }
+
+      task_function& operator=(task_function &&other) noexcept {
+        if (this != &other) {
+          reset();
+          move_from(other);
+        }
+        return *this;
+      }
+
+      task_function(const task_function&) = delete;
+      task_function& operator=(const task_function&) = delete;
+
+      ~task_function() {
+        reset();
+      }
+
+      void operator()() {
+        ops->invoke(&storage);
+      }
+
+      explicit operator bool() const {
+        return ops != nullptr;
+      }
+
+    private:
+      struct operations {
+        void (*invoke)(void *);
+        void (*move)(void *, void *);
+        void (*destroy)(void *);
+      };
+
+      template <typename T>
+        static constexpr operations inline_ops = {
+          [](void *s) { (*static_cast<T *>(s))(); },
+          [](void *from, void *to) { new (to) T(std::move(*static_cast<T *>(from))); static_cast<T *>(from)->~T(); },
+          [](void *s) { static_cast<T *>(s)->~T(); }
+        };
+
+      template <typename T>
+        static constexpr operations heap_ops = {
+          [](void *s) { (**static_cast<T **>(s))(); },
+          [](void *from, void *to) { *static_cast<T **>(to) = *static_cast<T **>(from); },
+          [](void *s) { delete *static_cast<T **>(s); }
+        };
+
+      void move_from(task_function &other) {
+        ops = other.ops;
+        if (ops != nullptr) {
+          ops->move(&other.storage, &storage);
+          other.ops = nullptr;
+        }
+      }
+
+      void reset() {
+        if (ops != nullptr) {
+          ops->destroy(&storage);
+          ops = nullptr;
+        }
+      }
+
+      std::aligned_storage_t<inline_capacity, alignof(std::max_align_t)> storage;
+      const operations *ops = nullptr;
+  };
+
+  // Interface retrofitted from https://github.com/bshoshany/thread-pool
+  // Every worker owns a deque: it takes tasks from the front of its own deque and, when that is empty,
+  // steals from the back of the others. Idle workers spin briefly and then park until a task arrives.
   class [[nodiscard]] thread_pool
   {
     public:
       thread_pool(const concurrency_t thread_count_ = 0) :
         thread_count(determine_thread_count(thread_count_)),
-        threads(std::make_unique<std::thread[]>(determine_thread_count(thread_count_))) {
+        threads(std::make_unique<std::thread[]>(determine_thread_count(thread_count_))),
+        queues(std::make_unique<worker_queue[]>(determine_thread_count(thread_count_))) {
           create_threads();
         }
 
@@ -43,35 +161,68 @@ namespace cppq {
         return thread_count;
       }
 
+      [[nodiscard]] size_t get_tasks_total() const {
+        return tasks_total;
+      }
+
+      // Arguments are moved (or copied, for lvalues) into the task once; use std::ref to pass references
       template <typename F, typename... A>
         void push_task(F&& task, A&&... args) {
-          std::function<void()> task_function =
-            std::bind(std::forward<F>(task), std::forward<A>(args)...);
+          task_function task_function_ =
+            [task = std::forward<F>(task), args = std::make_tuple(std::forward<A>(args)...)]() mutable {
+              std::apply(std::move(task), std::move(args));
+            };
+
+          // Workers submitting from inside a task keep it local, other threads spread tasks round-robin
+          concurrency_t index = (current_pool == this) ?
+            current_worker : static_cast<concurrency_t>(next_queue++ % thread_count);
+          ++tasks_total;
           {
-            const std::scoped_lock tasks_lock(tasks_mutex);
-            tasks.push(task_function);
+            const std::scoped_lock queue_lock(queues[index].mutex);
+            queues[index].tasks.push_back(std::move(task_function_));
+          }
+          ++tasks_queued;
+
+          if (sleeping > 0) {
+            { const std::scoped_lock park_lock(park_mutex); }
+            task_available_cv.notify_one();
           }
-          ++tasks_total;
-          task_available_cv.notify_one();
         }
 
       void wait_for_tasks() {
+        std::unique_lock<std::mutex> done_lock(done_mutex);
+        waiting = true;
+        task_done_cv.wait(done_lock, [this] { return (tasks_total == 0); });
+        waiting = false;
+      }
+
+      void wait_for_idle_thread() {
+        std::unique_lock<std::mutex> done_lock(done_mutex);
         waiting = true;
-        std::unique_lock<std::mutex> tasks_lock(tasks_mutex);
-        task_done_cv.wait(tasks_lock, [this] { return (tasks_total == 0); });
+        task_done_cv.wait(done_lock, [this] { return (tasks_total < thread_count); });
         waiting = false;
       }
 
     private:
+      struct worker_queue {
+        std::mutex mutex = {};
+        std::deque<task_function> tasks = {};
+      };
+
+      static constexpr int spin_rounds = 64;
+
       void create_threads() {
         running = true;
         for (concurrency_t i = 0; i < thread_count; ++i) {
-          threads[i] = std::thread(&thread_pool::worker, this);
+          threads[i] = std::thread(&thread_pool::worker, this, i);
         }
       }
 
       void destroy_threads() {
-        running = false;
+        {
+          const std::scoped_lock park_lock(park_mutex);
+          running = false;
+        }
         task_available_cv.notify_all();
         for (concurrency_t i = 0; i < thread_count; ++i) {
           threads[i].join();
@@ -89,32 +240,76 @@ namespace cppq {
         }
       }
 
-      void worker() {
+      bool pop_task(concurrency_t index, task_function &task) {
+        {
+          worker_queue &own = queues[index];
+          const std::scoped_lock queue_lock(own.mutex);
+          if (!own.tasks.empty()) {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            --tasks_queued;
+            return true;
+          }
+        }
+        for (concurrency_t i = 1; i < thread_count; ++i) {
+          worker_queue &victim = queues[(index + i) % thread_count];
+          const std::scoped_lock queue_lock(victim.mutex);
+          if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            --tasks_queued;
+            return true;
+          }
+        }
+        return false;
+      }
+
+      void worker(concurrency_t index) {
+        current_pool = this;
+        current_worker = index;
+        task_function task;
         while (running) {
-          std::function<void()> task;
-          std::unique_lock<std::mutex> tasks_lock(tasks_mutex);
-          task_available_cv.wait(tasks_lock, [this] { return !tasks.empty() || !running; });
-          if (running) {
-            task = std::move(tasks.front());
-            tasks.pop();
-            tasks_lock.unlock();
-            task();
-            tasks_lock.lock();
+          bool found = false;
+          for (int spin = 0; spin < spin_rounds && !found; ++spin) {
+            found = tasks_queued > 0 && pop_task(index, task);
+            if (!found)
+              std::this_thread::yield();
+          }
+
+          if (!found) {
+            std::unique_lock<std::mutex> park_lock(park_mutex);
+            ++sleeping;
+            task_available_cv.wait(park_lock, [this] { return tasks_queued > 0 || !running; });
+            --sleeping;
+            continue;
+          }
+
+          task();
+          task = task_function();
+          {
+            const std::scoped_lock done_lock(done_mutex);
             --tasks_total;
-            if (waiting)
-              task_done_cv.notify_one();
           }
+          if (waiting)
+            task_done_cv.notify_all();
         }
       }
 
+      inline static thread_local thread_pool *current_pool = nullptr;
+      inline static thread_local concurrency_t current_worker = 0;
+
       std::atomic<bool> running = false;
       std::condition_variable task_available_cv = {};
       std::condition_variable task_done_cv = {};
-      std::queue<std::function<void()>> tasks = {};
       std::atomic<size_t> tasks_total = 0;
-      mutable std::mutex tasks_mutex = {};
+      std::atomic<size_t> tasks_queued = 0;
+      std::atomic<size_t> sleeping = 0;
+      std::atomic<size_t> next_queue = 0;
+      mutable std::mutex park_mutex = {};
+      mutable std::mutex done_mutex = {};
       concurrency_t thread_count = 0;
       std::unique_ptr<std::thread[]> threads = nullptr;
+      std::unique_ptr<worker_queue[]> queues = nullptr;
       std::atomic<bool> waiting = false;
   };
 
@@ -149,12 +344,49 @@ namespace cppq {
     return TaskState::Unknown;
   }
 
-  std::string uuidToString(uuid_t uuid) {
+  std::string uuidToString(const uuid_t uuid) {
     char uuid_str[37];
     uuid_unparse_lower(uuid, uuid_str);
     return uuid_str;
   }
 
+  enum class TaskEncoding {
+    // One hash per task with a text field per attribute
+    Hash,
+    // One binary string per task, see encodeTask()
+    Compact
+  };
+
+  // Compact record layout, all integers little-endian:
+  // u8 version, u8 state, u8 flags (payload codec in the low nibble, result codec in the high one), u8 reserved,
+  // u64 maxRetry, u64 retried, u64 dequeuedAtMs, u64 schedule, u64 finishedAtMs (since version 2),
+  // u64 enqueuedAtMs (since version 3), then type, payload, cron and result, each as a u32 length followed by that many bytes
+  const uint8_t taskRecordVersion = 3;
+
+  // Byte offsets of the header fields, shared with the admin tools in cli/cppq_admin.py
+  const size_t taskRecordMaxRetryOffset = 4;
+  const size_t taskRecordRetriedOffset = 12;
+  const size_t taskRecordDequeuedAtOffset = 20;
+  const size_t taskRecordScheduleOffset = 28;
+  const size_t taskRecordFinishedAtOffset = 36;
+  const size_t taskRecordEnqueuedAtOffset = 44;
+
+  size_t taskRecordHeaderSize(uint8_t version) {
+    return 4 + (version + 3) * 8;
+  }
+
+  void appendUInt(std::string &out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++)
+      out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+
+  uint64_t readUInt(const std::string &in, size_t offset, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++)
+      value |= static_cast<uint64_t>(static_cast<uint8_t>(in[offset + i])) << (8 * i);
+    return value;
+  }
+
   class Task {
     public:
       Task(std::string type, std::string payload, uint64_t maxRetry) {
@@ -165,6 +397,43 @@ namespace cppq {
         this->maxRetry = maxRetry;
         this->retried = 0;
         this->dequeuedAtMs = 0;
+        this->schedule = 0;
+        this->finishedAtMs = 0;
+        this->enqueuedAtMs = 0;
+        this->payloadCodec = 0;
+        this->resultCodec = 0;
+      }
+
+      // Decodes a compact task record, see encodeTask()
+      Task(std::string uuid, const std::string &record) {
+        uint8_t version = record.empty() ? 0 : static_cast<uint8_t>(record[0]);
+        if (version < 1 || version > taskRecordVersion || record.size() < taskRecordHeaderSize(version))
+          throw std::runtime_error("Unsupported task record");
+
+        // Periodic definitions are stored under arbitrary ids
+        if (uuid_parse(uuid.c_str(), this->uuid) != 0)
+          uuid_clear(this->uuid);
+        this->state = static_cast<TaskState>(static_cast<uint8_t>(record[1]));
+        this->payloadCodec = static_cast<uint8_t>(record[2]) & 0x0f;
+        this->resultCodec = static_cast<uint8_t>(record[2]) >> 4;
+        this->maxRetry = readUInt(record, taskRecordMaxRetryOffset, 8);
+        this->retried = readUInt(record, taskRecordRetriedOffset, 8);
+        this->dequeuedAtMs = readUInt(record, taskRecordDequeuedAtOffset, 8);
+        this->schedule = readUInt(record, taskRecordScheduleOffset, 8);
+        this->finishedAtMs = version < 2 ? 0 : readUInt(record, taskRecordFinishedAtOffset, 8);
+        this->enqueuedAtMs = version < 3 ? 0 : readUInt(record, taskRecordEnqueuedAtOffset, 8);
+
+        size_t offset = taskRecordHeaderSize(version);
+        for (std::string *field : { &this->type, &this->payload, &this->cron, &this->result }) {
+          if (offset + 4 > record.size())
+            throw std::runtime_error("Truncated task record");
+          size_t length = readUInt(record, offset, 4);
+          offset += 4;
+          if (offset + length > record.size())
+            throw std::runtime_error("Truncated task record");
+          field->assign(record, offset, length);
+          offset += length;
+        }
       }
 
       Task(
@@ -176,7 +445,8 @@ namespace cppq {
           uint64_t retried,
           uint64_t dequeuedAtMs,
           uint64_t schedule = 0,
-          std::string cron = ""
+          std::string cron = "",
+          uint8_t payloadCodec = 0
           ) {
         uuid_t uuid_parsed;
         uuid_parse(uuid.c_str(), uuid_parsed);
@@ -189,6 +459,10 @@ namespace cppq {
         this->state = stringToState(state);
         this->schedule = schedule;
         this->cron = cron;
+        this->payloadCodec = payloadCodec;
+        this->resultCodec = 0;
+        this->finishedAtMs = 0;
+        this->enqueuedAtMs = 0;
       }
 
       uuid_t uuid;
@@ -201,358 +475,5235 @@ namespace cppq {
       uint64_t schedule;
       std::string cron;
       std::string result;
+      // When the task was acknowledged as completed or failed, 0 before that
+      uint64_t finishedAtMs;
+      // When the task was last put on pending (or scheduled), 0 for tasks enqueued by older versions
+      uint64_t enqueuedAtMs;
+      // Codec ids of payload and result, 0 when stored as is, see Codec
+      uint8_t payloadCodec;
+      uint8_t resultCodec;
   };
 
-  using Handler = void (*)(Task&);
-  auto handlers = std::unordered_map<std::string, Handler>();
-
-  void registerHandler(std::string type, Handler handler) {
-    handlers[type] = handler;
+  // Encodes `task` with `payload` stored in place of its own, so that enqueue can store a compressed copy
+  std::string encodeTask(const Task &task, const std::string &payload, uint8_t payloadCodec) {
+    std::string record;
+    record.reserve(taskRecordHeaderSize(taskRecordVersion) + 16 + task.type.size() + payload.size() + task.cron.size() + task.result.size());
+    appendUInt(record, taskRecordVersion, 1);
+    appendUInt(record, static_cast<uint8_t>(task.state), 1);
+    appendUInt(record, (payloadCodec & 0x0f) | (task.resultCodec << 4), 1);
+    appendUInt(record, 0, 1);
+    appendUInt(record, task.maxRetry, 8);
+    appendUInt(record, task.retried, 8);
+    appendUInt(record, task.dequeuedAtMs, 8);
+    appendUInt(record, task.schedule, 8);
+    appendUInt(record, task.finishedAtMs, 8);
+    appendUInt(record, task.enqueuedAtMs, 8);
+    for (const std::string *field : { &task.type, &payload, &task.cron, &task.result }) {
+      appendUInt(record, field->size(), 4);
+      record.append(*field);
+    }
+    return record;
   }
 
-  typedef enum { Cron, TimePoint, None } ScheduleType;
+  std::string encodeTask(const Task &task) {
+    return encodeTask(task, task.payload, task.payloadCodec);
+  }
 
-  typedef struct ScheduleOptions {
-    union {
-      const char *cron;
-      std::chrono::system_clock::time_point time;
-    };
-    ScheduleType type;
-  } ScheduleOptions;
+  // How enqueue writes new tasks. Both encodings can coexist in a queue, see migrateTaskEncoding()
+  TaskEncoding taskEncoding = TaskEncoding::Hash;
 
-  ScheduleOptions scheduleOptions(std::chrono::system_clock::time_point t) {
-    return ScheduleOptions{ .time = t, .type = ScheduleType::TimePoint };
+  void setTaskEncoding(TaskEncoding encoding) {
+    taskEncoding = encoding;
   }
 
-  ScheduleOptions scheduleOptions(std::string c) {
-    return ScheduleOptions{ .cron = c.c_str(), .type = ScheduleType::Cron };
-  }
+  // Compresses payloads and results. Implementations must be thread-safe, workers share them.
+  class Codec {
+    public:
+      virtual ~Codec() = default;
+      // Stored in the task record, 1-15
+      virtual uint8_t id() const = 0;
+      virtual std::string name() const = 0;
+      virtual std::string compress(const std::string &data) const = 0;
+      // Throws std::runtime_error on malformed input
+      virtual std::string decompress(const std::string &data) const = 0;
+  };
 
-  void enqueue(redisContext *c, Task task, std::string queue, ScheduleOptions s) {
-    if (s.type == ScheduleType::None)
-      task.state = TaskState::Pending;
-    else
-      task.state = TaskState::Scheduled;
+  const uint8_t codecNone = 0;
+  const uint8_t codecLZ4 = 1;
+  const uint8_t codecZstd = 2;
 
-    redisCommand(c, "MULTI");
-    if (s.type == ScheduleType::None) {
-      redisCommand(c, "LPUSH cppq:%s:pending %s", queue.c_str(), uuidToString(task.uuid).c_str());
-      redisCommand(
-          c,
-          "HSET cppq:%s:task:%s type %s payload %s state %s maxRetry %d retried %d dequeuedAtMs %d",
-          queue.c_str(),
-          uuidToString(task.uuid).c_str(),
-          task.type.c_str(),
-          task.payload.c_str(),
-          stateToString(task.state).c_str(),
-          task.maxRetry,
-          task.retried,
-          task.dequeuedAtMs
-          );
-    } else if (s.type == ScheduleType::TimePoint) {
-      redisCommand(c, "LPUSH cppq:%s:scheduled %s", queue.c_str(), uuidToString(task.uuid).c_str());
-      redisCommand(
-          c,
-          "HSET cppq:%s:task:%s type %s payload %s state %s maxRetry %d retried %d dequeuedAtMs %d schedule %lu",
-          queue.c_str(),
-          uuidToString(task.uuid).c_str(),
-          task.type.c_str(),
-          task.payload.c_str(),
-          stateToString(task.state).c_str(),
-          task.maxRetry,
-          task.retried,
-          task.dequeuedAtMs,
-          std::chrono::duration_cast<std::chrono::milliseconds>(s.time.time_since_epoch()).count()
-          );
-    } else if (s.type == ScheduleType::Cron) {
-      redisCommand(c, "LPUSH cppq:%s:scheduled %s", queue.c_str(), uuidToString(task.uuid).c_str());
-      redisCommand(
-          c,
-          "HSET cppq:%s:task:%s type %s payload %s state %s maxRetry %d retried %d dequeuedAtMs %d cron %s",
-          queue.c_str(),
-          uuidToString(task.uuid).c_str(),
-          task.type.c_str(),
-          task.payload.c_str(),
-          stateToString(task.state).c_str(),
-          task.maxRetry,
-          task.retried,
-          task.dequeuedAtMs,
-          s.cron
-          );
-    }
-    redisReply *reply = (redisReply *)redisCommand(c, "EXEC");
+#ifdef CPPQ_WITH_LZ4
+  // LZ4 block prefixed with the u32 little-endian uncompressed size
+  class LZ4Codec : public Codec {
+    public:
+      uint8_t id() const override { return codecLZ4; }
+      std::string name() const override { return "lz4"; }
 
-    if (reply->type == REDIS_REPLY_ERROR)
-      throw std::runtime_error("Failed to enqueue task");
+      std::string compress(const std::string &data) const override {
+        if (data.size() > LZ4_MAX_INPUT_SIZE)
+          throw std::runtime_error("Input too large for LZ4");
+        std::string out;
+        appendUInt(out, data.size(), 4);
+        out.resize(4 + LZ4_compressBound(data.size()));
+        int written = LZ4_compress_default(data.data(), out.data() + 4, data.size(), out.size() - 4);
+        if (written <= 0)
+          throw std::runtime_error("Failed to compress with LZ4");
+        out.resize(4 + written);
+        return out;
+      }
+
+      std::string decompress(const std::string &data) const override {
+        if (data.size() < 4)
+          throw std::runtime_error("Truncated LZ4 data");
+        std::string out(readUInt(data, 0, 4), '\0');
+        int read = LZ4_decompress_safe(data.data() + 4, out.data(), data.size() - 4, out.size());
+        if (read < 0 || static_cast<size_t>(read) != out.size())
+          throw std::runtime_error("Malformed LZ4 data");
+        return out;
+      }
+  };
+#endif
+
+#ifdef CPPQ_WITH_ZSTD
+  // Single zstd frame, which records its own content size
+  class ZstdCodec : public Codec {
+    public:
+      ZstdCodec(int level = 3) : level(level) {}
+
+      uint8_t id() const override { return codecZstd; }
+      std::string name() const override { return "zstd"; }
+
+      std::string compress(const std::string &data) const override {
+        std::string out(ZSTD_compressBound(data.size()), '\0');
+        size_t written = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), level);
+        if (ZSTD_isError(written))
+          throw std::runtime_error("Failed to compress with zstd");
+        out.resize(written);
+        return out;
+      }
+
+      std::string decompress(const std::string &data) const override {
+        unsigned long long size = ZSTD_getFrameContentSize(data.data(), data.size());
+        if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+          throw std::runtime_error("Malformed zstd data");
+        std::string out(size, '\0');
+        size_t read = ZSTD_decompress(out.data(), out.size(), data.data(), data.size());
+        if (ZSTD_isError(read) || read != size)
+          throw std::runtime_error("Malformed zstd data");
+        return out;
+      }
+
+    private:
+      int level;
+  };
+#endif
+
+  std::map<uint8_t, std::shared_ptr<Codec>> defaultCodecs() {
+    std::map<uint8_t, std::shared_ptr<Codec>> codecs;
+#ifdef CPPQ_WITH_LZ4
+    codecs[codecLZ4] = std::make_shared<LZ4Codec>();
+#endif
+#ifdef CPPQ_WITH_ZSTD
+    codecs[codecZstd] = std::make_shared<ZstdCodec>();
+#endif
+    return codecs;
   }
 
-  void enqueue(redisContext *c, Task task, std::string queue) {
-    return enqueue(c, task, queue, ScheduleOptions{ .cron = "", .type = ScheduleType::None });
+  auto codecs = defaultCodecs();
+
+  // Makes a custom codec available for compression and decompression, register before enqueueing or serving
+  void registerCodec(std::shared_ptr<Codec> codec) {
+    if (codec->id() == codecNone || codec->id() > 0x0f)
+      throw std::runtime_error("Codec id must be between 1 and 15");
+    codecs[codec->id()] = codec;
   }
 
-  std::optional<Task> dequeue(redisContext *c, std::string queue) {
-    redisReply *reply = (redisReply *)redisCommand(c, "LRANGE cppq:%s:pending -1 -1", queue.c_str());
-    if (reply->type != REDIS_REPLY_ARRAY)
+  typedef struct CompressionOptions {
+    // codecNone disables compression
+    uint8_t codec = codecNone;
+    // Payloads and results shorter than this are stored as is
+    size_t threshold = 4096;
+  } CompressionOptions;
+
+  CompressionOptions compressionOptions;
+
+  // Compresses payloads on enqueue and results on completion with `codec` once they reach `threshold` bytes.
+  // Readers decompress according to the codec recorded with each task, so this can change at any time.
+  void setCompression(uint8_t codec, size_t threshold = 4096) {
+    if (codec != codecNone && codecs.find(codec) == codecs.end())
+      throw std::runtime_error("Unknown codec " + std::to_string(codec));
+    compressionOptions = CompressionOptions{ codec, threshold };
+  }
+
+  // Returns the compressed data and sets `codec` if compression is enabled, `data` is large enough,
+  // and compression actually saves space
+  std::optional<std::string> compress(const std::string &data, uint8_t &codec) {
+    if (compressionOptions.codec == codecNone || data.size() < compressionOptions.threshold)
+      return {};
+    auto it = codecs.find(compressionOptions.codec);
+    if (it == codecs.end())
       return {};
-    if (reply->elements == 0)
+    std::string compressed = it->second->compress(data);
+    if (compressed.size() >= data.size())
       return {};
-    reply = reply->element[0];
-    std::string uuid = reply->str;
+    codec = it->first;
+    return compressed;
+  }
 
-    uint64_t dequeuedAtMs =
-      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  std::string decompress(uint8_t codec, const std::string &data) {
+    if (codec == codecNone)
+      return data;
+    auto it = codecs.find(codec);
+    if (it == codecs.end())
+      throw std::runtime_error("Unknown codec " + std::to_string(codec));
+    return it->second->decompress(data);
+  }
 
-    redisCommand(c, "MULTI");
-    redisCommand(c, "LREM cppq:%s:pending 1 %s", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s type", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s payload", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s state", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s maxRetry", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s retried", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s dequeuedAtMs", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HSET cppq:%s:task:%s dequeuedAtMs %lu", queue.c_str(), uuid.c_str(), dequeuedAtMs);
-    redisCommand(c, "HSET cppq:%s:task:%s state %s", queue.c_str(), uuid.c_str(), stateToString(TaskState::Active).c_str());
-    redisCommand(c, "LPUSH cppq:%s:active %s", queue.c_str(), uuid.c_str());
-    reply = (redisReply *)redisCommand(c, "EXEC");
-
-    if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 10)
-      return {};
+  // Decompresses the payload in place, once, workers call this right before the handler
+  void decompressPayload(Task &task) {
+    if (task.payloadCodec == codecNone)
+      return;
+    task.payload = decompress(task.payloadCodec, task.payload);
+    task.payloadCodec = codecNone;
+  }
 
-    Task task = Task(
-        uuid,
-        reply->element[1]->str,
-        reply->element[2]->str,
-        stateToString(TaskState::Active),
-        strtoull(reply->element[4]->str, NULL, 0),
-        strtoull(reply->element[5]->str, NULL, 0),
-        dequeuedAtMs
-        );
+  using Handler = void (*)(Task&);
+  auto handlers = std::unordered_map<std::string, Handler>();
 
-    return std::make_optional<Task>(task);
+  void registerHandler(std::string type, Handler handler) {
+    handlers[type] = handler;
   }
 
-  std::optional<Task> dequeueScheduled(redisContext *c, std::string queue, char *getScheduledScriptSHA) {
-    redisReply *reply = (redisReply *)redisCommand(c, "EVALSHA %s 0 %s", getScheduledScriptSHA, queue.c_str());
-    if (reply->type != REDIS_REPLY_STRING)
-      return {};
-    std::string uuid = reply->str;
+  // How the failures of a task type are retried: the n-th retry is due initialDelay * multiplier^(n - 1) after the
+  // failure, at most maxDelay, give or take `jitter` of it so that tasks failing together do not retry together.
+  // Delayed retries wait in the scheduled set, so they take neither a worker nor Redis round trips until they are due.
+  typedef struct RetryPolicy {
+    // Zero retries right away
+    std::chrono::milliseconds initialDelay = std::chrono::milliseconds(0);
+    double multiplier = 2;
+    std::chrono::milliseconds maxDelay = std::chrono::hours(1);
+    double jitter = 0.2;
+    // Failures this returns false for fail the task for good, unset retries every exception. See retryOnly().
+    std::function<bool(const std::exception &)> retryOn = nullptr;
+  } RetryPolicy;
 
-    uint64_t dequeuedAtMs =
-      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  // RetryPolicy::retryOn that only retries the given exception types and types derived from them
+  template <typename... Exceptions>
+  std::function<bool(const std::exception &)> retryOnly() {
+    return [](const std::exception &e) {
+      return ((dynamic_cast<const Exceptions *>(&e) != nullptr) || ...);
+    };
+  }
 
-    redisCommand(c, "MULTI");
-    redisCommand(c, "LREM cppq:%s:scheduled 1 %s", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s type", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s payload", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s state", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s maxRetry", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s retried", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s dequeuedAtMs", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HGET cppq:%s:task:%s schedule", queue.c_str(), uuid.c_str());
-    redisCommand(c, "HSET cppq:%s:task:%s dequeuedAtMs %lu", queue.c_str(), uuid.c_str(), dequeuedAtMs);
-    redisCommand(c, "HSET cppq:%s:task:%s state %s", queue.c_str(), uuid.c_str(), stateToString(TaskState::Active).c_str());
-    redisCommand(c, "LPUSH cppq:%s:active %s", queue.c_str(), uuid.c_str());
-    reply = (redisReply *)redisCommand(c, "EXEC");
-
-    if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 11)
-      return {};
+  auto retryPolicies = std::unordered_map<std::string, RetryPolicy>();
+  // Of task types without a policy of their own
+  RetryPolicy defaultRetryPolicy;
 
-    Task task = Task(
-        uuid,
-        reply->element[1]->str,
-        reply->element[2]->str,
-        stateToString(TaskState::Active),
-        strtoull(reply->element[4]->str, NULL, 0),
-        strtoull(reply->element[5]->str, NULL, 0),
-        dequeuedAtMs,
-        strtoull(reply->element[6]->str, NULL, 0)
-        );
+  void registerRetryPolicy(std::string type, RetryPolicy policy) {
+    retryPolicies[type] = policy;
+  }
 
-    return std::make_optional<Task>(task);
+  void setDefaultRetryPolicy(RetryPolicy policy) {
+    defaultRetryPolicy = policy;
   }
 
-  void taskRunner(redisOptions redisOpts, Task task, std::string queue) {
-    redisContext *c = redisConnectWithOptions(&redisOpts);
-    if (c == NULL || c->err) {
-      std::cerr << "Failed to connect to Redis" << std::endl;
-      return;
+  const RetryPolicy &retryPolicyFor(const std::string &type) {
+    auto it = retryPolicies.find(type);
+    return it == retryPolicies.end() ? defaultRetryPolicy : it->second;
+  }
+
+  // Delay before retry number `retried` (1 for the first) under `policy`
+  std::chrono::milliseconds retryDelay(const RetryPolicy &policy, uint64_t retried) {
+    if (policy.initialDelay.count() <= 0)
+      return std::chrono::milliseconds(0);
+    double delay = std::min<double>(
+        policy.initialDelay.count() * std::pow(policy.multiplier, std::max<uint64_t>(retried, 1) - 1),
+        policy.maxDelay.count()
+        );
+    if (policy.jitter > 0) {
+      thread_local std::mt19937_64 random(std::random_device{}());
+      delay *= std::uniform_real_distribution<double>(1 - policy.jitter, 1 + policy.jitter)(random);
     }
+    return std::chrono::milliseconds(static_cast<int64_t>(std::max(delay, 0.0)));
+  }
 
-    Handler handler = handlers[task.type];
+  // Days since 1970-01-01 of a proleptic Gregorian date, month 1-12
+  int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int64_t>(doe) - 719468;
+  }
 
-    try {
-      handler(task);
-    } catch(const std::exception &e) {
-      task.retried++;
-      redisCommand(c, "MULTI");
-      redisCommand(c, "LREM cppq:%s:active 1 %s", queue.c_str(), uuidToString(task.uuid).c_str());
-      redisCommand(c, "HSET cppq:%s:task:%s retried %d", queue.c_str(), uuidToString(task.uuid).c_str(), task.retried);
-      if (task.retried >= task.maxRetry) {
-        task.state = TaskState::Failed;
-        redisCommand(
-            c,
-            "HSET cppq:%s:task:%s state %s",
-            queue.c_str(),
-            uuidToString(task.uuid).c_str(),
-            stateToString(task.state).c_str()
-            );
-        redisCommand(c, "LPUSH cppq:%s:failed %s", queue.c_str(), uuidToString(task.uuid).c_str());
-      } else {
-        task.state = TaskState::Pending;
-        redisCommand(
-            c,
-            "HSET cppq:%s:task:%s state %s",
-            queue.c_str(),
-            uuidToString(task.uuid).c_str(),
-            stateToString(task.state).c_str()
-            );
-        redisCommand(c, "LPUSH cppq:%s:pending %s", queue.c_str(), uuidToString(task.uuid).c_str());
+  void civilFromDays(int64_t z, int64_t &y, unsigned &m, unsigned &d) {
+    z += 719468;
+    const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    const unsigned doe = static_cast<unsigned>(z - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = static_cast<int64_t>(yoe) + era * 400 + (m <= 2);
+  }
+
+  // A cron expression parsed once into bitsets, evaluated in UTC. Takes 5 fields (minute, hour, day of month,
+  // month, day of week) or 6 with leading seconds; `*`, lists, ranges, `/` steps, month and weekday names, and
+  // the @yearly, @monthly, @weekly, @daily and @hourly macros. When both day fields are restricted, a day
+  // matching either one fires, as in Vixie cron.
+  class CronExpression {
+    public:
+      CronExpression(const std::string &expression) {
+        std::string normalized = expression;
+        if (expression == "@yearly" || expression == "@annually")
+          normalized = "0 0 1 1 *";
+        else if (expression == "@monthly")
+          normalized = "0 0 1 * *";
+        else if (expression == "@weekly")
+          normalized = "0 0 * * 0";
+        else if (expression == "@daily" || expression == "@midnight")
+          normalized = "0 0 * * *";
+        else if (expression == "@hourly")
+          normalized = "0 * * * *";
+
+        std::vector<std::string> fields;
+        std::istringstream stream(normalized);
+        for (std::string field; stream >> field;)
+          fields.push_back(field);
+        if (fields.size() == 5)
+          fields.insert(fields.begin(), "0");
+        if (fields.size() != 6)
+          throw std::runtime_error("Cron expression must have 5 or 6 fields: " + expression);
+
+        static const std::vector<std::string> monthNames =
+          { "jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec" };
+        static const std::vector<std::string> dayNames = { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
+
+        seconds = parseField(fields[0], 0, 59, {}, 0);
+        minutes = parseField(fields[1], 0, 59, {}, 0);
+        hours = parseField(fields[2], 0, 23, {}, 0);
+        daysOfMonth = parseField(fields[3], 1, 31, {}, 0);
+        months = parseField(fields[4], 1, 12, monthNames, 1);
+        daysOfWeek = parseField(fields[5], 0, 7, dayNames, 0);
+        // 7 is another name for Sunday
+        if (daysOfWeek.test(7))
+          daysOfWeek.set(0);
+        daysOfWeek.reset(7);
+        anyDayOfMonth = fields[3][0] == '*' || fields[3][0] == '?';
+        anyDayOfWeek = fields[5][0] == '*' || fields[5][0] == '?';
       }
-      redisCommand(c, "EXEC");
-      redisFree(c);
-      return;
-    }
 
-    task.state = TaskState::Completed;
-    redisCommand(c, "MULTI");
-    redisCommand(c, "LREM cppq:%s:active 1 %s", queue.c_str(), uuidToString(task.uuid).c_str());
-    redisCommand(
-        c,
-        "HSET cppq:%s:task:%s state %s",
-        queue.c_str(),
-        uuidToString(task.uuid).c_str(),
-        stateToString(task.state).c_str()
-        );
-    redisCommand(
-        c,
-        "HSET cppq:%s:task:%s result %s",
-        queue.c_str(),
-        uuidToString(task.uuid).c_str(),
-        task.result.c_str()
-        );
-    redisCommand(c, "LPUSH cppq:%s:completed %s", queue.c_str(), uuidToString(task.uuid).c_str());
-    redisCommand(c, "EXEC");
-    redisFree(c);
-  }
+      // First fire time strictly after `afterSec` (seconds since the epoch), none if it does not fire within 5 years
+      std::optional<int64_t> next(int64_t afterSec) const {
+        int64_t t = afterSec + 1;
+        int64_t days = t >= 0 ? t / 86400 : (t - 86399) / 86400;
+        int64_t secondOfDay = t - days * 86400;
+        for (int i = 0; i < 366 * 5; i++) {
+          int64_t y;
+          unsigned m, d;
+          civilFromDays(days, y, m, d);
+          if (!months.test(m)) {
+            days = m == 12 ? daysFromCivil(y + 1, 1, 1) : daysFromCivil(y, m + 1, 1);
+            secondOfDay = 0;
+            continue;
+          }
+          if (dayMatches(days, d)) {
+            std::optional<int64_t> time = nextTimeOfDay(secondOfDay);
+            if (time.has_value())
+              return days * 86400 + time.value();
+          }
+          days++;
+          secondOfDay = 0;
+        }
+        return {};
+      }
 
-  void recovery(redisOptions redisOpts, std::map<std::string, int> queues, uint64_t timeoutMs, uint64_t checkEveryMs) {
-    redisContext *c = redisConnectWithOptions(&redisOpts);
-    if (c == NULL || c->err) {
-      std::cerr << "Failed to connect to Redis" << std::endl;
-      return;
-    }
+      std::bitset<64> seconds, minutes, hours, daysOfMonth, months, daysOfWeek;
+      bool anyDayOfMonth, anyDayOfWeek;
 
-    // TODO: Consider incrementing `retried` on recovery
-    while (true) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(checkEveryMs));
-      for (std::map<std::string, int>::iterator it = queues.begin(); it != queues.end(); it++) {
-        redisReply *reply = (redisReply *)redisCommand(c, "LRANGE cppq:%s:active 0 -1", it->first.c_str());
-        for (int i = 0; i < reply->elements; i++) {
-          std::string uuid = reply->element[i]->str;
-          redisReply *dequeuedAtMsReply = (redisReply *)redisCommand(
-              c,
-              "HGET cppq:%s:task:%s dequeuedAtMs",
-              it->first.c_str(),
-              uuid.c_str()
-              );
-          redisReply *scheduleReply = (redisReply *)redisCommand(
-              c,
-              "HGET cppq:%s:task:%s schedule",
-              it->first.c_str(),
-              uuid.c_str()
-              );
-          uint64_t dequeuedAtMs = strtoull(dequeuedAtMsReply->str, NULL, 0);
-          if (
-              dequeuedAtMs + timeoutMs <
-              std::chrono::duration_cast<std::chrono::milliseconds>(
-                std::chrono::system_clock::now().time_since_epoch()
-                ).count()
-             ) {
-            redisCommand(c, "MULTI");
-            redisCommand(c, "LREM cppq:%s:active 1 %s", it->first.c_str(), uuid.c_str());
-            redisCommand(
-                c,
-                "HSET cppq:%s:task:%s state %s",
-                it->first.c_str(),
-                uuid.c_str(),
-                stateToString(TaskState::Pending).c_str()
-                );
-            if (scheduleReply->type == REDIS_REPLY_NIL)
-              redisCommand(c, "LPUSH cppq:%s:pending %s", it->first.c_str(), uuid.c_str());
-            else
-              redisCommand(c, "LPUSH cppq:%s:scheduled %s", it->first.c_str(), uuid.c_str());
-            redisCommand(c, "EXEC");
+    private:
+      static int parseValue(const std::string &value, const std::vector<std::string> &names, int nameOffset) {
+        std::string lower;
+        for (char ch : value)
+          lower.push_back(std::tolower(static_cast<unsigned char>(ch)));
+        for (size_t i = 0; i < names.size(); i++)
+          if (lower == names[i])
+            return i + nameOffset;
+        if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+          throw std::runtime_error("Invalid cron value: " + value);
+        return std::stoi(value);
+      }
+
+      static std::bitset<64> parseField(
+          const std::string &field,
+          int min,
+          int max,
+          const std::vector<std::string> &names,
+          int nameOffset
+          ) {
+        std::bitset<64> bits;
+        std::istringstream stream(field);
+        for (std::string part; std::getline(stream, part, ',');) {
+          int step = 1;
+          size_t slash = part.find('/');
+          if (slash != std::string::npos) {
+            step = parseValue(part.substr(slash + 1), {}, 0);
+            part = part.substr(0, slash);
+            if (step <= 0)
+              throw std::runtime_error("Invalid cron step in: " + field);
+          }
+          int from, to;
+          size_t dash = part.find('-');
+          if (part == "*" || part == "?") {
+            from = min;
+            to = max;
+          } else if (dash != std::string::npos) {
+            from = parseValue(part.substr(0, dash), names, nameOffset);
+            to = parseValue(part.substr(dash + 1), names, nameOffset);
+          } else {
+            from = parseValue(part, names, nameOffset);
+            to = slash == std::string::npos ? from : max;
           }
+          if (from < min || to > max || from > to)
+            throw std::runtime_error("Cron field out of range: " + field);
+          for (int i = from; i <= to; i += step)
+            bits.set(i);
         }
+        return bits;
       }
-    }
+
+      bool dayMatches(int64_t days, unsigned dayOfMonth) const {
+        // 1970-01-01 was a Thursday
+        int weekday = static_cast<int>(((days % 7) + 11) % 7);
+        bool domMatches = daysOfMonth.test(dayOfMonth);
+        bool dowMatches = daysOfWeek.test(weekday);
+        if (!anyDayOfMonth && !anyDayOfWeek)
+          return domMatches || dowMatches;
+        return domMatches && dowMatches;
+      }
+
+      std::optional<int64_t> nextTimeOfDay(int64_t from) const {
+        int fromHour = from / 3600, fromMinute = (from / 60) % 60, fromSecond = from % 60;
+        for (int h = fromHour; h < 24; h++) {
+          if (!hours.test(h))
+            continue;
+          for (int m = h == fromHour ? fromMinute : 0; m < 60; m++) {
+            if (!minutes.test(m))
+              continue;
+            for (int s = h == fromHour && m == fromMinute ? fromSecond : 0; s < 60; s++)
+              if (seconds.test(s))
+                return h * 3600 + m * 60 + s;
+          }
+        }
+        return {};
+      }
+  };
+
+  typedef enum { Cron, TimePoint, None } ScheduleType;
+
+  typedef struct ScheduleOptions {
+    std::string cron;
+    std::chrono::system_clock::time_point time;
+    ScheduleType type;
+  } ScheduleOptions;
+
+  ScheduleOptions scheduleOptions(std::chrono::system_clock::time_point t) {
+    return ScheduleOptions{ .time = t, .type = ScheduleType::TimePoint };
   }
 
-  void pause(redisContext *c, std::string queue) {
-    redisCommand(c, "SADD cppq:queues:paused %s", queue.c_str());
+  // Throws std::runtime_error if `c` is not a valid cron expression
+  ScheduleOptions scheduleOptions(std::string c) {
+    CronExpression expression(c);
+    return ScheduleOptions{ .cron = std::move(c), .type = ScheduleType::Cron };
   }
 
-  void unpause(redisContext *c, std::string queue) {
-    redisCommand(c, "SREM cppq:queues:paused %s", queue.c_str());
+  enum class KeyNaming {
+    // cppq:<queue>:pending
+    Plain,
+    // cppq:{<queue>}:pending, the hash tag maps every key of a queue to one Redis Cluster slot as its scripts and
+    // transactions require, while different queues (and shards of one queue) spread over the cluster
+    HashTagged
+  };
+
+  // How queue keys are named. Set it the same way in producers and servers, before any other call.
+  KeyNaming keyNaming = KeyNaming::Plain;
+
+  void setKeyNaming(KeyNaming naming) {
+    keyNaming = naming;
   }
 
-  bool isPaused(redisContext *c, std::string queue) {
-    redisReply *reply = (redisReply *)redisCommand(c, "SMEMBERS cppq:queues:paused");
-    for (int i = 0; i < reply->elements; i++)
-      if (queue == reply->element[i]->str)
-        return true;
-    return false;
+  std::string queuePrefix(const std::string &queue) {
+    return keyNaming == KeyNaming::HashTagged ? "cppq:{" + queue + "}:" : "cppq:" + queue + ":";
   }
 
-  const char *getScheduledScript = R"DOC(
-    local timeCall = redis.call('time')
-    local time = timeCall[1] .. timeCall[2]
-    local scheduled = redis.call('LRANGE',  'cppq:' .. ARGV[1] .. ':scheduled', 0, -1)
-    for _, key in ipairs(scheduled) do
-      if (time > redis.call('HGET', 'cppq:' .. ARGV[1] .. ':task:' .. key, 'schedule')) then
-        return key
-      end
-    end)DOC";
+  std::string queueKey(const std::string &queue, const std::string &suffix) {
+    return queuePrefix(queue) + suffix;
+  }
 
-  void runServer(redisOptions redisOpts, std::map<std::string, int> queues, uint64_t recoveryTimeoutSecond) {
-    redisContext *c = redisConnectWithOptions(&redisOpts);
-    if (c == NULL || c->err) {
-      std::cerr << "Failed to connect to Redis" << std::endl;
-      return;
-    }
+  typedef struct Sharding {
+    // Number of physical queues, named <queue>#0 to <queue>#<shards - 1>, that the logical queue is split into
+    size_t shards = 1;
+    // Tasks with the same key go to the same shard, tasks are spread round-robin when unset
+    std::function<std::string(const Task&)> key = nullptr;
+  } Sharding;
 
-    redisReply *reply = (redisReply *)redisCommand(c, "SCRIPT LOAD %s", getScheduledScript);
-    char *getScheduledScriptSHA = reply->str;
+  // Sharded queues and their round-robin cursors
+  class ShardedQueue {
+    public:
+      ShardedQueue(Sharding sharding) : sharding(std::move(sharding)) {}
 
-    std::vector<std::pair<std::string, int>> queuesVector;
-    for (auto& it : queues) queuesVector.push_back(it);
-    sort(
-        queuesVector.begin(),
-        queuesVector.end(),
-        [](std::pair<std::string, int> const& a, std::pair<std::string, int> const& b) { return a.second > b.second; }
-        );
+      Sharding sharding;
+      std::atomic<size_t> next = 0;
+  };
 
-    for (auto it = queuesVector.begin(); it != queuesVector.end(); it++)
-      redisCommand(c, "SADD cppq:queues %s:%d", it->first.c_str(), it->second);
+  std::map<std::string, std::unique_ptr<ShardedQueue>> queueShardings;
 
-    thread_pool pool;
-    pool.push_task(recovery, redisOpts, queues, recoveryTimeoutSecond * 1000, 10000);
+  // Splits `queue` into shards in this process. Set it the same way in producers and servers, before enqueueing to or
+  // serving the queue; tasks already in the unsharded queue are not moved. Pause state, concurrency caps, metrics and
+  // weights stay per logical queue, everything else (backend choice, retention) applies to every shard.
+  void setQueueSharding(const std::string &queue, Sharding sharding) {
+    if (sharding.shards <= 1)
+      queueShardings.erase(queue);
+    else
+      queueShardings[queue] = std::make_unique<ShardedQueue>(std::move(sharding));
+  }
 
-    while (true) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
-      for (std::vector<std::pair<std::string, int>>::iterator it = queuesVector.begin(); it != queuesVector.end(); it++) {
-        if (isPaused(c, it->first))
-            continue;
-        std::optional<Task> task;
-        task = dequeueScheduled(c, it->first, getScheduledScriptSHA);
-        if (!task.has_value())
-          task = dequeue(c, it->first);
-        if (task.has_value()) {
-          pool.push_task(taskRunner, redisOpts, task.value(), it->first);
-          break;
-        }
-      }
+  std::string shardName(const std::string &queue, size_t shard) {
+    return queue + "#" + std::to_string(shard);
+  }
+
+  // Physical queues of `queue`, just `queue` when it is not sharded
+  std::vector<std::string> shardsOf(const std::string &queue) {
+    auto sharded = queueShardings.find(queue);
+    if (sharded == queueShardings.end())
+      return { queue };
+    std::vector<std::string> shards;
+    for (size_t i = 0; i < sharded->second->sharding.shards; i++)
+      shards.push_back(shardName(queue, i));
+    return shards;
+  }
+
+  // FNV-1a, stable across builds so that producers compiled differently agree on placement
+  uint64_t shardHash(const std::string &key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char ch : key) {
+      hash ^= static_cast<uint8_t>(ch);
+      hash *= 1099511628211ULL;
     }
+    return hash;
   }
-}
 
+  std::string shardForKey(const std::string &queue, const std::string &key) {
+    auto sharded = queueShardings.find(queue);
+    if (sharded == queueShardings.end())
+      return queue;
+    return shardName(queue, shardHash(key) % sharded->second->sharding.shards);
+  }
+
+  // Physical queue that `task` is enqueued to
+  std::string shardFor(const std::string &queue, const Task &task) {
+    auto sharded = queueShardings.find(queue);
+    if (sharded == queueShardings.end())
+      return queue;
+    ShardedQueue &shards = *sharded->second;
+    if (shards.sharding.key)
+      return shardForKey(queue, shards.sharding.key(task));
+    return shardName(queue, shards.next.fetch_add(1, std::memory_order_relaxed) % shards.sharding.shards);
+  }
+
+  // Logical queue of a physical one
+  std::string logicalQueue(const std::string &queue) {
+    size_t hash = queue.rfind('#');
+    if (hash == std::string::npos || queueShardings.find(queue.substr(0, hash)) == queueShardings.end())
+      return queue;
+    return queue.substr(0, hash);
+  }
+
+  // How long the per-minute rollups of enqueued and acknowledged tasks (cppq:<queue>:stats:<minute since epoch>) are
+  // kept for the CLI and web UI, zero stops recording them. Set it the same way in producers and servers.
+  std::chrono::seconds statsHistory = std::chrono::hours(24);
+
+  void setStatsHistory(std::chrono::seconds history) {
+    statsHistory = history;
+  }
+
+  std::string statsKey(const std::string &queue, uint64_t atMs) {
+    return queueKey(queue, "stats:" + std::to_string(atMs / 60000));
+  }
+
+  class Script;
+
+  // Storage layout of a queue's ready and leased tasks. Task records, the scheduled set and the completed and failed
+  // lists are shared by every backend, backends only differ in how tasks are handed out, acknowledged and recovered.
+  // Producers and servers must agree on each queue's backend, see setQueueBackend().
+  class Backend {
+    public:
+      virtual ~Backend() = default;
+
+      // 'list' or 'stream', tells scripts that make tasks ready (promotion, periodic tasks) how to push to readyKey()
+      virtual std::string layout() const = 0;
+      virtual std::string readyKey(const std::string &queue) const = 0;
+
+      // Appends the single command that makes `uuid` ready, as part of the enqueue transaction
+      virtual void appendPush(redisContext *c, const std::string &queue, const std::string &uuid) = 0;
+      virtual std::vector<Task> dequeue(redisContext *c, const std::string &queue, size_t count, uint64_t leaseMs) = 0;
+      virtual bool extendLease(redisContext *c, const std::string &queue, const Task &task, uint64_t leaseMs) = 0;
+      // Ends the lease of a task that did not run and makes it ready again behind the others, returns false if it was
+      // no longer leased
+      virtual bool requeue(redisContext *c, const std::string &queue, const Task &task) = 0;
+      // Makes up to `limit` tasks whose lease ran out ready again, returns how many were looked at. `leaseMs` is the
+      // lease of the recovering server, for backends that do not store a deadline per task.
+      virtual uint64_t recoverExpired(redisContext *c, const std::string &queue, uint64_t leaseMs, uint64_t limit) = 0;
+
+      // Script and keys that acknowledge a batch of the queue's tasks, taking the arguments of ackScript
+      virtual Script &ackScript() = 0;
+      virtual std::vector<std::string> ackKeys(const std::string &queue) const = 0;
+  };
+
+  Backend &backendFor(const std::string &queue);
+
+  void appendCommand(redisContext *c, const std::vector<std::string> &args) {
+    std::vector<const char *> argv;
+    std::vector<size_t> argvLen;
+    for (auto &arg : args) {
+      argv.push_back(arg.data());
+      argvLen.push_back(arg.size());
+    }
+    redisAppendCommandArgv(c, argv.size(), argv.data(), argvLen.data());
+  }
+
+  redisReply *command(redisContext *c, const std::vector<std::string> &args) {
+    appendCommand(c, args);
+    redisReply *reply = nullptr;
+    if (redisGetReply(c, (void **)&reply) != REDIS_OK)
+      return NULL;
+    return reply;
+  }
+
+  // Appends MULTI, two commands and EXEC. Tasks with a cron schedule are not enqueued themselves, they become the
+  // periodic definition with their uuid as id, of which PeriodicScheduler enqueues a copy at every occurrence.
+  // Returns the shard of `queue` that the task went to, see setQueueSharding(). With `replyTo` the outcome is published
+  // on that channel (see ResultListener), which adds a third command to the transaction.
+  std::string appendEnqueue(
+      redisContext *c,
+      Task &task,
+      const std::string &logical,
+      ScheduleOptions s,
+      const std::string &replyTo = "",
+      std::chrono::milliseconds replyTtl = std::chrono::milliseconds(0)
+      ) {
+    std::string uuid = uuidToString(task.uuid);
+    const std::string queue = s.type == ScheduleType::Cron ? shardForKey(logical, uuid) : shardFor(logical, task);
+    task.enqueuedAtMs =
+      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    if (s.type == ScheduleType::None) {
+      task.state = TaskState::Pending;
+    } else {
+      task.state = TaskState::Scheduled;
+      if (s.type == ScheduleType::TimePoint)
+        task.schedule = std::chrono::duration_cast<std::chrono::milliseconds>(s.time.time_since_epoch()).count();
+      else
+        task.cron = s.cron;
+    }
+
+    // The caller's task keeps its uncompressed payload
+    uint8_t payloadCodec = task.payloadCodec;
+    std::optional<std::string> compressed = payloadCodec == codecNone ? compress(task.payload, payloadCodec) : std::nullopt;
+    const std::string &payload = compressed.has_value() ? compressed.value() : task.payload;
+
+    redisAppendCommand(c, "MULTI");
+    if (s.type == ScheduleType::Cron) {
+      std::string record = encodeTask(task, payload, payloadCodec);
+      appendCommand(c, { "HSET", queueKey(queue, "periodic"), uuid, record });
+      appendCommand(c, { "HSET", queueKey(queue, "periodic:cron"), uuid, task.cron });
+      redisAppendCommand(c, "EXEC");
+      return queue;
+    }
+
+    // In the same transaction as the push, so that no acknowledgement can miss it
+    if (!replyTo.empty())
+      appendCommand(c, { "SET", queueKey(queue, "reply:" + uuid), replyTo, "PX", std::to_string(replyTtl.count()) });
+    if (s.type == ScheduleType::None)
+      backendFor(queue).appendPush(c, queue, uuid);
+    else
+      appendCommand(c, { "ZADD", queueKey(queue, "scheduled"), std::to_string(task.schedule), uuid });
+
+    if (statsHistory.count() > 0) {
+      std::string bucket = statsKey(queue, task.enqueuedAtMs);
+      appendCommand(c, { "HINCRBY", bucket, "enqueued", "1" });
+      appendCommand(c, { "EXPIRE", bucket, std::to_string(statsHistory.count()) });
+    }
+
+    std::string key = queueKey(queue, "task:") + uuid;
+    if (taskEncoding == TaskEncoding::Compact) {
+      std::string record = encodeTask(task, payload, payloadCodec);
+      redisAppendCommand(c, "SET %b %b", key.data(), key.size(), record.data(), record.size());
+    } else {
+      std::vector<std::string> args = {
+        "HSET", key,
+        "type", task.type,
+        "payload", payload,
+        "state", stateToString(task.state),
+        "maxRetry", std::to_string(task.maxRetry),
+        "retried", std::to_string(task.retried),
+        "dequeuedAtMs", std::to_string(task.dequeuedAtMs),
+        "enqueuedAtMs", std::to_string(task.enqueuedAtMs)
+      };
+      if (payloadCodec != codecNone) {
+        args.push_back("payloadCodec");
+        args.push_back(std::to_string(payloadCodec));
+      }
+      if (s.type == ScheduleType::TimePoint) {
+        args.push_back("schedule");
+        args.push_back(std::to_string(task.schedule));
+      }
+      appendCommand(c, args);
+    }
+    redisAppendCommand(c, "EXEC");
+    return queue;
+  }
+
+  // Reads the MULTI/.../EXEC replies of one appended enqueue transaction, returns whether it committed
+  bool readEnqueueReplies(redisContext *c) {
+    bool success = true;
+    for (bool exec = false; !exec;) {
+      redisReply *reply = nullptr;
+      if (redisGetReply(c, (void **)&reply) != REDIS_OK)
+        return false;
+      // Queued commands are answered with a status, EXEC with an array of their replies or an EXECABORT error
+      exec = reply->type == REDIS_REPLY_ARRAY || reply->type == REDIS_REPLY_NIL ||
+        (reply->type == REDIS_REPLY_ERROR && std::strncmp(reply->str, "EXECABORT", 9) == 0);
+      if (reply->type == REDIS_REPLY_ERROR || reply->type == REDIS_REPLY_NIL)
+        success = false;
+      else if (reply->type == REDIS_REPLY_ARRAY)
+        for (size_t j = 0; j < reply->elements; j++)
+          if (reply->element[j]->type == REDIS_REPLY_ERROR)
+            success = false;
+      freeReplyObject(reply);
+    }
+    return success;
+  }
+
+  // Wakes up servers that are parked on an empty queue
+  void appendWakeup(redisContext *c, const std::string &queue) {
+    appendCommand(c, { "PUBLISH", queueKey(queue, "wakeup"), "1" });
+  }
+
+  bool readWakeupReply(redisContext *c) {
+    redisReply *reply = nullptr;
+    if (redisGetReply(c, (void **)&reply) != REDIS_OK)
+      return false;
+    freeReplyObject(reply);
+    return true;
+  }
+
+  void enqueue(redisContext *c, Task task, std::string queue, ScheduleOptions s) {
+    appendWakeup(c, appendEnqueue(c, task, queue, s));
+    bool success = readEnqueueReplies(c);
+    readWakeupReply(c);
+    if (!success)
+      throw std::runtime_error("Failed to enqueue task");
+  }
+
+  void enqueue(redisContext *c, Task task, std::string queue) {
+    return enqueue(c, task, queue, ScheduleOptions{ .cron = "", .type = ScheduleType::None });
+  }
+
+  void enqueueBatch(redisContext *c, std::vector<Task> tasks, std::string queue, ScheduleOptions s) {
+    std::set<std::string> shards;
+    for (auto &task : tasks)
+      shards.insert(appendEnqueue(c, task, queue, s));
+    for (auto &shard : shards)
+      appendWakeup(c, shard);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < tasks.size(); i++)
+      if (!readEnqueueReplies(c))
+        failed++;
+    for (size_t i = 0; i < shards.size(); i++)
+      readWakeupReply(c);
+
+    if (failed > 0)
+      throw std::runtime_error("Failed to enqueue " + std::to_string(failed) + " of " + std::to_string(tasks.size()) + " tasks");
+  }
+
+  void enqueueBatch(redisContext *c, std::vector<Task> tasks, std::string queue) {
+    return enqueueBatch(c, std::move(tasks), queue, ScheduleOptions{ .cron = "", .type = ScheduleType::None });
+  }
+
+  using EnqueueErrorHandler = std::function<void(const Task&, const std::runtime_error&)>;
+
+  // Fire-and-forget enqueuer: tasks are buffered for up to `linger` (or until `maxBatchSize` is reached)
+  // and then written by a background thread as one pipelined batch over its own connection
+  class Producer {
+    public:
+      Producer(
+          redisOptions redisOpts,
+          std::chrono::microseconds linger = std::chrono::microseconds(1000),
+          size_t maxBatchSize = 512
+          ) : redisOpts(redisOpts), linger(linger), maxBatchSize(maxBatchSize > 0 ? maxBatchSize : 1) {
+        c = redisConnectWithOptions(&this->redisOpts);
+        if (c == NULL || c->err)
+          throw std::runtime_error("Failed to connect to Redis");
+        flusher = std::thread(&Producer::run, this);
+      }
+
+      ~Producer() {
+        {
+          const std::scoped_lock lock(mutex);
+          running = false;
+        }
+        available_cv.notify_one();
+        flusher.join();
+        redisFree(c);
+      }
+
+      Producer(const Producer&) = delete;
+      Producer& operator=(const Producer&) = delete;
+
+      std::future<void> enqueue(Task task, std::string queue, ScheduleOptions s) {
+        Entry entry{ std::move(task), std::move(queue), s, std::promise<void>(), nullptr };
+        std::future<void> future = entry.promise.get_future();
+        push(std::move(entry));
+        return future;
+      }
+
+      std::future<void> enqueue(Task task, std::string queue) {
+        return enqueue(std::move(task), std::move(queue), ScheduleOptions{ .cron = "", .type = ScheduleType::None });
+      }
+
+      void enqueue(Task task, std::string queue, ScheduleOptions s, EnqueueErrorHandler onError) {
+        push(Entry{ std::move(task), std::move(queue), s, std::promise<void>(), std::move(onError) });
+      }
+
+      // Blocks until everything enqueued so far has been written
+      void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        flushing = true;
+        available_cv.notify_one();
+        flushed_cv.wait(lock, [this] { return entries.empty() && !writing; });
+        flushing = false;
+      }
+
+    private:
+      struct Entry {
+        Task task;
+        std::string queue;
+        ScheduleOptions s;
+        std::promise<void> promise;
+        EnqueueErrorHandler onError;
+      };
+
+      void push(Entry entry) {
+        bool wake;
+        {
+          const std::scoped_lock lock(mutex);
+          bool first = entries.empty();
+          if (first)
+            oldest = std::chrono::steady_clock::now();
+          entries.push_back(std::move(entry));
+          // The first entry starts the linger countdown of an idle flusher, a full batch cuts it short
+          wake = first || entries.size() >= maxBatchSize;
+        }
+        if (wake)
+          available_cv.notify_one();
+      }
+
+      void run() {
+        std::vector<Entry> batch;
+        while (true) {
+          {
+            std::unique_lock<std::mutex> lock(mutex);
+            available_cv.wait(lock, [this] { return !entries.empty() || !running; });
+            if (entries.empty())
+              return;
+            available_cv.wait_until(
+                lock,
+                oldest + linger,
+                [this] { return entries.size() >= maxBatchSize || flushing || !running; }
+                );
+            size_t count = std::min(entries.size(), maxBatchSize);
+            std::move(entries.begin(), entries.begin() + count, std::back_inserter(batch));
+            entries.erase(entries.begin(), entries.begin() + count);
+            if (!entries.empty())
+              oldest = std::chrono::steady_clock::now();
+            writing = true;
+          }
+
+          write(batch);
+          batch.clear();
+
+          {
+            const std::scoped_lock lock(mutex);
+            writing = false;
+          }
+          flushed_cv.notify_all();
+        }
+      }
+
+      void write(std::vector<Entry> &batch) {
+        if (c->err && redisReconnect(c) != REDIS_OK) {
+          for (auto &entry : batch)
+            fail(entry, std::runtime_error("Failed to connect to Redis"));
+          return;
+        }
+
+        std::set<std::string> queues;
+        for (auto &entry : batch)
+          queues.insert(appendEnqueue(c, entry.task, entry.queue, entry.s));
+        for (auto &queue : queues)
+          appendWakeup(c, queue);
+
+        for (auto &entry : batch) {
+          if (readEnqueueReplies(c)) {
+            if (!entry.onError)
+              entry.promise.set_value();
+          } else {
+            fail(entry, std::runtime_error("Failed to enqueue task"));
+          }
+        }
+        for (size_t i = 0; i < queues.size(); i++)
+          readWakeupReply(c);
+      }
+
+      void fail(Entry &entry, const std::runtime_error &error) {
+        if (entry.onError)
+          entry.onError(entry.task, error);
+        else
+          entry.promise.set_exception(std::make_exception_ptr(error));
+      }
+
+      redisOptions redisOpts;
+      redisContext *c = nullptr;
+      std::chrono::microseconds linger;
+      size_t maxBatchSize;
+      std::vector<Entry> entries = {};
+      std::chrono::steady_clock::time_point oldest = {};
+      std::mutex mutex = {};
+      std::condition_variable available_cv = {};
+      std::condition_variable flushed_cv = {};
+      bool running = true;
+      bool writing = false;
+      bool flushing = false;
+      std::thread flusher;
+  };
+
+  class Script {
+    public:
+      Script(std::string source) : source(std::move(source)) {}
+
+      std::string getSHA() {
+        const std::scoped_lock lock(mutex);
+        return sha;
+      }
+
+      void setSHA(std::string sha) {
+        const std::scoped_lock lock(mutex);
+        this->sha = sha;
+      }
+
+      const std::string source;
+
+    private:
+      std::string sha = "";
+      std::mutex mutex = {};
+  };
+
+  bool loadScript(redisContext *c, Script &script) {
+    redisReply *reply = (redisReply *)redisCommand(c, "SCRIPT LOAD %b", script.source.data(), script.source.size());
+    if (reply == NULL)
+      return false;
+    bool loaded = reply->type == REDIS_REPLY_STRING;
+    if (loaded)
+      script.setSHA(std::string(reply->str, reply->len));
+    freeReplyObject(reply);
+    return loaded;
+  }
+
+  void appendScript(redisContext *c, const std::string &sha, const std::vector<std::string> &keys, const std::vector<std::string> &args) {
+    std::string numKeys = std::to_string(keys.size());
+    std::vector<const char *> argv = { "EVALSHA", sha.c_str(), numKeys.c_str() };
+    std::vector<size_t> argvLen = { 7, sha.size(), numKeys.size() };
+    for (auto &key : keys) {
+      argv.push_back(key.data());
+      argvLen.push_back(key.size());
+    }
+    for (auto &arg : args) {
+      argv.push_back(arg.data());
+      argvLen.push_back(arg.size());
+    }
+    redisAppendCommandArgv(c, argv.size(), argv.data(), argvLen.data());
+  }
+
+  bool isNoScriptError(redisReply *reply) {
+    return reply != NULL && reply->type == REDIS_REPLY_ERROR && std::string(reply->str, reply->len).rfind("NOSCRIPT", 0) == 0;
+  }
+
+  // Runs the script by SHA, (re)loading it first if the server has not seen it yet or has been flushed
+  redisReply *evalScript(redisContext *c, Script &script, const std::vector<std::string> &keys, const std::vector<std::string> &args) {
+    std::string sha = script.getSHA();
+    if (sha.empty()) {
+      if (!loadScript(c, script))
+        return NULL;
+      sha = script.getSHA();
+    }
+
+    redisReply *reply = nullptr;
+    appendScript(c, sha, keys, args);
+    if (redisGetReply(c, (void **)&reply) != REDIS_OK)
+      return NULL;
+    if (!isNoScriptError(reply))
+      return reply;
+
+    freeReplyObject(reply);
+    if (!loadScript(c, script))
+      return NULL;
+    appendScript(c, script.getSHA(), keys, args);
+    if (redisGetReply(c, (void **)&reply) != REDIS_OK)
+      return NULL;
+    return reply;
+  }
+
+  std::string replyToString(redisReply *reply) {
+    if (reply == NULL || reply->type != REDIS_REPLY_STRING)
+      return "";
+    return std::string(reply->str, reply->len);
+  }
+
+  uint64_t replyToUInt(redisReply *reply) {
+    if (reply == NULL)
+      return 0;
+    if (reply->type == REDIS_REPLY_INTEGER)
+      return reply->integer;
+    if (reply->type == REDIS_REPLY_STRING)
+      return strtoull(reply->str, NULL, 0);
+    return 0;
+  }
+
+  // Prepended to scripts that touch task records, so that they read and write hash and compact tasks alike.
+  // Attribute values are strings in both encodings, absent ones are false.
+  const std::string taskRecordLua = R"DOC(
+    local taskStates = { 'Unknown', 'Pending', 'Scheduled', 'Active', 'Failed', 'Completed' }
+
+    local function orFalse(value)
+      if value == nil or value == '' or value == '0' then
+        return false
+      end
+      return value
+    end
+
+    -- For strings, where '0' is a value like any other
+    local function stringOrFalse(value)
+      if value == nil or value == '' then
+        return false
+      end
+      return value
+    end
+
+    local function decodeTask(record)
+      local version, state, flags, _, maxRetry, retried, dequeuedAtMs, schedule, finishedAtMs, enqueuedAtMs, type, payload, cron, result
+      version = struct.unpack('<B', record)
+      if version == 1 then
+        version, state, flags, _, maxRetry, retried, dequeuedAtMs, schedule, type, payload, cron, result =
+          struct.unpack('<BBBBI8I8I8I8I4c0I4c0I4c0I4c0', record)
+        finishedAtMs, enqueuedAtMs = 0, 0
+      elseif version == 2 then
+        version, state, flags, _, maxRetry, retried, dequeuedAtMs, schedule, finishedAtMs, type, payload, cron, result =
+          struct.unpack('<BBBBI8I8I8I8I8I4c0I4c0I4c0I4c0', record)
+        enqueuedAtMs = 0
+      else
+        version, state, flags, _, maxRetry, retried, dequeuedAtMs, schedule, finishedAtMs, enqueuedAtMs, type, payload, cron, result =
+          struct.unpack('<BBBBI8I8I8I8I8I8I4c0I4c0I4c0I4c0', record)
+      end
+      return {
+        version = version,
+        state = taskStates[state + 1] or 'Unknown',
+        payloadCodec = orFalse(tostring(flags % 16)),
+        resultCodec = orFalse(tostring(math.floor(flags / 16))),
+        maxRetry = string.format('%.0f', maxRetry),
+        retried = string.format('%.0f', retried),
+        dequeuedAtMs = string.format('%.0f', dequeuedAtMs),
+        schedule = orFalse(string.format('%.0f', schedule)),
+        finishedAtMs = orFalse(string.format('%.0f', finishedAtMs)),
+        enqueuedAtMs = orFalse(string.format('%.0f', enqueuedAtMs)),
+        type = type,
+        payload = payload,
+        cron = stringOrFalse(cron),
+        result = stringOrFalse(result)
+      }
+    end
+
+    local function encodeTask(task)
+      local state = 0
+      for i, name in ipairs(taskStates) do
+        if name == task.state then
+          state = i - 1
+        end
+      end
+      local record = struct.pack(
+        '<BBBBI8I8I8I8I8I8', 3, state, (tonumber(task.payloadCodec) or 0) + 16 * (tonumber(task.resultCodec) or 0), 0,
+        tonumber(task.maxRetry) or 0, tonumber(task.retried) or 0, tonumber(task.dequeuedAtMs) or 0,
+        tonumber(task.schedule) or 0, tonumber(task.finishedAtMs) or 0, tonumber(task.enqueuedAtMs) or 0)
+      for _, field in ipairs({ 'type', 'payload', 'cron', 'result' }) do
+        local value = task[field] or ''
+        record = record .. struct.pack('<I4', #value) .. value
+      end
+      return record
+    end
+
+    local function isCompact(key)
+      return redis.call('TYPE', key).ok == 'string'
+    end
+
+    local function taskGet(key, ...)
+      if not isCompact(key) then
+        return redis.call('HMGET', key, ...)
+      end
+      local task = decodeTask(redis.call('GET', key))
+      local values = {}
+      for i, field in ipairs({ ... }) do
+        values[i] = task[field] or false
+      end
+      return values
+    end
+
+    local function taskSet(key, ...)
+      if not isCompact(key) then
+        return redis.call('HSET', key, ...)
+      end
+      local task = decodeTask(redis.call('GET', key))
+      local args = { ... }
+      for i = 1, #args, 2 do
+        task[args[i]] = args[i + 1]
+      end
+      return redis.call('SET', key, encodeTask(task))
+    end
+
+    -- Replaces whatever is stored at key with task, as a compact record or as a hash
+    local function taskWrite(key, task, compact)
+      redis.call('DEL', key)
+      if compact then
+        return redis.call('SET', key, encodeTask(task))
+      end
+      local args = {}
+      for _, field in ipairs({
+          'type', 'payload', 'state', 'maxRetry', 'retried', 'dequeuedAtMs', 'schedule', 'cron', 'result',
+          'payloadCodec', 'resultCodec', 'finishedAtMs', 'enqueuedAtMs' }) do
+        if task[field] then
+          args[#args + 1] = field
+          args[#args + 1] = task[field]
+        end
+      end
+      return redis.call('HSET', key, unpack(args))
+    end
+
+    -- Makes a task ready on a 'list' or 'stream' backend (see Backend::layout()), at the consuming end of a list
+    -- when first is set
+    local function pushReady(key, layout, uuid, first)
+      if layout == 'stream' then
+        return redis.call('XADD', key, '*', 'uuid', uuid)
+      elseif first then
+        return redis.call('RPUSH', key, uuid)
+      end
+      return redis.call('LPUSH', key, uuid)
+    end
+
+    -- A producer awaiting the outcome (see ResultListener) left the channel to publish it on in <queue prefix>reply:<uuid>,
+    -- next to the task key <queue prefix>task:<uuid>
+    local function notifyResult(key, uuid, state, retried, result, resultCodec)
+      local replyKey = string.sub(key, 1, -(#uuid + 6)) .. 'reply:' .. uuid
+      local channel = redis.call('GET', replyKey)
+      if channel then
+        redis.call('DEL', replyKey)
+        redis.call('PUBLISH', channel, uuid .. ' ' .. state .. ' ' .. retried .. ' ' .. resultCodec .. ' ' .. result)
+      end
+    end
+
+    -- Applies one acknowledgement (see ackScript) to the task record, files completed and failed tasks and schedules
+    -- delayed retries, returns whether the task is to be made ready again
+    local function finishTask(key, uuid, state, retried, result, resultCodec, retryAtMs, finishedAtMs, completed, failed, scheduled)
+      if state == 'Completed' then
+        if resultCodec == '0' then
+          taskSet(key, 'state', state, 'result', result, 'finishedAtMs', finishedAtMs)
+        else
+          taskSet(key, 'state', state, 'result', result, 'resultCodec', resultCodec, 'finishedAtMs', finishedAtMs)
+        end
+        redis.call('LPUSH', completed, uuid)
+        notifyResult(key, uuid, state, retried, result, resultCodec)
+        return false
+      elseif state == 'Failed' then
+        taskSet(key, 'state', state, 'retried', retried, 'finishedAtMs', finishedAtMs)
+        redis.call('LPUSH', failed, uuid)
+        notifyResult(key, uuid, state, retried, result, resultCodec)
+        return false
+      end
+      if retryAtMs ~= '0' then
+        taskSet(key, 'state', 'Scheduled', 'retried', retried, 'schedule', retryAtMs, 'enqueuedAtMs', finishedAtMs)
+        redis.call('ZADD', scheduled, retryAtMs, uuid)
+        return false
+      end
+      taskSet(key, 'state', state, 'retried', retried, 'enqueuedAtMs', finishedAtMs)
+      return true
+    end
+
+    -- Whether the lease an acknowledgement is for, the one taken at dequeuedAtMs, is still the task's current one
+    -- rather than one taken after recovery. '0' acknowledges whichever lease is current.
+    local function holdsLease(key, dequeuedAtMs)
+      return dequeuedAtMs == '0' or taskGet(key, 'dequeuedAtMs')[1] == dequeuedAtMs
+    end
+
+    -- Adds a batch of acknowledgements to the queue's rollup for the minute of finishedAtMs, see cppq::statsHistory.
+    -- counts is { processed, failed, retried }, the queue is the one whose task keys start with prefix.
+    local function countFinished(prefix, finishedAtMs, ttl, counts, handlerUs)
+      if ttl == '0' or counts[1] == 0 then
+        return
+      end
+      local bucket = string.sub(prefix, 1, -6) .. 'stats:' .. math.floor(tonumber(finishedAtMs) / 60000)
+      redis.call('HINCRBY', bucket, 'processed', counts[1])
+      redis.call('HINCRBY', bucket, 'failed', counts[2])
+      redis.call('HINCRBY', bucket, 'retried', counts[3])
+      redis.call('HINCRBY', bucket, 'handler_us', handlerUs)
+      redis.call('EXPIRE', bucket, ttl)
+    end
+
+    local function countState(counts, state)
+      counts[1] = counts[1] + 1
+      if state == 'Failed' then
+        counts[2] = counts[2] + 1
+      elseif state == 'Pending' then
+        counts[3] = counts[3] + 1
+      end
+    end
+  )DOC";
+
+  // Pops up to ARGV[3] of the oldest pending tasks, leases them in active until ARGV[4] and returns their fields in one go:
+  // KEYS = [pending, active], ARGV = [task key prefix, dequeuedAtMs, count, lease deadline]
+  Script dequeueScript(taskRecordLua + R"DOC(
+    local tasks = {}
+    for i = 1, tonumber(ARGV[3]) do
+      local uuid = redis.call('RPOP', KEYS[1])
+      if not uuid then
+        break
+      end
+      local key = ARGV[1] .. uuid
+      redis.call('ZADD', KEYS[2], ARGV[4], uuid)
+      taskSet(key, 'dequeuedAtMs', ARGV[2], 'state', 'Active')
+      local fields = taskGet(key, 'type', 'payload', 'maxRetry', 'retried', 'schedule', 'cron', 'payloadCodec', 'enqueuedAtMs')
+      tasks[i] = { uuid, fields[1], fields[2], fields[3], fields[4], fields[5], fields[6], fields[7], fields[8] }
+    end
+    return tasks)DOC");
+
+  // Moves up to ARGV[3] tasks that are due at ARGV[2] from the scheduled set to the consuming end of the ready list
+  // or stream, returns [promoted count, score of the next scheduled task or -1]:
+  // KEYS = [scheduled, ready], ARGV = [task key prefix, nowMs, limit, wakeup channel, backend layout]
+  Script promoteScheduledScript(taskRecordLua + R"DOC(
+    local due = redis.call('ZRANGEBYSCORE', KEYS[1], '-inf', ARGV[2], 'LIMIT', 0, tonumber(ARGV[3]))
+    for i = 1, #due do
+      local uuid = ARGV[5] == 'stream' and due[i] or due[#due + 1 - i]
+      taskSet(ARGV[1] .. uuid, 'state', 'Pending')
+      pushReady(KEYS[2], ARGV[5], uuid, true)
+    end
+    if #due > 0 then
+      redis.call('ZREMRANGEBYRANK', KEYS[1], 0, #due - 1)
+      redis.call('PUBLISH', ARGV[4], 1)
+    end
+    local next = redis.call('ZRANGE', KEYS[1], 0, 0, 'WITHSCORES')
+    if #next == 0 then
+      return { #due, -1 }
+    end
+    return { #due, next[2] })DOC");
+
+  // One-time conversion of the pre-ZSET scheduled list layout:
+  // KEYS = [scheduled], ARGV = [task key prefix]
+  Script migrateScheduledScript(taskRecordLua + R"DOC(
+    if redis.call('TYPE', KEYS[1]).ok ~= 'list' then
+      return 0
+    end
+    local scheduled = redis.call('LRANGE', KEYS[1], 0, -1)
+    redis.call('DEL', KEYS[1])
+    for _, uuid in ipairs(scheduled) do
+      local schedule = taskGet(ARGV[1] .. uuid, 'schedule')[1]
+      redis.call('ZADD', KEYS[1], schedule or '+inf', uuid)
+    end
+    return #scheduled)DOC");
+
+  // Turns cron tasks that earlier versions parked in the scheduled set at +inf into periodic definitions:
+  // KEYS = [scheduled, periodic, periodic cron], ARGV = [task key prefix]
+  Script migrateCronScript(taskRecordLua + R"DOC(
+    local parked = redis.call('ZRANGEBYSCORE', KEYS[1], '+inf', '+inf')
+    for _, uuid in ipairs(parked) do
+      local key = ARGV[1] .. uuid
+      local task
+      if isCompact(key) then
+        task = decodeTask(redis.call('GET', key))
+      else
+        local fields = redis.call('HGETALL', key)
+        task = {}
+        for i = 1, #fields, 2 do
+          task[fields[i]] = fields[i + 1]
+        end
+      end
+      if task.cron then
+        redis.call('HSET', KEYS[2], uuid, encodeTask(task))
+        redis.call('HSET', KEYS[3], uuid, task.cron)
+      end
+      redis.call('DEL', key)
+      redis.call('ZREM', KEYS[1], uuid)
+    end
+    return #parked)DOC");
+
+  // Returns up to ARGV[3] tasks whose lease expired by ARGV[2] to pending (or to scheduled, if they were scheduled):
+  // KEYS = [active, pending, scheduled], ARGV = [task key prefix, nowMs, limit, wakeup channel]
+  Script recoverScript(taskRecordLua + R"DOC(
+    local expired = redis.call('ZRANGEBYSCORE', KEYS[1], '-inf', ARGV[2], 'LIMIT', 0, tonumber(ARGV[3]))
+    for _, uuid in ipairs(expired) do
+      local key = ARGV[1] .. uuid
+      taskSet(key, 'state', 'Pending')
+      local schedule = taskGet(key, 'schedule')[1]
+      if schedule then
+        redis.call('ZADD', KEYS[3], schedule, uuid)
+      else
+        redis.call('LPUSH', KEYS[2], uuid)
+      end
+    end
+    if #expired > 0 then
+      redis.call('ZREMRANGEBYRANK', KEYS[1], 0, #expired - 1)
+      redis.call('PUBLISH', ARGV[4], 1)
+    end
+    return #expired)DOC");
+
+  // Pushes the lease deadline of a task that is still active: KEYS = [active], ARGV = [uuid, new deadline]
+  Script extendLeaseScript(R"DOC(
+    if not redis.call('ZSCORE', KEYS[1], ARGV[1]) then
+      return 0
+    end
+    redis.call('ZADD', KEYS[1], ARGV[2], ARGV[1])
+    return 1)DOC");
+
+  // Hands a leased task that did not run back to the enqueueing end of pending:
+  // KEYS = [active, pending], ARGV = [task key prefix, uuid, wakeup channel]
+  Script requeueScript(taskRecordLua + R"DOC(
+    if redis.call('ZREM', KEYS[1], ARGV[2]) == 0 then
+      return 0
+    end
+    taskSet(ARGV[1] .. ARGV[2], 'state', 'Pending')
+    pushReady(KEYS[2], 'list', ARGV[2])
+    redis.call('PUBLISH', ARGV[3], 1)
+    return 1)DOC");
+
+  // One-time conversion of the pre-ZSET active list layout, leasing every task from its dequeue time:
+  // KEYS = [active], ARGV = [task key prefix, lease length]
+  Script migrateActiveScript(taskRecordLua + R"DOC(
+    if redis.call('TYPE', KEYS[1]).ok ~= 'list' then
+      return 0
+    end
+    local active = redis.call('LRANGE', KEYS[1], 0, -1)
+    redis.call('DEL', KEYS[1])
+    for _, uuid in ipairs(active) do
+      local dequeuedAtMs = tonumber(taskGet(ARGV[1] .. uuid, 'dequeuedAtMs')[1]) or 0
+      redis.call('ZADD', KEYS[1], dequeuedAtMs + tonumber(ARGV[2]), uuid)
+    end
+    return #active)DOC");
+
+  // Acknowledges a batch of finished tasks of one queue. Each entry is a (uuid, state, retried, result, result codec,
+  // retry due ms, dequeuedAtMs of the lease) tuple where state is Completed, Failed or Pending (retry, scheduled if it
+  // is due later). Entries whose lease is gone, because recovery took the task back or it was acknowledged already,
+  // are skipped, so a batch can be sent again. The batch is added to the minute's rollup with its handlers' total run
+  // time, returns how many entries were applied: KEYS = [active, pending, completed, failed, scheduled],
+  // ARGV = [task key prefix, wakeup channel, finishedAtMs, stats history seconds, handler us, entries...]
+  Script ackScript(taskRecordLua + R"DOC(
+    local requeued, applied = 0, 0
+    local counts = { 0, 0, 0 }
+    for i = 6, #ARGV, 7 do
+      local uuid = ARGV[i]
+      local key = ARGV[1] .. uuid
+      if redis.call('ZSCORE', KEYS[1], uuid) and holdsLease(key, ARGV[i + 6]) then
+        redis.call('ZREM', KEYS[1], uuid)
+        countState(counts, ARGV[i + 1])
+        applied = applied + 1
+        if finishTask(key, uuid, ARGV[i + 1], ARGV[i + 2], ARGV[i + 3], ARGV[i + 4], ARGV[i + 5], ARGV[3], KEYS[3], KEYS[4], KEYS[5]) then
+          redis.call('LPUSH', KEYS[2], uuid)
+          requeued = requeued + 1
+        end
+      end
+    end
+    if requeued > 0 then
+      redis.call('PUBLISH', ARGV[2], 1)
+    end
+    countFinished(ARGV[1], ARGV[3], ARGV[4], counts, ARGV[5])
+    return applied)DOC");
+
+  // Outcome of an awaited task for a ResultListener that may have missed its notification, deletes the reply key
+  // once the task finished: KEYS = [task key, reply key], returns [state, retried, result, result codec]
+  Script taskResultScript(taskRecordLua + R"DOC(
+    local fields = taskGet(KEYS[1], 'state', 'retried', 'result', 'resultCodec')
+    if fields[1] == 'Completed' or fields[1] == 'Failed' then
+      redis.call('DEL', KEYS[2])
+    end
+    return fields)DOC");
+
+  // Requeues (with a fresh retry budget) or deletes up to ARGV[3] tasks from the consuming end of the failed list that
+  // are of type ARGV[4] ('' for any) and failed before ARGV[5] ('0' for any time). Tasks that do not match go back to
+  // the other end, so a series of calls over as many tasks as the list held goes through it once and leaves it in
+  // order. Returns [examined, matched]: KEYS = [failed, ready],
+  // ARGV = [task key prefix, 'requeue' or 'delete', limit, type, finished before ms, backend layout, wakeup channel, nowMs]
+  Script failedBatchScript(taskRecordLua + R"DOC(
+    local examined, matched = 0, 0
+    local before = tonumber(ARGV[5])
+    for i = 1, tonumber(ARGV[3]) do
+      local uuid = redis.call('RPOP', KEYS[1])
+      if not uuid then
+        break
+      end
+      examined = examined + 1
+      local key = ARGV[1] .. uuid
+      -- Entries of deleted records are dropped
+      if redis.call('EXISTS', key) == 1 then
+        local fields = taskGet(key, 'type', 'finishedAtMs')
+        if (ARGV[4] == '' or fields[1] == ARGV[4]) and (before == 0 or (tonumber(fields[2]) or 0) < before) then
+          matched = matched + 1
+          if ARGV[2] == 'delete' then
+            redis.call('DEL', key)
+          else
+            taskSet(key, 'state', 'Pending', 'retried', '0', 'enqueuedAtMs', ARGV[8])
+            pushReady(KEYS[2], ARGV[6], uuid)
+          end
+        else
+          redis.call('LPUSH', KEYS[1], uuid)
+        end
+      end
+    end
+    if matched > 0 and ARGV[2] == 'requeue' then
+      redis.call('PUBLISH', ARGV[7], 1)
+    end
+    return { examined, matched })DOC");
+
+  // Consumer group that every server reads stream backed queues with, see StreamBackend
+  const std::string streamGroup = "cppq";
+
+  // Second half of a stream dequeue: records the stream entry of each task read by XREADGROUP and returns the same
+  // fields as dequeueScript. KEYS = [entries], ARGV = [task key prefix, dequeuedAtMs, (uuid, entry id)...]
+  Script streamActivateScript(taskRecordLua + R"DOC(
+    local tasks = {}
+    for i = 3, #ARGV, 2 do
+      local uuid = ARGV[i]
+      local key = ARGV[1] .. uuid
+      redis.call('HSET', KEYS[1], uuid, ARGV[i + 1])
+      taskSet(key, 'dequeuedAtMs', ARGV[2], 'state', 'Active')
+      local fields = taskGet(key, 'type', 'payload', 'maxRetry', 'retried', 'schedule', 'cron', 'payloadCodec', 'enqueuedAtMs')
+      tasks[#tasks + 1] = { uuid, fields[1], fields[2], fields[3], fields[4], fields[5], fields[6], fields[7], fields[8] }
+    end
+    return tasks)DOC");
+
+  // ackScript for stream backed queues, acknowledged entries are deleted so the stream only holds unfinished tasks:
+  // KEYS = [stream, entries, completed, failed, scheduled], ARGV = the same as ackScript's
+  Script streamAckScript(taskRecordLua + R"DOC(
+    local requeued, applied = 0, 0
+    local counts = { 0, 0, 0 }
+    for i = 6, #ARGV, 7 do
+      local uuid = ARGV[i]
+      local key = ARGV[1] .. uuid
+      local id = redis.call('HGET', KEYS[2], uuid)
+      if id and holdsLease(key, ARGV[i + 6]) and redis.call('XACK', KEYS[1], ')DOC" + streamGroup + R"DOC(', id) == 1 then
+        redis.call('XDEL', KEYS[1], id)
+        redis.call('HDEL', KEYS[2], uuid)
+        countState(counts, ARGV[i + 1])
+        applied = applied + 1
+        if finishTask(key, uuid, ARGV[i + 1], ARGV[i + 2], ARGV[i + 3], ARGV[i + 4], ARGV[i + 5], ARGV[3], KEYS[3], KEYS[4], KEYS[5]) then
+          pushReady(KEYS[1], 'stream', uuid)
+          requeued = requeued + 1
+        end
+      end
+    end
+    if requeued > 0 then
+      redis.call('PUBLISH', ARGV[2], 1)
+    end
+    countFinished(ARGV[1], ARGV[3], ARGV[4], counts, ARGV[5])
+    return applied)DOC");
+
+  // Takes up to ARGV[3] entries that were delivered but not acknowledged for ARGV[2] ms over with XAUTOCLAIM and
+  // adds their tasks again as new entries (or to scheduled, if they were scheduled), returns how many were taken.
+  // XAUTOCLAIM only looks at so many entries per call, so the scan goes on for a few rounds and its cursor is kept
+  // in KEYS[4], for the next call to reach expired entries behind live ones:
+  // KEYS = [stream, entries, scheduled, recovery cursor], ARGV = [task key prefix, min idle ms, limit, wakeup channel,
+  // claiming consumer]
+  Script streamRecoverScript(taskRecordLua + R"DOC(
+    local limit = tonumber(ARGV[3])
+    local cursor = redis.call('GET', KEYS[4]) or '0-0'
+    local taken, recovered = 0, 0
+    for round = 1, 16 do
+      local claimed = redis.call(
+        'XAUTOCLAIM', KEYS[1], ')DOC" + streamGroup + R"DOC(', ARGV[5], ARGV[2], cursor, 'COUNT', limit - taken)
+      cursor = claimed[1]
+      taken = taken + #claimed[2]
+      for _, entry in ipairs(claimed[2]) do
+        local id, fields = entry[1], entry[2]
+        redis.call('XACK', KEYS[1], ')DOC" + streamGroup + R"DOC(', id)
+        redis.call('XDEL', KEYS[1], id)
+        -- Entries deleted while pending come back without fields
+        if type(fields) == 'table' and fields[2] then
+          local uuid = fields[2]
+          local key = ARGV[1] .. uuid
+          redis.call('HDEL', KEYS[2], uuid)
+          taskSet(key, 'state', 'Pending')
+          local schedule = taskGet(key, 'schedule')[1]
+          if schedule then
+            redis.call('ZADD', KEYS[3], schedule, uuid)
+          else
+            pushReady(KEYS[1], 'stream', uuid)
+          end
+          recovered = recovered + 1
+        end
+      end
+      if cursor == '0-0' or taken >= limit then
+        break
+      end
+    end
+    if cursor == '0-0' then
+      redis.call('DEL', KEYS[4])
+    else
+      redis.call('SET', KEYS[4], cursor)
+    end
+    if recovered > 0 then
+      redis.call('PUBLISH', ARGV[4], 1)
+    end
+    return taken)DOC");
+
+  // requeueScript for stream backed queues, the task is added again as a new entry:
+  // KEYS = [stream, entries], ARGV = [task key prefix, uuid, wakeup channel]
+  Script streamRequeueScript(taskRecordLua + R"DOC(
+    local id = redis.call('HGET', KEYS[2], ARGV[2])
+    if not id then
+      return 0
+    end
+    redis.call('XACK', KEYS[1], ')DOC" + streamGroup + R"DOC(', id)
+    redis.call('XDEL', KEYS[1], id)
+    redis.call('HDEL', KEYS[2], ARGV[2])
+    taskSet(ARGV[1] .. ARGV[2], 'state', 'Pending')
+    pushReady(KEYS[1], 'stream', ARGV[2])
+    redis.call('PUBLISH', ARGV[3], 1)
+    return 1)DOC");
+
+  // Resets the idle time of a task's stream entry, which is what recovery measures its lease by:
+  // KEYS = [stream, entries], ARGV = [uuid, consumer]
+  Script streamExtendLeaseScript(R"DOC(
+    local id = redis.call('HGET', KEYS[2], ARGV[1])
+    if not id then
+      return 0
+    end
+    return #redis.call('XCLAIM', KEYS[1], ')DOC" + streamGroup + R"DOC(', ARGV[2], 0, id, 'JUSTID'))DOC");
+
+  // Returns up to ARGV[4] of the oldest tasks of a completed or failed list that exceed ARGV[2] entries or finished
+  // at or before ARGV[3] (0 disables either bound), oldest first, without removing them. With ARGV[5] = '1' each
+  // entry is [uuid, fields...] in the order of retentionFields, otherwise just the uuid:
+  // KEYS = [completed or failed], ARGV = [task key prefix, max count, cutoffMs, limit, with fields]
+  Script retentionScanScript(taskRecordLua + R"DOC(
+    local maxCount, cutoffMs = tonumber(ARGV[2]), tonumber(ARGV[3])
+    local length = redis.call('LLEN', KEYS[1])
+    local oldest = redis.call('LRANGE', KEYS[1], -tonumber(ARGV[4]), -1)
+    local candidates = {}
+    for i = #oldest, 1, -1 do
+      local uuid = oldest[i]
+      local key = ARGV[1] .. uuid
+      local excess = maxCount > 0 and length - #candidates > maxCount
+      -- Tasks finished before finishedAtMs was recorded count as expired
+      local expired = cutoffMs > 0 and (tonumber(taskGet(key, 'finishedAtMs')[1]) or 0) <= cutoffMs
+      if not excess and not expired then
+        break
+      end
+      if ARGV[5] == '1' then
+        local fields = taskGet(
+          key, 'type', 'payload', 'state', 'maxRetry', 'retried', 'dequeuedAtMs', 'finishedAtMs', 'result',
+          'payloadCodec', 'resultCodec')
+        table.insert(fields, 1, uuid)
+        candidates[#candidates + 1] = fields
+      else
+        candidates[#candidates + 1] = uuid
+      end
+    end
+    return candidates)DOC");
+
+  // Removes the given tasks, oldest first, from the tail of a completed or failed list and deletes their records.
+  // Stops at the first one that is no longer at the tail, returns how many were removed:
+  // KEYS = [completed or failed], ARGV = [task key prefix, uuids...]
+  Script retentionEvictScript(R"DOC(
+    local evicted = 0
+    for i = 2, #ARGV do
+      if redis.call('LINDEX', KEYS[1], -1) ~= ARGV[i] then
+        break
+      end
+      redis.call('RPOP', KEYS[1])
+      redis.call('DEL', ARGV[1] .. ARGV[i])
+      evicted = evicted + 1
+    end
+    return evicted)DOC");
+
+  // Rewrites the given task keys in the target encoding ('Hash' or 'Compact'), returns how many were converted:
+  // KEYS = task keys, ARGV = [target encoding]
+  Script convertTaskEncodingScript(taskRecordLua + R"DOC(
+    local converted = 0
+    for _, key in ipairs(KEYS) do
+      local compact = isCompact(key)
+      if ARGV[1] == 'Compact' and not compact and redis.call('EXISTS', key) == 1 then
+        local fields = redis.call('HGETALL', key)
+        local task = {}
+        for i = 1, #fields, 2 do
+          task[fields[i]] = fields[i + 1]
+        end
+        taskWrite(key, task, true)
+        converted = converted + 1
+      elseif ARGV[1] == 'Hash' and compact then
+        taskWrite(key, decodeTask(redis.call('GET', key)), false)
+        converted = converted + 1
+      end
+    end
+    return converted)DOC");
+
+  // Takes or renews a lock for ARGV[2] ms on behalf of ARGV[1], returns 1 if the caller holds it:
+  // KEYS = [lock], ARGV = [holder id, ttlMs]
+  Script leaderScript(R"DOC(
+    if redis.call('GET', KEYS[1]) == ARGV[1] then
+      redis.call('PEXPIRE', KEYS[1], ARGV[2])
+      return 1
+    end
+    if redis.call('SET', KEYS[1], ARGV[1], 'NX', 'PX', ARGV[2]) then
+      return 1
+    end
+    return 0)DOC");
+
+  // Enqueues a copy of a periodic definition for each (definition id, fire time, new uuid) entry, unless that
+  // occurrence was enqueued already; the fired hash remembers the latest fire time per definition. Returns the count:
+  // KEYS = [ready, periodic, periodic fired], ARGV = [task key prefix, wakeup channel, 'Compact' or 'Hash', backend layout, entries...]
+  Script materializePeriodicScript(taskRecordLua + R"DOC(
+    local enqueued = 0
+    for i = 5, #ARGV, 3 do
+      local id, fireSec, uuid = ARGV[i], tonumber(ARGV[i + 1]), ARGV[i + 2]
+      local definition = redis.call('HGET', KEYS[2], id)
+      if definition and fireSec > (tonumber(redis.call('HGET', KEYS[3], id)) or 0) then
+        redis.call('HSET', KEYS[3], id, ARGV[i + 1])
+        local task = decodeTask(definition)
+        task.state = 'Pending'
+        task.schedule = false
+        task.cron = false
+        task.result = false
+        task.resultCodec = false
+        task.finishedAtMs = false
+        task.retried = '0'
+        task.dequeuedAtMs = '0'
+        task.enqueuedAtMs = string.format('%.0f', fireSec * 1000)
+        taskWrite(ARGV[1] .. uuid, task, ARGV[3] == 'Compact')
+        pushReady(KEYS[1], ARGV[4], uuid)
+        enqueued = enqueued + 1
+      end
+    end
+    if enqueued > 0 then
+      redis.call('PUBLISH', ARGV[2], 1)
+    end
+    return enqueued)DOC");
+
+  void loadScripts(redisContext *c) {
+    for (Script *script : {
+        &dequeueScript,
+        &promoteScheduledScript,
+        &migrateScheduledScript,
+        &migrateCronScript,
+        &recoverScript,
+        &extendLeaseScript,
+        &requeueScript,
+        &migrateActiveScript,
+        &ackScript,
+        &taskResultScript,
+        &failedBatchScript,
+        &convertTaskEncodingScript,
+        &retentionScanScript,
+        &retentionEvictScript,
+        &leaderScript,
+        &materializePeriodicScript,
+        &streamActivateScript,
+        &streamAckScript,
+        &streamRecoverScript,
+        &streamExtendLeaseScript,
+        &streamRequeueScript
+        })
+      if (!loadScript(c, *script))
+        throw std::runtime_error("Failed to load Lua scripts");
+  }
+
+  // Builds an active Task from one entry of a dequeue script reply:
+  // [uuid, type, payload, maxRetry, retried, schedule, cron, payloadCodec, enqueuedAtMs]
+  std::optional<Task> taskFromDequeueReply(redisReply *reply, uint64_t dequeuedAtMs) {
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 9)
+      return {};
+
+    std::optional<Task> task = std::make_optional<Task>(
+        replyToString(reply->element[0]),
+        replyToString(reply->element[1]),
+        replyToString(reply->element[2]),
+        stateToString(TaskState::Active),
+        replyToUInt(reply->element[3]),
+        replyToUInt(reply->element[4]),
+        dequeuedAtMs,
+        replyToUInt(reply->element[5]),
+        replyToString(reply->element[6]),
+        replyToUInt(reply->element[7])
+        );
+    task->enqueuedAtMs = replyToUInt(reply->element[8]);
+    return task;
+  }
+
+  // Lease used when the caller does not specify one, the server leases for its recovery timeout instead
+  const uint64_t defaultLeaseMs = 30 * 60 * 1000;
+
+  // Builds the tasks of a dequeue script reply and frees it
+  std::vector<Task> tasksFromDequeueReply(redisReply *reply, uint64_t dequeuedAtMs) {
+    std::vector<Task> tasks;
+    if (reply == NULL)
+      return tasks;
+    if (reply->type == REDIS_REPLY_ARRAY) {
+      for (size_t i = 0; i < reply->elements; i++) {
+        std::optional<Task> task = taskFromDequeueReply(reply->element[i], dequeuedAtMs);
+        if (task.has_value())
+          tasks.push_back(std::move(task.value()));
+      }
+    }
+    freeReplyObject(reply);
+    return tasks;
+  }
+
+  // The original layout: a pending list that is popped from, and an active set scored by lease deadline
+  class ListBackend : public Backend {
+    public:
+      std::string layout() const override {
+        return "list";
+      }
+
+      std::string readyKey(const std::string &queue) const override {
+        return queueKey(queue, "pending");
+      }
+
+      void appendPush(redisContext *c, const std::string &queue, const std::string &uuid) override {
+        appendCommand(c, { "LPUSH", queueKey(queue, "pending"), uuid });
+      }
+
+      std::vector<Task> dequeue(redisContext *c, const std::string &queue, size_t count, uint64_t leaseMs) override {
+        uint64_t dequeuedAtMs =
+          std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+        redisReply *reply = evalScript(
+            c,
+            dequeueScript,
+            { queueKey(queue, "pending"), queueKey(queue, "active") },
+            { queueKey(queue, "task:"), std::to_string(dequeuedAtMs), std::to_string(count), std::to_string(dequeuedAtMs + leaseMs) }
+            );
+        return tasksFromDequeueReply(reply, dequeuedAtMs);
+      }
+
+      bool extendLease(redisContext *c, const std::string &queue, const Task &task, uint64_t leaseMs) override {
+        uint64_t nowMs =
+          std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+        redisReply *reply = evalScript(
+            c,
+            extendLeaseScript,
+            { queueKey(queue, "active") },
+            { uuidToString(task.uuid), std::to_string(nowMs + leaseMs) }
+            );
+        if (reply == NULL)
+          return false;
+        bool extended = reply->type == REDIS_REPLY_INTEGER && reply->integer == 1;
+        freeReplyObject(reply);
+        return extended;
+      }
+
+      bool requeue(redisContext *c, const std::string &queue, const Task &task) override {
+        redisReply *reply = evalScript(
+            c,
+            requeueScript,
+            { queueKey(queue, "active"), queueKey(queue, "pending") },
+            { queueKey(queue, "task:"), uuidToString(task.uuid), queueKey(queue, "wakeup") }
+            );
+        if (reply == NULL)
+          return false;
+        bool requeued = reply->type == REDIS_REPLY_INTEGER && reply->integer == 1;
+        freeReplyObject(reply);
+        return requeued;
+      }
+
+      // Leases carry their own deadline in the active set, `leaseMs` is not needed
+      uint64_t recoverExpired(redisContext *c, const std::string &queue, uint64_t leaseMs, uint64_t limit) override {
+        uint64_t nowMs =
+          std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+        redisReply *reply = evalScript(
+            c,
+            recoverScript,
+            { queueKey(queue, "active"), queueKey(queue, "pending"), queueKey(queue, "scheduled") },
+            { queueKey(queue, "task:"), std::to_string(nowMs), std::to_string(limit), queueKey(queue, "wakeup") }
+            );
+        if (reply == NULL)
+          return 0;
+        uint64_t count = replyToUInt(reply);
+        freeReplyObject(reply);
+        return count;
+      }
+
+      Script &ackScript() override {
+        return cppq::ackScript;
+      }
+
+      std::vector<std::string> ackKeys(const std::string &queue) const override {
+        return {
+          queueKey(queue, "active"),
+          queueKey(queue, "pending"),
+          queueKey(queue, "completed"),
+          queueKey(queue, "failed"),
+          queueKey(queue, "scheduled")
+        };
+      }
+  };
+
+  // hostname:pid
+  std::string defaultServerName() {
+    char hostname[256] = {0};
+    gethostname(hostname, sizeof(hostname) - 1);
+    return std::string(hostname) + ":" + std::to_string(getpid());
+  }
+
+  // Redis Streams layout (Redis 6.2 or later): tasks are entries of cppq:<queue>:stream, read through the consumer
+  // group streamGroup whose pending entries list tracks the leases, and cppq:<queue>:stream:entries maps the uuid of
+  // each leased task to its entry. Acks and lease extensions are O(1) and recovery (XAUTOCLAIM) only visits expired
+  // entries. A lease runs out when its entry has been idle for the recovering server's lease length, so a lease
+  // asked for at dequeue only matters through heartbeat().
+  class StreamBackend : public Backend {
+    public:
+      // With a nonzero `block` a dequeue from an empty stream waits that long for an entry (XREADGROUP BLOCK). Servers
+      // park on wakeup notifications already and hold up every other queue while blocked, so keep it 0 for them.
+      StreamBackend(std::chrono::milliseconds block = std::chrono::milliseconds(0), std::string consumer = "") :
+        block(block), consumer(consumer.empty() ? defaultServerName() : std::move(consumer)) {}
+
+      std::string layout() const override {
+        return "stream";
+      }
+
+      std::string readyKey(const std::string &queue) const override {
+        return queueKey(queue, "stream");
+      }
+
+      void appendPush(redisContext *c, const std::string &queue, const std::string &uuid) override {
+        appendCommand(c, { "XADD", readyKey(queue), "*", "uuid", uuid });
+      }
+
+      std::vector<Task> dequeue(redisContext *c, const std::string &queue, size_t count, uint64_t leaseMs) override {
+        std::vector<std::string> args = { "XREADGROUP", "GROUP", streamGroup, consumer, "COUNT", std::to_string(count) };
+        if (block.count() > 0) {
+          args.push_back("BLOCK");
+          args.push_back(std::to_string(block.count()));
+        }
+        args.push_back("STREAMS");
+        args.push_back(readyKey(queue));
+        args.push_back(">");
+
+        redisReply *reply = command(c, args);
+        if (reply != NULL && reply->type == REDIS_REPLY_ERROR && std::string(reply->str, reply->len).rfind("NOGROUP", 0) == 0) {
+          freeReplyObject(reply);
+          createGroup(c, queue);
+          reply = command(c, args);
+        }
+        if (reply == NULL)
+          return {};
+
+        uint64_t dequeuedAtMs =
+          std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        std::vector<std::string> activate = { queueKey(queue, "task:"), std::to_string(dequeuedAtMs) };
+        // [[stream, [[entry id, [field, value, ...]], ...]]], or nil when nothing was read
+        if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 1 && reply->element[0]->elements == 2) {
+          redisReply *entries = reply->element[0]->element[1];
+          for (size_t i = 0; i < entries->elements; i++) {
+            redisReply *entry = entries->element[i];
+            if (entry->elements != 2 || entry->element[1]->type != REDIS_REPLY_ARRAY || entry->element[1]->elements < 2)
+              continue;
+            activate.push_back(replyToString(entry->element[1]->element[1]));
+            activate.push_back(replyToString(entry->element[0]));
+          }
+        }
+        freeReplyObject(reply);
+        if (activate.size() == 2)
+          return {};
+
+        reply = evalScript(c, streamActivateScript, { readyKey(queue) + ":entries" }, activate);
+        return tasksFromDequeueReply(reply, dequeuedAtMs);
+      }
+
+      bool extendLease(redisContext *c, const std::string &queue, const Task &task, uint64_t leaseMs) override {
+        redisReply *reply = evalScript(
+            c,
+            streamExtendLeaseScript,
+            { readyKey(queue), readyKey(queue) + ":entries" },
+            { uuidToString(task.uuid), consumer }
+            );
+        if (reply == NULL)
+          return false;
+        bool extended = reply->type == REDIS_REPLY_INTEGER && reply->integer == 1;
+        freeReplyObject(reply);
+        return extended;
+      }
+
+      bool requeue(redisContext *c, const std::string &queue, const Task &task) override {
+        redisReply *reply = evalScript(
+            c,
+            streamRequeueScript,
+            { readyKey(queue), readyKey(queue) + ":entries" },
+            { queueKey(queue, "task:"), uuidToString(task.uuid), queueKey(queue, "wakeup") }
+            );
+        if (reply == NULL)
+          return false;
+        bool requeued = reply->type == REDIS_REPLY_INTEGER && reply->integer == 1;
+        freeReplyObject(reply);
+        return requeued;
+      }
+
+      uint64_t recoverExpired(redisContext *c, const std::string &queue, uint64_t leaseMs, uint64_t limit) override {
+        redisReply *reply = evalScript(
+            c,
+            streamRecoverScript,
+            { readyKey(queue), readyKey(queue) + ":entries", queueKey(queue, "scheduled"), readyKey(queue) + ":recovery" },
+            { queueKey(queue, "task:"), std::to_string(leaseMs), std::to_string(limit), queueKey(queue, "wakeup"), consumer }
+            );
+        if (reply == NULL)
+          return 0;
+        uint64_t count = replyToUInt(reply);
+        freeReplyObject(reply);
+        return count;
+      }
+
+      Script &ackScript() override {
+        return streamAckScript;
+      }
+
+      std::vector<std::string> ackKeys(const std::string &queue) const override {
+        return {
+          readyKey(queue),
+          readyKey(queue) + ":entries",
+          queueKey(queue, "completed"),
+          queueKey(queue, "failed"),
+          queueKey(queue, "scheduled")
+        };
+      }
+
+    private:
+      // From the start of the stream, so that tasks enqueued before any server ran are read too
+      void createGroup(redisContext *c, const std::string &queue) {
+        redisReply *reply = command(c, { "XGROUP", "CREATE", readyKey(queue), streamGroup, "0", "MKSTREAM" });
+        if (reply != NULL)
+          freeReplyObject(reply);
+      }
+
+      std::chrono::milliseconds block;
+      std::string consumer;
+  };
+
+  std::shared_ptr<Backend> listBackend = std::make_shared<ListBackend>();
+  std::map<std::string, std::shared_ptr<Backend>> queueBackends;
+
+  // Stores `queue` with `backend` in this process, queues without one use ListBackend. Set it before enqueueing to or
+  // serving the queue, in producers and servers alike. Tasks already in another layout are not moved.
+  void setQueueBackend(const std::string &queue, std::shared_ptr<Backend> backend) {
+    queueBackends[queue] = std::move(backend);
+  }
+
+  // Shards use the backend of their logical queue
+  Backend &backendFor(const std::string &queue) {
+    auto backend = queueBackends.find(queue);
+    if (backend == queueBackends.end())
+      backend = queueBackends.find(logicalQueue(queue));
+    return backend == queueBackends.end() ? *listBackend : *backend->second;
+  }
+
+  // Dequeued tasks stay leased until acknowledged or until `leaseMs` passes without extendLease(),
+  // after which recovery hands them to another worker. Like the other per-queue calls below, takes one shard of a
+  // sharded queue, see shardsOf().
+  std::vector<Task> dequeue(redisContext *c, std::string queue, size_t count, uint64_t leaseMs) {
+    return backendFor(queue).dequeue(c, queue, count, leaseMs);
+  }
+
+  std::vector<Task> dequeue(redisContext *c, std::string queue, size_t count) {
+    return dequeue(c, queue, count, defaultLeaseMs);
+  }
+
+  std::optional<Task> dequeue(redisContext *c, std::string queue) {
+    std::vector<Task> tasks = dequeue(c, queue, 1);
+    if (tasks.empty())
+      return {};
+    return std::make_optional<Task>(std::move(tasks.front()));
+  }
+
+  struct Promotion {
+    uint64_t promoted;
+    // Due time of the earliest task still in the scheduled set
+    std::optional<uint64_t> nextDueMs;
+  };
+
+  // Moves every scheduled task that is due by now to the head of pending, in batches of `limit`
+  Promotion promoteScheduled(redisContext *c, std::string queue, uint64_t limit = 1000) {
+    Promotion promotion{ 0, {} };
+    while (true) {
+      uint64_t nowMs =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+      redisReply *reply = evalScript(
+          c,
+          promoteScheduledScript,
+          { queueKey(queue, "scheduled"), backendFor(queue).readyKey(queue) },
+          { queueKey(queue, "task:"), std::to_string(nowMs), std::to_string(limit), queueKey(queue, "wakeup"), backendFor(queue).layout() }
+          );
+      if (reply == NULL)
+        return promotion;
+      if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+        freeReplyObject(reply);
+        return promotion;
+      }
+
+      uint64_t promoted = replyToUInt(reply->element[0]);
+      std::string next = replyToString(reply->element[1]);
+      freeReplyObject(reply);
+
+      promotion.promoted += promoted;
+      promotion.nextDueMs = {};
+      if (!next.empty() && next != "inf")
+        promotion.nextDueMs = strtoull(next.c_str(), NULL, 0);
+      if (promoted < limit)
+        return promotion;
+    }
+  }
+
+  void migrateScheduled(redisContext *c, std::string queue) {
+    redisReply *reply = evalScript(c, migrateScheduledScript, { queueKey(queue, "scheduled") }, { queueKey(queue, "task:") });
+    if (reply != NULL)
+      freeReplyObject(reply);
+    reply = evalScript(
+        c,
+        migrateCronScript,
+        { queueKey(queue, "scheduled"), queueKey(queue, "periodic"), queueKey(queue, "periodic:cron") },
+        { queueKey(queue, "task:") }
+        );
+    if (reply != NULL)
+      freeReplyObject(reply);
+  }
+
+  void migrateActive(redisContext *c, std::string queue, uint64_t leaseMs) {
+    redisReply *reply = evalScript(
+        c,
+        migrateActiveScript,
+        { queueKey(queue, "active") },
+        { queueKey(queue, "task:"), std::to_string(leaseMs) }
+        );
+    if (reply != NULL)
+      freeReplyObject(reply);
+  }
+
+  // Converts every task record of the queue (of all its shards) to `encoding`, SCANning `batch` keys per round trip,
+  // returns how many records were rewritten. Safe to run while servers are processing the queue.
+  uint64_t migrateTaskEncoding(redisContext *c, std::string queue, TaskEncoding encoding, size_t batch = 500) {
+    uint64_t converted = 0;
+    std::string target = encoding == TaskEncoding::Compact ? "Compact" : "Hash";
+    for (auto &shard : shardsOf(queue)) {
+      std::string cursor = "0";
+      std::string pattern = queueKey(shard, "task:*");
+      do {
+        redisReply *reply = (redisReply *)redisCommand(
+            c,
+            "SCAN %s MATCH %s COUNT %zu",
+            cursor.c_str(),
+            pattern.c_str(),
+            batch
+            );
+        if (reply == NULL)
+          throw std::runtime_error("Failed to scan task records");
+        if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+          freeReplyObject(reply);
+          throw std::runtime_error("Failed to scan task records");
+        }
+        cursor = replyToString(reply->element[0]);
+        std::vector<std::string> keys;
+        for (size_t i = 0; i < reply->element[1]->elements; i++)
+          keys.push_back(replyToString(reply->element[1]->element[i]));
+        freeReplyObject(reply);
+
+        if (keys.empty())
+          continue;
+        reply = evalScript(c, convertTaskEncodingScript, keys, { target });
+        converted += replyToUInt(reply);
+        if (reply != NULL)
+          freeReplyObject(reply);
+      } while (cursor != "0");
+    }
+    return converted;
+  }
+
+  // Returns false if the task is no longer active, e.g. because its lease already expired and it was recovered
+  bool extendLease(redisContext *c, std::string queue, const Task &task, uint64_t leaseMs) {
+    return backendFor(queue).extendLease(c, queue, task, leaseMs);
+  }
+
+  // Gives a dequeued task back without running it, it goes behind the queue's other ready tasks. Returns false if the
+  // task is no longer active.
+  bool requeue(redisContext *c, std::string queue, const Task &task) {
+    return backendFor(queue).requeue(c, queue, task);
+  }
+
+  // Reclaims every task in the queue whose lease expired, in batches of `limit`, returns how many were reclaimed.
+  // `leaseMs` only matters to backends without per-task deadlines, see Backend::recoverExpired().
+  uint64_t recoverExpired(redisContext *c, std::string queue, uint64_t limit = 1000, uint64_t leaseMs = defaultLeaseMs) {
+    Backend &backend = backendFor(queue);
+    uint64_t recovered = 0;
+    while (true) {
+      uint64_t count = backend.recoverExpired(c, queue, leaseMs, limit);
+      recovered += count;
+      if (count < limit)
+        return recovered;
+    }
+  }
+
+  // Bounded set of Redis connections shared by the server's threads. Each thread prefers the same slot
+  // on every acquire so it keeps reusing its own connection, idle connections are PINGed before reuse
+  // and broken ones are reconnected transparently.
+  class ConnectionPool {
+    public:
+      class Connection {
+        public:
+          Connection(ConnectionPool *pool, size_t slot, redisContext *c) : pool(pool), slot(slot), c(c) {}
+
+          Connection(Connection &&other) : pool(other.pool), slot(other.slot), c(other.c) {
+            other.pool = nullptr;
+          }
+
+          Connection(const Connection&) = delete;
+          Connection& operator=(const Connection&) = delete;
+          Connection& operator=(Connection&&) = delete;
+
+          ~Connection() {
+            if (pool != nullptr)
+              pool->release(slot);
+          }
+
+          // NULL when the connection could not be (re)established
+          [[nodiscard]] redisContext *get() const {
+            return c;
+          }
+
+        private:
+          ConnectionPool *pool;
+          size_t slot;
+          redisContext *c;
+      };
+
+      ConnectionPool(
+          redisOptions redisOpts,
+          size_t size,
+          std::chrono::milliseconds healthCheckAfter = std::chrono::milliseconds(30000)
+          ) : redisOpts(redisOpts), slots(size > 0 ? size : 1), healthCheckAfter(healthCheckAfter) {}
+
+      ~ConnectionPool() {
+        for (auto &slot : slots)
+          if (slot.c != NULL)
+            redisFree(slot.c);
+      }
+
+      ConnectionPool(const ConnectionPool&) = delete;
+      ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+      [[nodiscard]] size_t size() const {
+        return slots.size();
+      }
+
+      // Blocks until a slot is free
+      Connection acquire() {
+        static std::atomic<size_t> threadCount = 0;
+        thread_local size_t threadIndex = threadCount++;
+
+        size_t index;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          slot_free_cv.wait(lock, [this] { return inUse < slots.size(); });
+          index = threadIndex % slots.size();
+          while (slots[index].inUse)
+            index = (index + 1) % slots.size();
+          slots[index].inUse = true;
+          inUse++;
+        }
+
+        Slot &slot = slots[index];
+        if (slot.c != NULL && !slot.c->err && std::chrono::steady_clock::now() - slot.lastUsed > healthCheckAfter) {
+          redisReply *reply = (redisReply *)redisCommand(slot.c, "PING");
+          if (reply != NULL)
+            freeReplyObject(reply);
+        }
+        if (slot.c != NULL && slot.c->err) {
+          redisFree(slot.c);
+          slot.c = NULL;
+        }
+        if (slot.c == NULL) {
+          slot.c = redisConnectWithOptions(&redisOpts);
+          if (slot.c != NULL && slot.c->err) {
+            redisFree(slot.c);
+            slot.c = NULL;
+          }
+        }
+
+        return Connection(this, index, slot.c);
+      }
+
+    private:
+      struct Slot {
+        redisContext *c = NULL;
+        bool inUse = false;
+        std::chrono::steady_clock::time_point lastUsed = {};
+      };
+
+      void release(size_t index) {
+        {
+          const std::scoped_lock lock(mutex);
+          slots[index].inUse = false;
+          slots[index].lastUsed = std::chrono::steady_clock::now();
+          inUse--;
+        }
+        slot_free_cv.notify_one();
+      }
+
+      redisOptions redisOpts;
+      std::vector<Slot> slots;
+      std::chrono::milliseconds healthCheckAfter;
+      size_t inUse = 0;
+      std::mutex mutex = {};
+      std::condition_variable slot_free_cv = {};
+  };
+
+  // Log-linear histogram in the manner of HdrHistogram: values below 16 get a bucket each and every larger power of
+  // two is split into 16 buckets, so quantiles are within 1/16 of the recorded values over the whole uint64_t range
+  class Histogram {
+    public:
+      static constexpr size_t subBuckets = 16;
+      static constexpr size_t bucketCount = 61 * subBuckets;
+
+      static size_t bucketOf(uint64_t value) {
+        if (value < subBuckets)
+          return value;
+        size_t msb = 63 - __builtin_clzll(value);
+        return (msb - 3) * subBuckets + ((value >> (msb - 4)) & (subBuckets - 1));
+      }
+
+      // Smallest value that falls into `bucket`
+      static uint64_t lowerBound(size_t bucket) {
+        if (bucket < subBuckets)
+          return bucket;
+        return (subBuckets + bucket % subBuckets) << (bucket / subBuckets - 1);
+      }
+
+      // Largest value that falls into `bucket`
+      static uint64_t upperBound(size_t bucket) {
+        if (bucket + 1 >= bucketCount)
+          return UINT64_MAX;
+        return lowerBound(bucket + 1) - 1;
+      }
+
+      void record(uint64_t value, uint64_t n = 1) {
+        counts[bucketOf(value)] += n;
+        count += n;
+        sum += value * n;
+        max = std::max(max, value);
+      }
+
+      void merge(const Histogram &other) {
+        for (size_t i = 0; i < bucketCount; i++)
+          counts[i] += other.counts[i];
+        count += other.count;
+        sum += other.sum;
+        max = std::max(max, other.max);
+      }
+
+      // Lower bound of the bucket that holds the `q` quantile, 0 when empty
+      uint64_t quantile(double q) const {
+        if (count == 0)
+          return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * count)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucketCount; i++) {
+          seen += counts[i];
+          if (seen >= rank)
+            return std::min(lowerBound(i), max);
+        }
+        return max;
+      }
+
+      std::vector<uint64_t> counts = std::vector<uint64_t>(bucketCount);
+      uint64_t count = 0;
+      uint64_t sum = 0;
+      uint64_t max = 0;
+  };
+
+  // Histogram that one thread records into while any other reads it. With a single writer plain relaxed loads and
+  // stores suffice, so recording is a handful of uncontended memory accesses without locks or read-modify-writes.
+  class HistogramShard {
+    public:
+      void record(uint64_t value) {
+        add(counts[Histogram::bucketOf(value)], 1);
+        add(sum, value);
+        if (value > max.load(std::memory_order_relaxed))
+          max.store(value, std::memory_order_relaxed);
+      }
+
+      // The count is taken from the buckets, so a concurrent record is either wholly in the quantiles or not at all
+      void addTo(Histogram &histogram) const {
+        for (size_t i = 0; i < Histogram::bucketCount; i++) {
+          uint64_t n = counts[i].load(std::memory_order_relaxed);
+          histogram.counts[i] += n;
+          histogram.count += n;
+        }
+        histogram.sum += sum.load(std::memory_order_relaxed);
+        histogram.max = std::max(histogram.max, max.load(std::memory_order_relaxed));
+      }
+
+    private:
+      static void add(std::atomic<uint64_t> &counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+      }
+
+      std::array<std::atomic<uint64_t>, Histogram::bucketCount> counts = {};
+      std::atomic<uint64_t> sum = 0;
+      std::atomic<uint64_t> max = 0;
+  };
+
+  enum class Metric {
+    // From enqueue (or the scheduled time, or the last retry) to dequeue, in microseconds at millisecond resolution
+    QueueWait,
+    // Handler run time in microseconds
+    Execution,
+    // From the handler returning to its acknowledgement being written, in microseconds
+    AckLatency,
+    // Retries a task took by the time it completed or failed for good
+    Retries
+  };
+  const size_t metricCount = 4;
+  const char *metricNames[metricCount] = { "queue_wait_us", "execution_us", "ack_latency_us", "retries" };
+
+  enum class Outcome { Completed, Failed, Requeued };
+  const size_t outcomeCount = 3;
+  const char *outcomeNames[outcomeCount] = { "completed", "failed", "requeued" };
+
+  // One thread's accumulators for the tasks of one queue and type
+  class MetricsShard {
+    public:
+      void record(Metric metric, uint64_t value) {
+        histograms[static_cast<size_t>(metric)].record(value);
+      }
+
+      void count(Outcome outcome) {
+        std::atomic<uint64_t> &counter = outcomes[static_cast<size_t>(outcome)];
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      }
+
+      HistogramShard histograms[metricCount];
+      std::atomic<uint64_t> outcomes[outcomeCount] = {};
+  };
+
+  struct MetricsSeries {
+    Histogram histograms[metricCount];
+    uint64_t outcomes[outcomeCount] = {};
+  };
+
+  // Series by (queue, type), cumulative since the process started
+  typedef std::map<std::pair<std::string, std::string>, MetricsSeries> MetricsSnapshot;
+
+  // Per-thread sharded task metrics. Threads only ever write their own shards, snapshot() merges all of them.
+  class Metrics {
+    public:
+      Metrics() : id(nextId++) {}
+
+      Metrics(const Metrics&) = delete;
+      Metrics& operator=(const Metrics&) = delete;
+
+      // The calling thread's accumulators for tasks of `type` from `queue`. Lock-free, except the first time a thread
+      // asks for a queue and type.
+      MetricsShard &local(const std::string &queue, const std::string &type) {
+        ThreadShards &shards = threadShards();
+        auto types = shards.series.find(queue);
+        if (types != shards.series.end()) {
+          auto shard = types->second.find(type);
+          if (shard != types->second.end())
+            return *shard->second;
+        }
+        const std::scoped_lock lock(shards.mutex);
+        std::unique_ptr<MetricsShard> &shard = shards.series[queue][type];
+        shard = std::make_unique<MetricsShard>();
+        return *shard;
+      }
+
+      MetricsSnapshot snapshot() {
+        std::vector<std::shared_ptr<ThreadShards>> all;
+        {
+          const std::scoped_lock lock(mutex);
+          for (auto &[thread, shards] : threads)
+            all.push_back(shards);
+        }
+        MetricsSnapshot snapshot;
+        for (auto &shards : all) {
+          const std::scoped_lock lock(shards->mutex);
+          for (auto &[queue, types] : shards->series) {
+            for (auto &[type, shard] : types) {
+              MetricsSeries &series = snapshot[{ queue, type }];
+              for (size_t i = 0; i < metricCount; i++)
+                shard->histograms[i].addTo(series.histograms[i]);
+              for (size_t i = 0; i < outcomeCount; i++)
+                series.outcomes[i] += shard->outcomes[i].load(std::memory_order_relaxed);
+            }
+          }
+        }
+        return snapshot;
+      }
+
+    private:
+      // Only the owning thread inserts, under the mutex, so it can look up without it
+      struct ThreadShards {
+        std::mutex mutex;
+        std::map<std::string, std::map<std::string, std::unique_ptr<MetricsShard>>> series;
+      };
+
+      // A thread id that is reused inherits the shards of the exited thread, still with a single writer
+      ThreadShards &threadShards() {
+        thread_local uint64_t cachedId = 0;
+        thread_local ThreadShards *cached = nullptr;
+        if (cachedId != id) {
+          const std::scoped_lock lock(mutex);
+          std::shared_ptr<ThreadShards> &shards = threads[std::this_thread::get_id()];
+          if (shards == nullptr)
+            shards = std::make_shared<ThreadShards>();
+          cachedId = id;
+          cached = shards.get();
+        }
+        return *cached;
+      }
+
+      static inline std::atomic<uint64_t> nextId = 1;
+      const uint64_t id;
+      std::map<std::thread::id, std::shared_ptr<ThreadShards>> threads = {};
+      std::mutex mutex = {};
+  };
+
+  // What servers in this process record into
+  Metrics metrics;
+
+  std::string prometheusLabel(const std::string &value) {
+    std::string escaped;
+    for (char ch : value) {
+      if (ch == '\\' || ch == '"')
+        escaped += '\\';
+      if (ch == '\n')
+        escaped += "\\n";
+      else
+        escaped += ch;
+    }
+    return escaped;
+  }
+
+  // Renders a snapshot in the Prometheus text exposition format, with times in seconds, for an application to serve
+  std::string prometheusText(const MetricsSnapshot &snapshot) {
+    struct Family {
+      std::string name;
+      std::string help;
+      double scale;
+      std::vector<double> bounds;
+    };
+    const std::vector<double> secondBounds = { 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60, 300 };
+    const Family families[metricCount] = {
+      { "cppq_queue_wait_seconds", "Time from enqueue to dequeue.", 1e-6, secondBounds },
+      { "cppq_execution_seconds", "Handler run time.", 1e-6, secondBounds },
+      { "cppq_ack_latency_seconds", "Time from handler return to acknowledgement.", 1e-6, secondBounds },
+      { "cppq_retries", "Retries of tasks that completed or failed for good.", 1, { 0, 1, 2, 3, 5, 10 } }
+    };
+
+    std::ostringstream out;
+    for (size_t m = 0; m < metricCount; m++) {
+      const Family &family = families[m];
+      out << "# HELP " << family.name << " " << family.help << "\n";
+      out << "# TYPE " << family.name << " histogram\n";
+      for (auto &[key, series] : snapshot) {
+        std::string labels = "queue=\"" + prometheusLabel(key.first) + "\",type=\"" + prometheusLabel(key.second) + "\"";
+        const Histogram &histogram = series.histograms[m];
+        uint64_t cumulative = 0;
+        size_t bucket = 0;
+        // A bucket counts towards `le` only once all of its values are at most the bound
+        for (double bound : family.bounds) {
+          for (; bucket < Histogram::bucketCount && Histogram::upperBound(bucket) * family.scale <= bound; bucket++)
+            cumulative += histogram.counts[bucket];
+          out << family.name << "_bucket{" << labels << ",le=\"" << bound << "\"} " << cumulative << "\n";
+        }
+        out << family.name << "_bucket{" << labels << ",le=\"+Inf\"} " << histogram.count << "\n";
+        out << family.name << "_sum{" << labels << "} " << histogram.sum * family.scale << "\n";
+        out << family.name << "_count{" << labels << "} " << histogram.count << "\n";
+      }
+    }
+
+    out << "# HELP cppq_tasks_total Acknowledged tasks by outcome.\n";
+    out << "# TYPE cppq_tasks_total counter\n";
+    for (auto &[key, series] : snapshot)
+      for (size_t i = 0; i < outcomeCount; i++)
+        out << "cppq_tasks_total{queue=\"" << prometheusLabel(key.first) << "\",type=\"" << prometheusLabel(key.second)
+          << "\",outcome=\"" << outcomeNames[i] << "\"} " << series.outcomes[i] << "\n";
+    return out.str();
+  }
+
+  // {"completed": n, "failed": n, "requeued": n, "<metric>": {"count": n, "sum": n, "max": n, "buckets": [[bucket, count], ...]}, ...}
+  // with only non-empty buckets, see Histogram for their bounds
+  std::string metricsJSON(const MetricsSeries &series) {
+    std::ostringstream out;
+    out << "{";
+    for (size_t i = 0; i < outcomeCount; i++)
+      out << "\"" << outcomeNames[i] << "\":" << series.outcomes[i] << ",";
+    for (size_t m = 0; m < metricCount; m++) {
+      const Histogram &histogram = series.histograms[m];
+      out << (m > 0 ? "," : "") << "\"" << metricNames[m] << "\":{\"count\":" << histogram.count
+        << ",\"sum\":" << histogram.sum << ",\"max\":" << histogram.max << ",\"buckets\":[";
+      bool first = true;
+      for (size_t i = 0; i < Histogram::bucketCount; i++) {
+        if (histogram.counts[i] == 0)
+          continue;
+        out << (first ? "" : ",") << "[" << i << "," << histogram.counts[i] << "]";
+        first = false;
+      }
+      out << "]}";
+    }
+    out << "}";
+    return out.str();
+  }
+
+  // Stores each queue's series in the hash cppq:<queue>:metrics:<server>, one field per task type. The hashes expire
+  // after `ttl` unless written again, so servers that stop reporting drop out; the CLI and web UI merge the rest.
+  bool writeMetrics(redisContext *c, const std::string &server, const MetricsSnapshot &snapshot, std::chrono::milliseconds ttl) {
+    std::map<std::string, std::vector<std::string>> argsByQueue;
+    for (auto &[key, series] : snapshot) {
+      std::vector<std::string> &args = argsByQueue[key.first];
+      if (args.empty())
+        args = { "HSET", queueKey(key.first, "metrics:") + server };
+      args.push_back(key.second);
+      args.push_back(metricsJSON(series));
+    }
+    for (auto &[queue, args] : argsByQueue) {
+      appendCommand(c, args);
+      redisAppendCommand(c, "PEXPIRE %s %lld", args[1].c_str(), (long long)ttl.count());
+    }
+
+    bool success = true;
+    for (size_t i = 0; i < 2 * argsByQueue.size(); i++) {
+      redisReply *reply = nullptr;
+      if (redisGetReply(c, (void **)&reply) != REDIS_OK)
+        return false;
+      if (reply->type == REDIS_REPLY_ERROR)
+        success = false;
+      freeReplyObject(reply);
+    }
+    return success;
+  }
+
+  struct Completion {
+    std::string queue;
+    std::string uuid;
+    // Completed, Failed, or Pending when the task goes back for another try
+    TaskState state;
+    uint64_t retried;
+    std::string result;
+    uint8_t resultCodec = codecNone;
+    // For metrics, completions without a type are not recorded
+    std::string type = "";
+    std::chrono::steady_clock::time_point handledAt = {};
+    // Handler run time, summed into the per-minute rollups
+    uint64_t executionUs = 0;
+    // When a Pending task is due again, it waits in the scheduled set until then. Zero makes it ready right away.
+    uint64_t retryAtMs = 0;
+    // Dequeue time of the task's lease, an acknowledgement for an older lease is ignored. Zero matches any lease.
+    uint64_t dequeuedAtMs = 0;
+  };
+
+  // Coalesces task acknowledgements from the workers and writes them from a single flusher thread,
+  // at most `maxBatchSize` at a time or after `linger`, as one ackScript call per queue in one pipeline
+  class AckWriter {
+    public:
+      AckWriter(
+          ConnectionPool &connections,
+          size_t maxBatchSize = 256,
+          std::chrono::microseconds linger = std::chrono::microseconds(200)
+          ) : connections(connections), maxBatchSize(maxBatchSize > 0 ? maxBatchSize : 1), linger(linger) {
+        flusher = std::thread(&AckWriter::run, this);
+      }
+
+      ~AckWriter() {
+        {
+          const std::scoped_lock lock(mutex);
+          running = false;
+        }
+        available_cv.notify_one();
+        flusher.join();
+      }
+
+      AckWriter(const AckWriter&) = delete;
+      AckWriter& operator=(const AckWriter&) = delete;
+
+      void push(Completion completion) {
+        bool wake;
+        {
+          const std::scoped_lock lock(mutex);
+          bool first = entries.empty();
+          if (first)
+            oldest = std::chrono::steady_clock::now();
+          entries.push_back(std::move(completion));
+          // The first entry starts the linger countdown of an idle flusher, a full batch cuts it short
+          wake = first || entries.size() >= maxBatchSize;
+        }
+        if (wake)
+          available_cv.notify_one();
+      }
+
+      // Blocks until everything pushed so far has been written
+      void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        flushing = true;
+        available_cv.notify_one();
+        flushed_cv.wait(lock, [this] { return entries.empty() && !writing; });
+        flushing = false;
+      }
+
+    private:
+      void run() {
+        std::vector<Completion> batch;
+        while (true) {
+          {
+            std::unique_lock<std::mutex> lock(mutex);
+            available_cv.wait(lock, [this] { return !entries.empty() || !running; });
+            if (entries.empty())
+              return;
+            available_cv.wait_until(
+                lock,
+                oldest + linger,
+                [this] { return entries.size() >= maxBatchSize || flushing || !running; }
+                );
+            size_t count = std::min(entries.size(), maxBatchSize);
+            std::move(entries.begin(), entries.begin() + count, std::back_inserter(batch));
+            entries.erase(entries.begin(), entries.begin() + count);
+            if (!entries.empty())
+              oldest = std::chrono::steady_clock::now();
+            writing = true;
+          }
+
+          // Acks that cannot be written are retried, until then the tasks stay leased in active. Queues whose
+          // ackScript ran are not written again.
+          std::map<std::string, std::vector<std::string>> argsByQueue = ackArgs(batch);
+          while (!write(argsByQueue)) {
+            std::cerr << "Failed to write task acknowledgements to Redis" << std::endl;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+          }
+          record(batch);
+          batch.clear();
+
+          {
+            const std::scoped_lock lock(mutex);
+            writing = false;
+          }
+          flushed_cv.notify_all();
+        }
+      }
+
+      void record(const std::vector<Completion> &batch) {
+        auto now = std::chrono::steady_clock::now();
+        for (auto &completion : batch) {
+          if (completion.type.empty())
+            continue;
+          MetricsShard &series = metrics.local(logicalQueue(completion.queue), completion.type);
+          series.record(
+              Metric::AckLatency,
+              std::chrono::duration_cast<std::chrono::microseconds>(now - completion.handledAt).count()
+              );
+          if (completion.state == TaskState::Pending) {
+            series.count(Outcome::Requeued);
+          } else {
+            series.count(completion.state == TaskState::Completed ? Outcome::Completed : Outcome::Failed);
+            series.record(Metric::Retries, completion.retried);
+          }
+        }
+      }
+
+      // ackScript arguments of each queue of the batch
+      std::map<std::string, std::vector<std::string>> ackArgs(const std::vector<Completion> &batch) {
+        uint64_t finishedAtMs =
+          std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        std::map<std::string, std::vector<std::string>> argsByQueue;
+        std::map<std::string, uint64_t> executionUs;
+        for (auto &completion : batch)
+          executionUs[completion.queue] += completion.executionUs;
+        for (auto &completion : batch) {
+          auto &args = argsByQueue[completion.queue];
+          if (args.empty()) {
+            args.push_back(queueKey(completion.queue, "task:"));
+            args.push_back(queueKey(completion.queue, "wakeup"));
+            args.push_back(std::to_string(finishedAtMs));
+            args.push_back(std::to_string(statsHistory.count()));
+            args.push_back(std::to_string(executionUs[completion.queue]));
+          }
+          args.push_back(completion.uuid);
+          args.push_back(stateToString(completion.state));
+          args.push_back(std::to_string(completion.retried));
+          args.push_back(completion.result);
+          args.push_back(std::to_string(completion.resultCodec));
+          args.push_back(std::to_string(completion.retryAtMs));
+          args.push_back(std::to_string(completion.dequeuedAtMs));
+        }
+        return argsByQueue;
+      }
+
+      // Runs the ackScript of each queue in one pipeline and removes the queues it ran for, returns whether none are
+      // left. Only queues whose reply was lost or whose script was not loaded are left for another try: a script
+      // error is logged and its queue dropped, as it would fail the same way every time; its tasks stay leased until
+      // recovery takes them back.
+      bool write(std::map<std::string, std::vector<std::string>> &argsByQueue) {
+        ConnectionPool::Connection connection = connections.acquire();
+        redisContext *c = connection.get();
+        if (c == NULL)
+          return false;
+
+        for (auto &[queue, args] : argsByQueue) {
+          Script &script = backendFor(queue).ackScript();
+          if (script.getSHA().empty() && !loadScript(c, script))
+            return false;
+        }
+
+        for (int attempt = 0; attempt < 2 && !argsByQueue.empty(); attempt++) {
+          for (auto &[queue, args] : argsByQueue) {
+            Backend &backend = backendFor(queue);
+            appendScript(c, backend.ackScript().getSHA(), backend.ackKeys(queue), args);
+          }
+
+          // Queues are only removed once their reply is read, the rest are written again by the next call
+          std::set<Script *> missing;
+          for (auto it = argsByQueue.begin(); it != argsByQueue.end();) {
+            redisReply *reply = nullptr;
+            if (redisGetReply(c, (void **)&reply) != REDIS_OK)
+              return false;
+            bool retry = isNoScriptError(reply);
+            if (retry)
+              missing.insert(&backendFor(it->first).ackScript());
+            else if (reply->type == REDIS_REPLY_ERROR)
+              std::cerr << "Failed to acknowledge tasks of " << it->first << ": " << reply->str << std::endl;
+            freeReplyObject(reply);
+            it = retry ? std::next(it) : argsByQueue.erase(it);
+          }
+
+          for (Script *script : missing)
+            if (!loadScript(c, *script))
+              return false;
+        }
+
+        return argsByQueue.empty();
+      }
+
+      ConnectionPool &connections;
+      size_t maxBatchSize;
+      std::chrono::microseconds linger;
+      std::vector<Completion> entries = {};
+      std::chrono::steady_clock::time_point oldest = {};
+      std::mutex mutex = {};
+      std::condition_variable available_cv = {};
+      std::condition_variable flushed_cv = {};
+      bool running = true;
+      bool writing = false;
+      bool flushing = false;
+      std::thread flusher;
+  };
+
+  // What heartbeat() needs to know about the task running on this thread
+  struct Lease {
+    ConnectionPool *connections;
+    std::string queue;
+    uint64_t leaseMs;
+  };
+  thread_local std::optional<Lease> currentLease;
+
+  // Lets a long-running handler extend its task's lease by another lease length of the server,
+  // returns false if the lease could not be extended (see extendLease)
+  bool heartbeat(const Task &task) {
+    if (!currentLease.has_value())
+      return false;
+    ConnectionPool::Connection connection = currentLease->connections->acquire();
+    if (connection.get() == NULL)
+      return false;
+    return extendLease(connection.get(), currentLease->queue, task, currentLease->leaseMs);
+  }
+
+  // Caps how many tasks of a queue, or of a task type, run at once in this server. Names without a cap are unlimited.
+  class ConcurrencyLimits {
+    public:
+      ConcurrencyLimits(std::map<std::string, size_t> perQueue = {}, std::map<std::string, size_t> perType = {}) :
+        perQueue(std::move(perQueue)), perType(std::move(perType)) {}
+
+      // How many more tasks of `queue` may start now
+      size_t available(const std::string &queue) {
+        auto cap = perQueue.find(queue);
+        if (cap == perQueue.end())
+          return SIZE_MAX;
+        const std::scoped_lock lock(mutex);
+        return cap->second - std::min(cap->second, runningByQueue[queue]);
+      }
+
+      // Takes a slot for a task of `type` from `queue` if both have room
+      bool tryAcquire(const std::string &queue, const std::string &type) {
+        if (perQueue.empty() && perType.empty())
+          return true;
+        const std::scoped_lock lock(mutex);
+        auto queueCap = perQueue.find(queue);
+        if (queueCap != perQueue.end() && runningByQueue[queue] >= queueCap->second)
+          return false;
+        auto typeCap = perType.find(type);
+        if (typeCap != perType.end() && runningByType[type] >= typeCap->second)
+          return false;
+        runningByQueue[queue]++;
+        runningByType[type]++;
+        return true;
+      }
+
+      void release(const std::string &queue, const std::string &type) {
+        if (perQueue.empty() && perType.empty())
+          return;
+        {
+          const std::scoped_lock lock(mutex);
+          runningByQueue[queue]--;
+          runningByType[type]--;
+          releases++;
+        }
+        released_cv.notify_all();
+      }
+
+      // Number of releases so far, pass it to waitForRelease() to not miss one that happens in between
+      uint64_t releaseCount() {
+        const std::scoped_lock lock(mutex);
+        return releases;
+      }
+
+      void waitForRelease(uint64_t since, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        released_cv.wait_for(lock, timeout, [this, since] { return releases != since; });
+      }
+
+    private:
+      const std::map<std::string, size_t> perQueue;
+      const std::map<std::string, size_t> perType;
+      std::map<std::string, size_t> runningByQueue = {};
+      std::map<std::string, size_t> runningByType = {};
+      uint64_t releases = 0;
+      std::mutex mutex = {};
+      std::condition_variable released_cv = {};
+  };
+
+  // Whether the policy of the task's type retries `e`
+  bool isRetryable(const Task &task, const std::exception &e) {
+    const RetryPolicy &policy = retryPolicyFor(task.type);
+    return !policy.retryOn || policy.retryOn(e);
+  }
+
+  // Completed, or after a failure Pending for another try or Failed once out of retries; failures that are not
+  // `retryable` fail at once. Returns when a task going back for another try is due, zero for right away
+  uint64_t settleTask(Task &task, bool failed, bool retryable = true) {
+    if (!failed) {
+      task.state = TaskState::Completed;
+      return 0;
+    }
+    task.retried++;
+    task.state = task.retried >= task.maxRetry || !retryable ? TaskState::Failed : TaskState::Pending;
+    task.result.clear();
+    task.resultCodec = codecNone;
+    if (task.state == TaskState::Failed)
+      return 0;
+    std::chrono::milliseconds delay = retryDelay(retryPolicyFor(task.type), task.retried);
+    if (delay.count() == 0)
+      return 0;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        (std::chrono::system_clock::now() + delay).time_since_epoch()
+        ).count();
+  }
+
+  void taskRunner(
+      ConnectionPool &connections,
+      AckWriter &acks,
+      ConcurrencyLimits &limits,
+      Task task,
+      std::string queue,
+      uint64_t leaseMs
+      ) {
+    Handler handler = handlers[task.type];
+    // `queue` is the shard the task came from, caps and metrics are per logical queue
+    const std::string logical = logicalQueue(queue);
+
+    MetricsShard &series = metrics.local(logical, task.type);
+    // Tasks enqueued by older versions carry no enqueue time
+    if (task.enqueuedAtMs > 0) {
+      uint64_t readyAtMs = std::max(task.enqueuedAtMs, task.schedule);
+      series.record(Metric::QueueWait, (task.dequeuedAtMs - std::min(task.dequeuedAtMs, readyAtMs)) * 1000);
+    }
+
+    currentLease = Lease{ &connections, queue, leaseMs };
+    bool failed = false;
+    bool retryable = true;
+    auto startedAt = std::chrono::steady_clock::now();
+    try {
+      decompressPayload(task);
+      startedAt = std::chrono::steady_clock::now();
+      handler(task);
+      if (task.resultCodec == codecNone)
+        if (std::optional<std::string> compressed = compress(task.result, task.resultCodec))
+          task.result = std::move(compressed.value());
+    } catch(const std::exception &e) {
+      failed = true;
+      retryable = isRetryable(task, e);
+    }
+    currentLease.reset();
+    uint64_t executionUs =
+      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startedAt).count();
+    series.record(Metric::Execution, executionUs);
+
+    uint64_t retryAtMs = settleTask(task, failed, retryable);
+
+    limits.release(logical, task.type);
+    acks.push(Completion{
+        std::move(queue),
+        uuidToString(task.uuid),
+        task.state,
+        task.retried,
+        std::move(task.result),
+        task.resultCodec,
+        std::move(task.type),
+        std::chrono::steady_clock::now(),
+        executionUs,
+        retryAtMs,
+        task.dequeuedAtMs
+        });
+  }
+
+  // Ends the background loops of a server (recovery, retention, metrics reports), which sleep between rounds in wait()
+  class StopSignal {
+    public:
+      void stop() {
+        {
+          const std::scoped_lock lock(mutex);
+          stopped = true;
+        }
+        stop_cv.notify_all();
+      }
+
+      // Sleeps for `timeout`, returns false as soon as the signal is stopped
+      bool wait(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return !stop_cv.wait_for(lock, timeout, [this] { return stopped; });
+      }
+
+    private:
+      bool stopped = false;
+      std::mutex mutex = {};
+      std::condition_variable stop_cv = {};
+  };
+
+  // Sleeps before the next round of a background loop and returns whether to run it, always without a signal
+  bool nextRound(StopSignal *stop, uint64_t intervalMs) {
+    if (stop == nullptr) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+      return true;
+    }
+    return stop->wait(std::chrono::milliseconds(intervalMs));
+  }
+
+  // Threads of background loops that are stopped through `signal` and joined on destruction, so that none outlives
+  // the connections and options it was started with
+  class BackgroundThreads {
+    public:
+      BackgroundThreads() = default;
+      BackgroundThreads(const BackgroundThreads&) = delete;
+      BackgroundThreads& operator=(const BackgroundThreads&) = delete;
+
+      ~BackgroundThreads() {
+        signal.stop();
+        for (auto &thread : threads)
+          thread.join();
+      }
+
+      StopSignal signal;
+      std::vector<std::thread> threads = {};
+  };
+
+  // Cost of a sweep is proportional to the number of expired leases, not to the number of active tasks. Loops until
+  // `stop`, if given, is stopped.
+  void recovery(
+      ConnectionPool &connections,
+      std::map<std::string, int> queues,
+      uint64_t checkEveryMs,
+      uint64_t leaseMs = defaultLeaseMs,
+      StopSignal *stop = nullptr
+      ) {
+    // TODO: Consider incrementing `retried` on recovery
+    while (nextRound(stop, checkEveryMs)) {
+      ConnectionPool::Connection connection = connections.acquire();
+      redisContext *c = connection.get();
+      if (c == NULL) {
+        std::cerr << "Failed to connect to Redis" << std::endl;
+        continue;
+      }
+      for (std::map<std::string, int>::iterator it = queues.begin(); it != queues.end(); it++)
+        for (auto &shard : shardsOf(it->first))
+          recoverExpired(c, shard, 1000, leaseMs);
+    }
+  }
+
+  void recovery(redisOptions redisOpts, std::map<std::string, int> queues, uint64_t checkEveryMs, uint64_t leaseMs = defaultLeaseMs) {
+    ConnectionPool connections(redisOpts, 1);
+    recovery(connections, queues, checkEveryMs, leaseMs);
+  }
+
+  typedef struct RetentionPolicy {
+    // Most tasks kept, 0 for no limit
+    uint64_t maxCount = 0;
+    // Tasks that finished longer ago are evicted, 0 for no limit
+    std::chrono::milliseconds maxAge = std::chrono::milliseconds(0);
+  } RetentionPolicy;
+
+  typedef struct Retention {
+    RetentionPolicy completed;
+    RetentionPolicy failed;
+  } Retention;
+
+  // Receives evicted tasks before their records are deleted, eviction stops while write() returns false
+  class ArchiveSink {
+    public:
+      virtual ~ArchiveSink() = default;
+      virtual bool write(const std::string &queue, const std::vector<Task> &tasks) = 0;
+  };
+
+  std::string jsonString(const std::string &s) {
+    std::string out = "\"";
+    for (char ch : s) {
+      unsigned char u = static_cast<unsigned char>(ch);
+      if (ch == '"' || ch == '\\') {
+        out.push_back('\\');
+        out.push_back(ch);
+      } else if (u < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", u);
+        out.append(escaped);
+      } else {
+        out.push_back(ch);
+      }
+    }
+    out.push_back('"');
+    return out;
+  }
+
+  // Appends one JSON object per evicted task to a local file, payloads and results decompressed when possible
+  class FileArchive : public ArchiveSink {
+    public:
+      FileArchive(std::string path) : file(path, std::ios::out | std::ios::app | std::ios::binary) {
+        if (!file.is_open())
+          throw std::runtime_error("Failed to open archive " + path);
+      }
+
+      bool write(const std::string &queue, const std::vector<Task> &tasks) override {
+        std::string lines;
+        for (auto &task : tasks) {
+          std::string payload = task.payload, result = task.result;
+          uint8_t payloadCodec = task.payloadCodec, resultCodec = task.resultCodec;
+          try {
+            payload = decompress(payloadCodec, payload);
+            payloadCodec = codecNone;
+            result = decompress(resultCodec, result);
+            resultCodec = codecNone;
+          } catch (const std::exception &e) {
+            // Archived as stored, the codec fields tell how to read them back
+          }
+          lines += "{\"queue\":" + jsonString(queue) +
+            ",\"uuid\":" + jsonString(uuidToString(task.uuid)) +
+            ",\"type\":" + jsonString(task.type) +
+            ",\"payload\":" + jsonString(payload) +
+            ",\"state\":" + jsonString(stateToString(task.state)) +
+            ",\"maxRetry\":" + std::to_string(task.maxRetry) +
+            ",\"retried\":" + std::to_string(task.retried) +
+            ",\"dequeuedAtMs\":" + std::to_string(task.dequeuedAtMs) +
+            ",\"finishedAtMs\":" + std::to_string(task.finishedAtMs) +
+            ",\"result\":" + jsonString(result);
+          if (payloadCodec != codecNone)
+            lines += ",\"payloadCodec\":" + std::to_string(payloadCodec);
+          if (resultCodec != codecNone)
+            lines += ",\"resultCodec\":" + std::to_string(resultCodec);
+          lines += "}\n";
+        }
+        const std::scoped_lock lock(mutex);
+        file.write(lines.data(), lines.size());
+        file.flush();
+        return file.good();
+      }
+
+    private:
+      std::ofstream file;
+      std::mutex mutex;
+  };
+
+  // Evicts the tasks of one completed or failed list that exceed `policy`, `batch` at a time, archiving them first
+  // when `archive` is set. Returns how many were evicted.
+  uint64_t trimFinished(
+      redisContext *c,
+      std::string queue,
+      TaskState state,
+      RetentionPolicy policy,
+      ArchiveSink *archive = nullptr,
+      size_t batch = 500
+      ) {
+    if (policy.maxCount == 0 && policy.maxAge.count() == 0)
+      return 0;
+
+    std::string list = queueKey(queue, state == TaskState::Completed ? "completed" : "failed");
+    std::string prefix = queueKey(queue, "task:");
+    uint64_t nowMs =
+      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    uint64_t cutoffMs = policy.maxAge.count() > 0 ? nowMs - std::min<uint64_t>(nowMs - 1, policy.maxAge.count()) : 0;
+
+    uint64_t evicted = 0;
+    while (true) {
+      redisReply *reply = evalScript(
+          c,
+          retentionScanScript,
+          { list },
+          { prefix, std::to_string(policy.maxCount), std::to_string(cutoffMs), std::to_string(batch), archive ? "1" : "0" }
+          );
+      if (reply == NULL)
+        return evicted;
+      if (reply->type != REDIS_REPLY_ARRAY || reply->elements == 0) {
+        freeReplyObject(reply);
+        return evicted;
+      }
+
+      std::vector<std::string> args = { prefix };
+      std::vector<Task> tasks;
+      for (size_t i = 0; i < reply->elements; i++) {
+        redisReply *entry = reply->element[i];
+        if (archive == nullptr) {
+          args.push_back(replyToString(entry));
+          continue;
+        }
+        if (entry->type != REDIS_REPLY_ARRAY || entry->elements != 11)
+          break;
+        args.push_back(replyToString(entry->element[0]));
+        Task task(
+            args.back(),
+            replyToString(entry->element[1]),
+            replyToString(entry->element[2]),
+            replyToString(entry->element[3]),
+            replyToUInt(entry->element[4]),
+            replyToUInt(entry->element[5]),
+            replyToUInt(entry->element[6]),
+            0,
+            "",
+            replyToUInt(entry->element[9])
+            );
+        task.finishedAtMs = replyToUInt(entry->element[7]);
+        task.result = replyToString(entry->element[8]);
+        task.resultCodec = replyToUInt(entry->element[10]);
+        tasks.push_back(std::move(task));
+      }
+      size_t scanned = reply->elements;
+      freeReplyObject(reply);
+
+      if (archive != nullptr && !archive->write(queue, tasks)) {
+        std::cerr << "Failed to archive evicted tasks" << std::endl;
+        return evicted;
+      }
+
+      reply = evalScript(c, retentionEvictScript, { list }, args);
+      uint64_t removed = replyToUInt(reply);
+      if (reply != NULL)
+        freeReplyObject(reply);
+      evicted += removed;
+      if (removed < args.size() - 1 || scanned < batch)
+        return evicted;
+    }
+  }
+
+  // Enforces per-queue retention every `checkEveryMs`, see trimFinished(), until `stop` if given
+  void retention(
+      ConnectionPool &connections,
+      std::map<std::string, Retention> policies,
+      std::shared_ptr<ArchiveSink> archive,
+      uint64_t checkEveryMs,
+      size_t batch,
+      StopSignal *stop = nullptr
+      ) {
+    while (nextRound(stop, checkEveryMs)) {
+      ConnectionPool::Connection connection = connections.acquire();
+      redisContext *c = connection.get();
+      if (c == NULL) {
+        std::cerr << "Failed to connect to Redis" << std::endl;
+        continue;
+      }
+      for (auto &[queue, policy] : policies) {
+        for (auto &shard : shardsOf(queue)) {
+          trimFinished(c, shard, TaskState::Completed, policy.completed, archive.get(), batch);
+          trimFinished(c, shard, TaskState::Failed, policy.failed, archive.get(), batch);
+        }
+      }
+    }
+  }
+
+  // Writes this process's metrics snapshot every `checkEveryMs`, see writeMetrics(), until `stop` if given
+  void reportMetrics(ConnectionPool &connections, std::string server, uint64_t checkEveryMs, StopSignal *stop = nullptr) {
+    // Outlives a few missed reports
+    std::chrono::milliseconds ttl(std::max<uint64_t>(3 * checkEveryMs, 60000));
+    while (nextRound(stop, checkEveryMs)) {
+      ConnectionPool::Connection connection = connections.acquire();
+      redisContext *c = connection.get();
+      if (c == NULL) {
+        std::cerr << "Failed to connect to Redis" << std::endl;
+        continue;
+      }
+      if (!writeMetrics(c, server, metrics.snapshot(), ttl))
+        std::cerr << "Failed to write metrics to Redis" << std::endl;
+    }
+  }
+
+  // Stores `task` as the periodic definition `id` of `queue`, replacing any previous one with that id, so that it is
+  // safe to call on every start. See PeriodicScheduler. Throws std::runtime_error on an invalid cron expression.
+  void registerPeriodic(redisContext *c, std::string id, std::string cron, std::string queue, Task task) {
+    CronExpression expression(cron);
+    task.state = TaskState::Scheduled;
+    task.cron = cron;
+    uint8_t payloadCodec = task.payloadCodec;
+    std::optional<std::string> compressed = payloadCodec == codecNone ? compress(task.payload, payloadCodec) : std::nullopt;
+    std::string record = encodeTask(task, compressed.has_value() ? compressed.value() : task.payload, payloadCodec);
+
+    // A sharded queue keeps each definition on the shard its id hashes to
+    queue = shardForKey(queue, id);
+    redisAppendCommand(c, "MULTI");
+    appendCommand(c, { "HSET", queueKey(queue, "periodic"), id, record });
+    appendCommand(c, { "HSET", queueKey(queue, "periodic:cron"), id, cron });
+    redisAppendCommand(c, "EXEC");
+    if (!readEnqueueReplies(c))
+      throw std::runtime_error("Failed to register periodic task");
+  }
+
+  void unregisterPeriodic(redisContext *c, std::string id, std::string queue) {
+    queue = shardForKey(queue, id);
+    for (const char *suffix : { "periodic", "periodic:cron", "periodic:fired" }) {
+      redisReply *reply = command(c, { "HDEL", queueKey(queue, suffix), id });
+      if (reply != NULL)
+        freeReplyObject(reply);
+    }
+  }
+
+  // Hierarchical timing wheel with one-second ticks. Four levels of 64 slots cover about 194 days, anything later
+  // waits in an overflow list. Scheduling is O(1) and each entry is moved at most once per level, so thousands of
+  // pending entries cost next to nothing per tick.
+  template <typename T>
+  class TimingWheel {
+    public:
+      TimingWheel(int64_t nowSec) : now(nowSec) {}
+
+      void schedule(int64_t atSec, T item) {
+        insert(Entry{ atSec, std::move(item) });
+        count++;
+      }
+
+      // Moves time forward to `nowSec` and returns the entries that fell due as (fire time, item), earliest first
+      std::vector<std::pair<int64_t, T>> advance(int64_t nowSec) {
+        while (now < nowSec) {
+          now++;
+          // Slots of coarser levels are redistributed when their turn comes, coarsest first
+          for (int level = levels; level >= 1; level--) {
+            if ((now & ((int64_t(1) << (slotBits * level)) - 1)) != 0)
+              continue;
+            cascade(level == levels ? overflow : wheel[level][(now >> (slotBits * level)) & slotMask]);
+          }
+          std::vector<Entry> &slot = wheel[0][now & slotMask];
+          std::move(slot.begin(), slot.end(), std::back_inserter(due));
+          slot.clear();
+        }
+
+        std::sort(due.begin(), due.end(), [](const Entry &a, const Entry &b) { return a.at < b.at; });
+        std::vector<std::pair<int64_t, T>> fired;
+        for (auto &entry : due)
+          fired.emplace_back(entry.at, std::move(entry.item));
+        count -= due.size();
+        due.clear();
+        return fired;
+      }
+
+      size_t size() const {
+        return count;
+      }
+
+    private:
+      static const int slotBits = 6;
+      static const int64_t slotMask = (1 << slotBits) - 1;
+      static const int levels = 4;
+
+      struct Entry {
+        int64_t at;
+        T item;
+      };
+
+      // An entry goes to the finest level whose current block, the range of times sharing the bits above that
+      // level, contains its fire time
+      void insert(Entry entry) {
+        if (entry.at <= now) {
+          due.push_back(std::move(entry));
+          return;
+        }
+        for (int level = 0; level < levels; level++) {
+          if ((entry.at >> (slotBits * (level + 1))) == (now >> (slotBits * (level + 1)))) {
+            wheel[level][(entry.at >> (slotBits * level)) & slotMask].push_back(std::move(entry));
+            return;
+          }
+        }
+        overflow.push_back(std::move(entry));
+      }
+
+      void cascade(std::vector<Entry> &slot) {
+        std::vector<Entry> entries;
+        entries.swap(slot);
+        for (auto &entry : entries)
+          insert(std::move(entry));
+      }
+
+      int64_t now;
+      size_t count = 0;
+      std::vector<Entry> wheel[levels][1 << slotBits];
+      std::vector<Entry> overflow;
+      std::vector<Entry> due;
+  };
+
+  // Enqueues periodic tasks (see registerPeriodic and cron ScheduleOptions) at 1-second granularity. Cron expressions
+  // are parsed once per definition and upcoming fires wait in a TimingWheel. Per queue, only the server holding
+  // the `cppq:<queue>:periodic:leader` lock enqueues, and the fired hash makes every occurrence enqueue at most
+  // once even across a change of leader. Occurrences missed while no server was leading are skipped.
+  class PeriodicScheduler {
+    public:
+      PeriodicScheduler(
+          ConnectionPool &connections,
+          std::vector<std::string> queues,
+          std::chrono::milliseconds leaderLease = std::chrono::seconds(10),
+          std::chrono::milliseconds reloadInterval = std::chrono::seconds(10)
+          ) : connections(connections), queues(std::move(queues)), leaderLease(leaderLease), reloadInterval(reloadInterval),
+              wheel(nowSec()) {
+        uuid_t id;
+        uuid_generate(id);
+        holder = uuidToString(id);
+      }
+
+      ~PeriodicScheduler() {
+        stop();
+      }
+
+      PeriodicScheduler(const PeriodicScheduler&) = delete;
+      PeriodicScheduler& operator=(const PeriodicScheduler&) = delete;
+
+      // Runs the scheduler on a thread of its own until stop()
+      void start() {
+        thread = std::thread(&PeriodicScheduler::run, this);
+      }
+
+      // Makes run() return within a second, and waits for the thread start() began
+      void stop() {
+        {
+          const std::scoped_lock lock(mutex);
+          running = false;
+        }
+        stop_cv.notify_all();
+        if (thread.joinable())
+          thread.join();
+      }
+
+      // Loops until stop(), run it on a dedicated thread or use start()
+      void run() {
+        auto nextElection = std::chrono::steady_clock::now();
+        auto nextReload = nextElection + reloadInterval;
+        while (true) {
+          {
+            ConnectionPool::Connection connection = connections.acquire();
+            redisContext *c = connection.get();
+            if (c == NULL) {
+              std::cerr << "Failed to connect to Redis" << std::endl;
+            } else {
+              if (std::chrono::steady_clock::now() >= nextElection) {
+                nextElection = std::chrono::steady_clock::now() + leaderLease / 3;
+                elect(c);
+              }
+              if (std::chrono::steady_clock::now() >= nextReload) {
+                nextReload = std::chrono::steady_clock::now() + reloadInterval;
+                for (auto &queue : leading)
+                  reload(c, queue);
+              }
+              fire(c, wheel.advance(nowSec()));
+            }
+          }
+          std::unique_lock<std::mutex> lock(mutex);
+          auto nextSecond = std::chrono::system_clock::time_point(std::chrono::seconds(nowSec() + 1));
+          if (stop_cv.wait_until(lock, nextSecond, [this] { return !running; }))
+            return;
+        }
+      }
+
+    private:
+      struct Definition {
+        std::string expression;
+        CronExpression cron;
+        uint64_t generation;
+      };
+
+      // Entries of replaced or removed definitions stay in the wheel and are skipped by generation
+      struct Occurrence {
+        std::string queue;
+        std::string id;
+        uint64_t generation;
+      };
+
+      static int64_t nowSec() {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+      }
+
+      void elect(redisContext *c) {
+        for (auto &queue : queues) {
+          redisReply *reply = evalScript(
+              c,
+              leaderScript,
+              { queueKey(queue, "periodic:leader") },
+              { holder, std::to_string(leaderLease.count()) }
+              );
+          bool isLeader = replyToUInt(reply) == 1;
+          if (reply != NULL)
+            freeReplyObject(reply);
+
+          if (isLeader && leading.insert(queue).second) {
+            reload(c, queue);
+          } else if (!isLeader && leading.erase(queue) > 0) {
+            definitions.erase(queue);
+          }
+        }
+      }
+
+      // Only the cron expressions are read here, the script reads the rest of a definition when it fires
+      void reload(redisContext *c, const std::string &queue) {
+        redisReply *reply = command(c, { "HGETALL", queueKey(queue, "periodic:cron") });
+        if (reply == NULL)
+          return;
+        if (reply->type != REDIS_REPLY_ARRAY) {
+          freeReplyObject(reply);
+          return;
+        }
+
+        std::map<std::string, Definition> &queueDefinitions = definitions[queue];
+        std::set<std::string> ids;
+        for (size_t i = 0; i + 1 < reply->elements; i += 2) {
+          std::string id = replyToString(reply->element[i]);
+          std::string expression = replyToString(reply->element[i + 1]);
+          ids.insert(id);
+          auto it = queueDefinitions.find(id);
+          if (it != queueDefinitions.end() && it->second.expression == expression)
+            continue;
+          try {
+            Definition definition{ expression, CronExpression(expression), ++generation };
+            schedule(queue, id, definition, nowSec() - 1);
+            queueDefinitions.insert_or_assign(id, std::move(definition));
+          } catch (const std::exception &e) {
+            std::cerr << "Invalid periodic task " << id << ": " << e.what() << std::endl;
+          }
+        }
+        freeReplyObject(reply);
+
+        for (auto it = queueDefinitions.begin(); it != queueDefinitions.end();)
+          it = ids.count(it->first) ? std::next(it) : queueDefinitions.erase(it);
+      }
+
+      void schedule(const std::string &queue, const std::string &id, const Definition &definition, int64_t afterSec) {
+        std::optional<int64_t> next = definition.cron.next(afterSec);
+        if (next.has_value())
+          wheel.schedule(next.value(), Occurrence{ queue, id, definition.generation });
+      }
+
+      void fire(redisContext *c, std::vector<std::pair<int64_t, Occurrence>> due) {
+        std::map<std::string, std::vector<std::string>> argsByQueue;
+        for (auto &[fireSec, occurrence] : due) {
+          auto queueIt = definitions.find(occurrence.queue);
+          if (queueIt == definitions.end())
+            continue;
+          auto it = queueIt->second.find(occurrence.id);
+          if (it == queueIt->second.end() || it->second.generation != occurrence.generation)
+            continue;
+
+          auto &args = argsByQueue[occurrence.queue];
+          if (args.empty()) {
+            args.push_back(queueKey(occurrence.queue, "task:"));
+            args.push_back(queueKey(occurrence.queue, "wakeup"));
+            args.push_back(taskEncoding == TaskEncoding::Compact ? "Compact" : "Hash");
+            args.push_back(backendFor(occurrence.queue).layout());
+          }
+          uuid_t uuid;
+          uuid_generate(uuid);
+          args.push_back(occurrence.id);
+          args.push_back(std::to_string(fireSec));
+          args.push_back(uuidToString(uuid));
+          schedule(occurrence.queue, occurrence.id, it->second, std::max(fireSec, nowSec() - 1));
+        }
+
+        for (auto &[queue, args] : argsByQueue) {
+          redisReply *reply = evalScript(
+              c,
+              materializePeriodicScript,
+              {
+                backendFor(queue).readyKey(queue),
+                queueKey(queue, "periodic"),
+                queueKey(queue, "periodic:fired")
+              },
+              args
+              );
+          if (reply == NULL || reply->type == REDIS_REPLY_ERROR)
+            std::cerr << "Failed to enqueue periodic tasks of " << queue << std::endl;
+          if (reply != NULL)
+            freeReplyObject(reply);
+        }
+      }
+
+      ConnectionPool &connections;
+      std::vector<std::string> queues;
+      std::chrono::milliseconds leaderLease;
+      std::chrono::milliseconds reloadInterval;
+      std::string holder;
+      std::set<std::string> leading = {};
+      std::map<std::string, std::map<std::string, Definition>> definitions = {};
+      uint64_t generation = 0;
+      TimingWheel<Occurrence> wheel;
+      bool running = true;
+      std::mutex mutex = {};
+      std::condition_variable stop_cv = {};
+      std::thread thread = {};
+  };
+
+  const char *pausedChannel = "cppq:queues:paused";
+  // Paused queue names and a counter bumped on every change, hash-tagged so that setPaused() can update both in one
+  // transaction on Redis Cluster
+  const char *pausedKey = "cppq:{queues}:paused";
+  const char *pausedVersionKey = "cppq:{queues}:paused:version";
+
+  // Changes bump a version counter and are announced on pausedChannel, see PauseCache. Throws std::runtime_error if
+  // the change was not applied.
+  void setPaused(redisContext *c, const std::string &queue, bool paused) {
+    redisAppendCommand(c, "MULTI");
+    redisAppendCommand(c, paused ? "SADD %s %s" : "SREM %s %s", pausedKey, queue.c_str());
+    redisAppendCommand(c, "INCR %s", pausedVersionKey);
+    redisAppendCommand(c, "PUBLISH %s %s", pausedChannel, queue.c_str());
+    redisAppendCommand(c, "EXEC");
+    // A command rejected while queueing makes EXEC fail too, the first error is the one worth reporting
+    std::string error;
+    for (int i = 0; i < 5; i++) {
+      redisReply *reply = nullptr;
+      if (redisGetReply(c, (void **)&reply) != REDIS_OK)
+        throw std::runtime_error("Failed to connect to Redis");
+      if (error.empty() && reply->type == REDIS_REPLY_ERROR)
+        error = std::string(reply->str, reply->len);
+      else if (error.empty() && i == 4 && reply->type != REDIS_REPLY_ARRAY)
+        error = "transaction was not executed";
+      freeReplyObject(reply);
+    }
+    if (!error.empty())
+      throw std::runtime_error("Failed to " + std::string(paused ? "pause " : "unpause ") + queue + ": " + error);
+  }
+
+  void pause(redisContext *c, std::string queue) {
+    setPaused(c, queue, true);
+  }
+
+  void unpause(redisContext *c, std::string queue) {
+    setPaused(c, queue, false);
+  }
+
+  bool isPaused(redisContext *c, std::string queue) {
+    redisReply *reply = (redisReply *)redisCommand(c, "SISMEMBER %s %s", pausedKey, queue.c_str());
+    if (reply == NULL)
+      return false;
+    bool paused = reply->type == REDIS_REPLY_INTEGER && reply->integer == 1;
+    freeReplyObject(reply);
+    return paused;
+  }
+
+  // One-time move of the pause set from its key before it was hash-tagged
+  void migratePaused(redisContext *c) {
+    redisReply *reply = (redisReply *)redisCommand(c, "SMEMBERS cppq:queues:paused");
+    if (reply == NULL)
+      return;
+    std::vector<std::string> queues;
+    if (reply->type == REDIS_REPLY_ARRAY)
+      for (size_t i = 0; i < reply->elements; i++)
+        queues.push_back(replyToString(reply->element[i]));
+    freeReplyObject(reply);
+    if (queues.empty())
+      return;
+
+    for (auto &queue : queues)
+      setPaused(c, queue, true);
+    reply = (redisReply *)redisCommand(c, "DEL cppq:queues:paused");
+    if (reply != NULL)
+      freeReplyObject(reply);
+  }
+
+  // Of a bulk operation on failed tasks: tasks looked at so far, those requeued or deleted, and how many the failed
+  // lists held when it started
+  struct FailedProgress {
+    uint64_t examined;
+    uint64_t matched;
+    uint64_t total;
+  };
+
+  using FailedProgressCallback = std::function<void(const FailedProgress &)>;
+
+  // Goes through the failed lists of every shard of `queue` in failedBatchScript calls of `batchSize` tasks, so that
+  // Redis serves other clients between batches, reporting progress after each. Returns the final progress.
+  FailedProgress processFailed(
+      redisContext *c,
+      const std::string &queue,
+      const std::string &action,
+      const std::string &type,
+      uint64_t finishedBeforeMs,
+      FailedProgressCallback progress = nullptr,
+      uint64_t batchSize = 1000
+      ) {
+    FailedProgress done{ 0, 0, 0 };
+    std::vector<std::pair<std::string, uint64_t>> lengths;
+    for (auto &shard : shardsOf(queue)) {
+      redisReply *reply = command(c, { "LLEN", queueKey(shard, "failed") });
+      if (reply == NULL)
+        throw std::runtime_error("Failed to connect to Redis");
+      lengths.emplace_back(shard, replyToUInt(reply));
+      done.total += lengths.back().second;
+      freeReplyObject(reply);
+    }
+
+    for (auto &[shard, remaining] : lengths) {
+      Backend &backend = backendFor(shard);
+      while (remaining > 0) {
+        uint64_t nowMs =
+          std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        redisReply *reply = evalScript(
+            c,
+            failedBatchScript,
+            { queueKey(shard, "failed"), backend.readyKey(shard) },
+            {
+              queueKey(shard, "task:"), action, std::to_string(std::min(remaining, batchSize)), type,
+              std::to_string(finishedBeforeMs), backend.layout(), queueKey(shard, "wakeup"), std::to_string(nowMs)
+            }
+            );
+        if (reply == NULL)
+          throw std::runtime_error("Failed to connect to Redis");
+        if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+          freeReplyObject(reply);
+          throw std::runtime_error("Failed to " + action + " failed tasks");
+        }
+        uint64_t examined = replyToUInt(reply->element[0]);
+        done.examined += examined;
+        done.matched += replyToUInt(reply->element[1]);
+        freeReplyObject(reply);
+        if (progress)
+          progress(done);
+        // The list shrank under us, e.g. through retention
+        if (examined == 0)
+          break;
+        remaining -= std::min(remaining, examined);
+      }
+    }
+    return done;
+  }
+
+  // Makes the queue's failed tasks (of `type` only, if given) ready again with their retry count reset,
+  // returns how many
+  uint64_t requeueFailed(redisContext *c, std::string queue, std::string type = "", FailedProgressCallback progress = nullptr) {
+    return processFailed(c, queue, "requeue", type, 0, progress).matched;
+  }
+
+  // Deletes the queue's failed tasks, returns how many
+  uint64_t deleteFailed(redisContext *c, std::string queue, FailedProgressCallback progress = nullptr) {
+    return processFailed(c, queue, "delete", "", 0, progress).matched;
+  }
+
+  // Deletes the queue's tasks that failed before `time`, returns how many. Tasks without a recorded failure time
+  // count as failed at the epoch.
+  uint64_t deleteFailedBefore(
+      redisContext *c,
+      std::string queue,
+      std::chrono::system_clock::time_point time,
+      FailedProgressCallback progress = nullptr
+      ) {
+    uint64_t beforeMs = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+    return processFailed(c, queue, "delete", "", std::max<uint64_t>(beforeMs, 1), progress).matched;
+  }
+
+  // Local copy of the paused set for the fetch loop. A refresh costs one GET of the version counter, plus an
+  // SMEMBERS when it moved, and happens when a change is announced or `maxStaleness` after the last one,
+  // which bounds how long a missed announcement can go unnoticed.
+  class PauseCache {
+    public:
+      PauseCache(std::chrono::milliseconds maxStaleness = std::chrono::seconds(1)) : maxStaleness(maxStaleness) {}
+
+      bool isPaused(const std::string &queue) const {
+        return paused.count(queue) > 0;
+      }
+
+      void refresh(redisContext *c, bool changed) {
+        auto now = std::chrono::steady_clock::now();
+        if (!changed && now < nextCheck)
+          return;
+        nextCheck = now + maxStaleness;
+
+        redisReply *reply = (redisReply *)redisCommand(c, "GET %s", pausedVersionKey);
+        if (reply == NULL)
+          return;
+        std::string latest = replyToString(reply);
+        freeReplyObject(reply);
+        if (loaded && latest == version)
+          return;
+
+        reply = (redisReply *)redisCommand(c, "SMEMBERS %s", pausedKey);
+        if (reply == NULL)
+          return;
+        if (reply->type == REDIS_REPLY_ARRAY) {
+          paused.clear();
+          for (size_t i = 0; i < reply->elements; i++)
+            paused.insert(replyToString(reply->element[i]));
+          // Read before the members, so a change in between is picked up by the next refresh
+          version = latest;
+          loaded = true;
+        }
+        freeReplyObject(reply);
+      }
+
+    private:
+      std::chrono::milliseconds maxStaleness;
+      std::chrono::steady_clock::time_point nextCheck = {};
+      std::set<std::string> paused = {};
+      std::string version = "";
+      bool loaded = false;
+  };
+
+  // Subscribes to the wakeup channels of the given queues so that an idle server can park
+  // until something is enqueued instead of polling Redis, and to pause announcements
+  class WakeupListener {
+    public:
+      WakeupListener(redisOptions redisOpts, std::vector<std::string> queues) :
+        redisOpts(redisOpts), queues(queues) {
+          connect();
+        }
+
+      ~WakeupListener() {
+        if (c != NULL)
+          redisFree(c);
+      }
+
+      WakeupListener(const WakeupListener&) = delete;
+      WakeupListener& operator=(const WakeupListener&) = delete;
+
+      // Blocks until a wakeup is published on one of the queues, a queue is paused or unpaused, or the timeout
+      // elapses, returns whether it was woken up
+      bool wait(std::chrono::milliseconds timeout) {
+        if (c == NULL || c->err) {
+          // Messages may have been missed while disconnected, so let the caller re-check the queues
+          if (!connect())
+            std::this_thread::sleep_for(timeout);
+          return true;
+        }
+
+        receive(std::chrono::milliseconds(0));
+        if (!woken && !pauseChanged)
+          receive(timeout);
+        bool result = woken || pauseChanged;
+        woken = false;
+        return result;
+      }
+
+      // Returns whether pause state was announced to change since the last call, without blocking.
+      // Wakeups read meanwhile are reported by the next wait().
+      bool takePauseChange() {
+        if (c == NULL || c->err)
+          return true;
+        receive(std::chrono::milliseconds(0));
+        bool changed = pauseChanged;
+        pauseChanged = false;
+        return changed;
+      }
+
+    private:
+      bool connect() {
+        if (c != NULL)
+          redisFree(c);
+        c = redisConnectWithOptions(&redisOpts);
+        if (c == NULL || c->err)
+          return false;
+
+        for (auto &queue : queues)
+          appendCommand(c, { "SUBSCRIBE", queueKey(queue, "wakeup") });
+        redisAppendCommand(c, "SUBSCRIBE %s", pausedChannel);
+        for (size_t i = 0; i < queues.size() + 1; i++) {
+          redisReply *reply = nullptr;
+          if (redisGetReply(c, (void **)&reply) != REDIS_OK)
+            return false;
+          freeReplyObject(reply);
+        }
+        pauseChanged = true;
+        return true;
+      }
+
+      // Handles buffered messages, then waits up to `timeout` for more to arrive
+      void receive(std::chrono::milliseconds timeout) {
+        drain();
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN, .revents = 0 };
+        if (poll(&pfd, 1, timeout.count()) <= 0)
+          return;
+
+        redisReply *reply = nullptr;
+        if (redisGetReply(c, (void **)&reply) != REDIS_OK) {
+          woken = true;
+          return;
+        }
+        handle(reply);
+        drain();
+      }
+
+      void drain() {
+        redisReply *reply = nullptr;
+        while (redisGetReplyFromReader(c, (void **)&reply) == REDIS_OK && reply != NULL) {
+          handle(reply);
+          reply = nullptr;
+        }
+      }
+
+      // Messages are [message, channel, payload]
+      void handle(redisReply *reply) {
+        if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3 && replyToString(reply->element[1]) == pausedChannel)
+          pauseChanged = true;
+        else
+          woken = true;
+        freeReplyObject(reply);
+      }
+
+      redisOptions redisOpts;
+      std::vector<std::string> queues;
+      redisContext *c = NULL;
+      bool woken = false;
+      bool pauseChanged = false;
+  };
+
+  typedef struct TaskResult {
+    std::string uuid;
+    // Completed or Failed
+    TaskState state;
+    uint64_t retried;
+    // Empty for failed tasks
+    std::string result;
+    // Codec of `result` when it could not be decompressed here, codecNone otherwise
+    uint8_t resultCodec;
+  } TaskResult;
+
+  using ResultCallback = std::function<void(const TaskResult&)>;
+
+  // Delivers the outcome of awaited tasks (see the enqueue overloads below) to the process that enqueued them.
+  // Acknowledging a task as completed or failed publishes it on the listener's own channel, so one subscriber
+  // connection serves every outstanding await of the listener without polling task records. Outcomes that are
+  // published while the connection is down are read from the task records after reconnecting.
+  // Callbacks run on the listener's thread, keep them short.
+  class ResultListener {
+    public:
+      // Awaits that are not resolved within `replyTtl` stop being published, the task itself is unaffected
+      ResultListener(redisOptions redisOpts, std::chrono::milliseconds replyTtl = std::chrono::hours(24)) :
+        redisOpts(redisOpts), ttl(replyTtl) {
+        uuid_t id;
+        uuid_generate(id);
+        name = "cppq:results:" + uuidToString(id);
+        if (!connect())
+          throw std::runtime_error("Failed to connect to Redis");
+        listener = std::thread(&ResultListener::run, this);
+      }
+
+      // Futures of outstanding awaits fail with std::future_errc::broken_promise
+      ~ResultListener() {
+        running = false;
+        listener.join();
+        if (c != NULL)
+          redisFree(c);
+      }
+
+      ResultListener(const ResultListener&) = delete;
+      ResultListener& operator=(const ResultListener&) = delete;
+
+      const std::string &channel() const {
+        return name;
+      }
+
+      std::chrono::milliseconds replyTtl() const {
+        return ttl;
+      }
+
+      // Registers an await for task `uuid` of `queue` (the shard it was enqueued to). Register before the enqueue is
+      // sent, an outcome published for an unknown uuid is dropped.
+      void watch(const std::string &queue, const std::string &uuid, ResultCallback callback) {
+        const std::scoped_lock lock(mutex);
+        awaits[uuid] = Await{ queue, std::move(callback) };
+      }
+
+      std::future<TaskResult> watch(const std::string &queue, const std::string &uuid) {
+        auto promise = std::make_shared<std::promise<TaskResult>>();
+        std::future<TaskResult> future = promise->get_future();
+        watch(queue, uuid, [promise](const TaskResult &result) { promise->set_value(result); });
+        return future;
+      }
+
+      // Drops the await, its callback is not called
+      void cancel(const std::string &uuid) {
+        const std::scoped_lock lock(mutex);
+        awaits.erase(uuid);
+      }
+
+      size_t outstanding() {
+        const std::scoped_lock lock(mutex);
+        return awaits.size();
+      }
+
+    private:
+      struct Await {
+        std::string queue;
+        ResultCallback callback;
+      };
+
+      bool connect() {
+        if (c != NULL)
+          redisFree(c);
+        c = redisConnectWithOptions(&redisOpts);
+        if (c == NULL || c->err)
+          return false;
+        redisReply *reply = command(c, { "SUBSCRIBE", name });
+        if (reply == NULL)
+          return false;
+        freeReplyObject(reply);
+        return true;
+      }
+
+      void run() {
+        while (running) {
+          if (c == NULL || c->err) {
+            if (!connect()) {
+              std::this_thread::sleep_for(std::chrono::milliseconds(100));
+              continue;
+            }
+            recheck();
+          }
+
+          // Bounded so that the destructor does not wait long
+          struct pollfd pfd = { .fd = c->fd, .events = POLLIN, .revents = 0 };
+          if (poll(&pfd, 1, 100) <= 0)
+            continue;
+          redisReply *reply = nullptr;
+          if (redisGetReply(c, (void **)&reply) != REDIS_OK)
+            continue;
+          while (reply != NULL) {
+            handle(reply);
+            reply = nullptr;
+            if (redisGetReplyFromReader(c, (void **)&reply) != REDIS_OK)
+              break;
+          }
+        }
+      }
+
+      // Messages are [message, channel, "<uuid> <state> <retried> <result codec> <result>"]
+      void handle(redisReply *reply) {
+        if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3) {
+          std::string message = replyToString(reply->element[2]);
+          size_t state = message.find(' ');
+          size_t retried = message.find(' ', state + 1);
+          size_t codec = message.find(' ', retried + 1);
+          size_t result = message.find(' ', codec + 1);
+          if (result != std::string::npos)
+            resolve(
+                message.substr(0, state),
+                message.substr(state + 1, retried - state - 1),
+                message.substr(retried + 1, codec - retried - 1),
+                message.substr(codec + 1, result - codec - 1),
+                message.substr(result + 1)
+                );
+        }
+        freeReplyObject(reply);
+      }
+
+      // Reads the outcome of every outstanding await over a separate connection, the subscribed one cannot run commands
+      void recheck() {
+        std::vector<std::pair<std::string, std::string>> pending;
+        {
+          const std::scoped_lock lock(mutex);
+          for (auto &[uuid, await] : awaits)
+            pending.emplace_back(uuid, await.queue);
+        }
+        if (pending.empty())
+          return;
+
+        redisContext *rc = redisConnectWithOptions(&redisOpts);
+        if (rc == NULL || rc->err) {
+          if (rc != NULL)
+            redisFree(rc);
+          // Retried with the next reconnect
+          redisFree(c);
+          c = NULL;
+          return;
+        }
+        for (auto &[uuid, queue] : pending) {
+          redisReply *reply = evalScript(rc, taskResultScript, { queueKey(queue, "task:" + uuid), queueKey(queue, "reply:" + uuid) }, {});
+          if (reply != NULL && reply->type == REDIS_REPLY_ARRAY && reply->elements == 4) {
+            std::string state = replyToString(reply->element[0]);
+            if (state == "Completed" || state == "Failed")
+              resolve(
+                  uuid,
+                  state,
+                  replyToString(reply->element[1]),
+                  replyToString(reply->element[3]),
+                  replyToString(reply->element[2])
+                  );
+          }
+          if (reply != NULL)
+            freeReplyObject(reply);
+        }
+        redisFree(rc);
+      }
+
+      void resolve(const std::string &uuid, const std::string &state, const std::string &retried, const std::string &codec, std::string result) {
+        ResultCallback callback;
+        {
+          const std::scoped_lock lock(mutex);
+          auto await = awaits.find(uuid);
+          if (await == awaits.end())
+            return;
+          callback = std::move(await->second.callback);
+          awaits.erase(await);
+        }
+
+        TaskResult outcome{ uuid, stringToState(state), strtoull(retried.c_str(), NULL, 10), std::move(result), codecNone };
+        uint8_t resultCodec = strtoul(codec.c_str(), NULL, 10);
+        try {
+          outcome.result = decompress(resultCodec, outcome.result);
+        } catch (const std::exception &e) {
+          outcome.resultCodec = resultCodec;
+        }
+        callback(outcome);
+      }
+
+      redisOptions redisOpts;
+      std::chrono::milliseconds ttl;
+      std::string name;
+      redisContext *c = NULL;
+      std::atomic<bool> running = true;
+      std::map<std::string, Await> awaits = {};
+      std::mutex mutex = {};
+      std::thread listener;
+  };
+
+  // Enqueues `task` and calls `callback` with its outcome once it completed or failed for good, see ResultListener.
+  // Throws std::runtime_error for periodic tasks, which have no single outcome.
+  void enqueue(
+      redisContext *c,
+      Task task,
+      std::string queue,
+      ScheduleOptions s,
+      ResultListener &results,
+      ResultCallback callback
+      ) {
+    if (s.type == ScheduleType::Cron)
+      throw std::runtime_error("Periodic tasks cannot be awaited");
+    std::string uuid = uuidToString(task.uuid);
+    std::string shard = appendEnqueue(c, task, queue, s, results.channel(), results.replyTtl());
+    results.watch(shard, uuid, std::move(callback));
+    appendWakeup(c, shard);
+    bool success = readEnqueueReplies(c);
+    readWakeupReply(c);
+    if (!success) {
+      results.cancel(uuid);
+      throw std::runtime_error("Failed to enqueue task");
+    }
+  }
+
+  void enqueue(redisContext *c, Task task, std::string queue, ResultListener &results, ResultCallback callback) {
+    enqueue(c, std::move(task), queue, ScheduleOptions{ .cron = "", .type = ScheduleType::None }, results, std::move(callback));
+  }
+
+  std::future<TaskResult> enqueue(redisContext *c, Task task, std::string queue, ScheduleOptions s, ResultListener &results) {
+    auto promise = std::make_shared<std::promise<TaskResult>>();
+    std::future<TaskResult> future = promise->get_future();
+    enqueue(c, std::move(task), queue, s, results, [promise](const TaskResult &result) { promise->set_value(result); });
+    return future;
+  }
+
+  std::future<TaskResult> enqueue(redisContext *c, Task task, std::string queue, ResultListener &results) {
+    return enqueue(c, std::move(task), queue, ScheduleOptions{ .cron = "", .type = ScheduleType::None }, results);
+  }
+
+  // Fixed-capacity FIFO used by the fetch loop to hold prefetched tasks until a worker frees up
+  template <typename T>
+    class RingBuffer {
+      public:
+        RingBuffer(size_t capacity) : items(capacity > 0 ? capacity : 1) {}
+
+        [[nodiscard]] size_t size() const {
+          return count;
+        }
+
+        [[nodiscard]] size_t capacity() const {
+          return items.size();
+        }
+
+        [[nodiscard]] bool empty() const {
+          return count == 0;
+        }
+
+        [[nodiscard]] bool full() const {
+          return count == items.size();
+        }
+
+        void push(T item) {
+          items[(head + count) % items.size()].emplace(std::move(item));
+          count++;
+        }
+
+        T pop() {
+          T item = std::move(items[head].value());
+          items[head].reset();
+          head = (head + 1) % items.size();
+          count--;
+          return item;
+        }
+
+      private:
+        std::vector<std::optional<T>> items;
+        size_t head = 0;
+        size_t count = 0;
+    };
+
+  // Decides how each fetch window is split between the server's queues
+  class QueueSelector {
+    public:
+      virtual ~QueueSelector() = default;
+
+      // Called once by runServer with the queues and their weights, highest weight first
+      virtual void init(const std::vector<std::pair<std::string, int>> &queues) {
+        this->queues = queues;
+        for (auto &queue : queues)
+          counters[queue.first] = 0;
+      }
+
+      // How many of `window` tasks to fetch from each queue, in the order to fetch them. Whatever the queues
+      // cannot fill is offered to them again in the same order, so idle workers never wait on a quota.
+      virtual std::vector<std::pair<std::string, size_t>> plan(size_t window) = 0;
+
+      // Outcome of a planned fetch, fewer than `requested` means the queue ran dry
+      virtual void fetched(const std::string &queue, size_t requested, size_t count) {}
+
+      void countDispatch(const std::string &queue) {
+        counters.at(queue)++;
+      }
+
+      // Tasks handed to workers per queue since init, to check the achieved ratios
+      std::map<std::string, uint64_t> dispatchCounts() const {
+        std::map<std::string, uint64_t> counts;
+        for (auto &[queue, count] : counters)
+          counts[queue] = count.load();
+        return counts;
+      }
+
+    protected:
+      std::vector<std::pair<std::string, int>> queues;
+
+    private:
+      std::map<std::string, std::atomic<uint64_t>> counters;
+  };
+
+  // Always serves the highest-weight queue that has tasks, lower ones only get what it leaves
+  class StrictPrioritySelector : public QueueSelector {
+    public:
+      std::vector<std::pair<std::string, size_t>> plan(size_t window) override {
+        std::vector<std::pair<std::string, size_t>> plan;
+        for (auto &queue : queues)
+          plan.emplace_back(queue.first, window);
+        return plan;
+      }
+  };
+
+  // Splits every window in proportion to the weights with smooth weighted round robin, so that no queue is
+  // starved and the split evens out across windows that are smaller than the sum of the weights
+  class WeightedRoundRobinSelector : public QueueSelector {
+    public:
+      void init(const std::vector<std::pair<std::string, int>> &queues) override {
+        QueueSelector::init(queues);
+        current.assign(queues.size(), 0);
+      }
+
+      std::vector<std::pair<std::string, size_t>> plan(size_t window) override {
+        std::vector<size_t> counts(queues.size(), 0);
+        int64_t total = 0;
+        for (auto &queue : queues)
+          total += std::max(queue.second, 1);
+        for (size_t slot = 0; slot < window && !queues.empty(); slot++) {
+          size_t best = 0;
+          for (size_t i = 0; i < queues.size(); i++) {
+            current[i] += std::max(queues[i].second, 1);
+            if (current[i] > current[best])
+              best = i;
+          }
+          current[best] -= total;
+          counts[best]++;
+        }
+
+        std::vector<std::pair<std::string, size_t>> plan;
+        for (size_t i = 0; i < queues.size(); i++)
+          plan.emplace_back(queues[i].first, counts[i]);
+        return plan;
+      }
+
+    private:
+      std::vector<int64_t> current;
+  };
+
+  // Deficit round robin: every round each queue earns its weight's share of the window as credit and spends one
+  // per fetched task, credit of a queue that ran dry is dropped. The starting queue rotates between rounds.
+  class DeficitRoundRobinSelector : public QueueSelector {
+    public:
+      void init(const std::vector<std::pair<std::string, int>> &queues) override {
+        QueueSelector::init(queues);
+        deficits.clear();
+        for (auto &queue : queues)
+          deficits[queue.first] = 0;
+      }
+
+      std::vector<std::pair<std::string, size_t>> plan(size_t window) override {
+        std::vector<std::pair<std::string, size_t>> plan;
+        if (queues.empty())
+          return plan;
+        double total = 0;
+        for (auto &queue : queues)
+          total += std::max(queue.second, 1);
+        for (size_t i = 0; i < queues.size(); i++) {
+          auto &queue = queues[(cursor + i) % queues.size()];
+          double &deficit = deficits[queue.first];
+          // Credit that could not be spent because the window was full is capped
+          deficit = std::min(deficit + window * std::max(queue.second, 1) / total, 2.0 * window);
+          plan.emplace_back(queue.first, static_cast<size_t>(deficit));
+        }
+        cursor = (cursor + 1) % queues.size();
+        return plan;
+      }
+
+      void fetched(const std::string &queue, size_t requested, size_t count) override {
+        double &deficit = deficits[queue];
+        deficit = count < requested ? 0 : deficit - count;
+      }
+
+    private:
+      std::map<std::string, double> deficits;
+      size_t cursor = 0;
+  };
+
+  typedef struct ServerOptions {
+    // How many tasks may be fetched beyond the number of idle workers. Prefetched tasks are already
+    // active in Redis, so keep this small to avoid hiding work from other servers.
+    size_t prefetchLookahead = 4;
+    // Upper bound on the number of tasks taken from one queue in a single round trip
+    size_t maxFetchBatch = 64;
+    // Finished tasks are acknowledged in batches of up to ackBatchSize, waiting at most ackLinger to fill one
+    size_t ackBatchSize = 256;
+    std::chrono::microseconds ackLinger = std::chrono::microseconds(200);
+    // Per-queue limits on completed and failed tasks, queues without an entry keep them forever
+    std::map<std::string, Retention> retention = {};
+    // When set, tasks evicted by retention are written here before they are deleted
+    std::shared_ptr<ArchiveSink> archive = nullptr;
+    std::chrono::milliseconds retentionInterval = std::chrono::seconds(10);
+    // Tasks evicted per script call, bounds how long Redis is blocked by a single trim
+    size_t retentionBatchSize = 500;
+    // Longest a pause or unpause can go unnoticed when its announcement is missed
+    std::chrono::milliseconds pauseCheckInterval = std::chrono::seconds(1);
+    // How fetches are split between queues, StrictPrioritySelector when unset
+    std::shared_ptr<QueueSelector> selector = nullptr;
+    // Most tasks of a queue, or of a task type, that run at once in this server; others wait in the prefetch buffer,
+    // for up to a second if workers are idle, then go back to their queue
+    std::map<std::string, size_t> queueConcurrency = {};
+    std::map<std::string, size_t> typeConcurrency = {};
+    // Whether this server takes part in enqueueing periodic tasks, see PeriodicScheduler
+    bool periodic = true;
+    // A leader that stops renewing its lock is replaced after this long
+    std::chrono::milliseconds periodicLeaderLease = std::chrono::seconds(10);
+    // How often the metrics snapshot is written to Redis for the CLI and web UI, 0 to not write it
+    std::chrono::milliseconds metricsInterval = std::chrono::seconds(10);
+    // Names this server's metrics snapshot, hostname:pid when empty
+    std::string serverName = "";
+  } ServerOptions;
+
+  void runServer(
+      redisOptions redisOpts,
+      std::map<std::string, int> queues,
+      uint64_t recoveryTimeoutSecond,
+      ServerOptions options = ServerOptions()
+      ) {
+    thread_pool pool;
+    // One connection per worker plus the fetch loop, recovery, retention, the periodic scheduler, metrics and the ack writer
+    ConnectionPool connections(redisOpts, pool.get_thread_count() + 6);
+    AckWriter acks(connections, options.ackBatchSize, options.ackLinger);
+
+    std::optional<ConnectionPool::Connection> connection = connections.acquire();
+    redisContext *c = connection->get();
+    if (c == NULL) {
+      std::cerr << "Failed to connect to Redis" << std::endl;
+      return;
+    }
+
+    try {
+      loadScripts(c);
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return;
+    }
+
+    std::vector<std::pair<std::string, int>> queuesVector;
+    for (auto& it : queues) queuesVector.push_back(it);
+    sort(
+        queuesVector.begin(),
+        queuesVector.end(),
+        [](std::pair<std::string, int> const& a, std::pair<std::string, int> const& b) { return a.second > b.second; }
+        );
+
+    for (auto it = queuesVector.begin(); it != queuesVector.end(); it++) {
+      redisCommand(c, "SADD cppq:queues %s:%d", it->first.c_str(), it->second);
+      // Where the CLI and web UI find the queue's keys
+      std::string layout = keyNaming == KeyNaming::HashTagged ? "hashtagged" : "plain";
+      redisReply *reply = command(c, { "HSET", "cppq:queues:layout", it->first, layout + ":" + std::to_string(shardsOf(it->first).size()) });
+      if (reply != NULL)
+        freeReplyObject(reply);
+    }
+
+    std::vector<std::string> queueNames;
+    for (auto &it : queuesVector) queueNames.push_back(it.first);
+    // Queues are selected, paused and capped by name, their shards are what is fetched from and maintained
+    std::map<std::string, std::vector<std::string>> shardsByQueue;
+    std::map<std::string, size_t> shardCursors;
+    std::vector<std::string> shardNames;
+    for (auto &queue : queueNames) {
+      shardsByQueue[queue] = shardsOf(queue);
+      shardNames.insert(shardNames.end(), shardsByQueue[queue].begin(), shardsByQueue[queue].end());
+    }
+    WakeupListener listener(redisOpts, shardNames);
+
+    const uint64_t leaseMs = recoveryTimeoutSecond * 1000;
+
+    for (auto &shard : shardNames) {
+      migrateScheduled(c, shard);
+      migrateActive(c, shard, leaseMs);
+    }
+    migratePaused(c);
+
+    connection.reset();
+
+    // Stopped and joined by its destructor should the loop below throw, before the connections go away
+    BackgroundThreads background;
+    background.threads.emplace_back(
+        static_cast<void (*)(ConnectionPool&, std::map<std::string, int>, uint64_t, uint64_t, StopSignal*)>(recovery),
+        std::ref(connections),
+        queues,
+        1000,
+        leaseMs,
+        &background.signal
+        );
+
+    if (!options.retention.empty())
+      background.threads.emplace_back(
+          retention,
+          std::ref(connections),
+          options.retention,
+          options.archive,
+          options.retentionInterval.count(),
+          options.retentionBatchSize,
+          &background.signal
+          );
+
+    if (options.metricsInterval.count() > 0)
+      background.threads.emplace_back(
+          reportMetrics,
+          std::ref(connections),
+          options.serverName.empty() ? defaultServerName() : options.serverName,
+          options.metricsInterval.count(),
+          &background.signal
+          );
+
+    PeriodicScheduler scheduler(connections, shardNames, options.periodicLeaderLease);
+    // Stopped and joined by its destructor should the loop below throw
+    if (options.periodic)
+      scheduler.start();
+
+    // Scheduled sets are re-checked when the earliest task falls due, after a wakeup (which may
+    // carry a newly scheduled task) and at least once a second to pick up other producers' schedules
+    const auto maxPromotionInterval = std::chrono::milliseconds(1000);
+    auto nextPromotion = std::chrono::system_clock::now();
+
+    RingBuffer<std::pair<Task, std::string>> buffer(pool.get_thread_count() + options.prefetchLookahead);
+    std::map<std::string, size_t> bufferedByQueue;
+    PauseCache pauses(options.pauseCheckInterval);
+
+    std::shared_ptr<QueueSelector> selector = options.selector;
+    if (selector == nullptr)
+      selector = std::make_shared<StrictPrioritySelector>();
+    selector->init(queuesVector);
+    ConcurrencyLimits limits(options.queueConcurrency, options.typeConcurrency);
+
+    // Waits for a worker to free up, or, when workers are idle because every buffered task is over a
+    // concurrency cap, for a running task to finish
+    auto waitForProgress = [&](uint64_t releasesBefore) {
+      if (pool.get_tasks_total() < pool.get_thread_count())
+        limits.waitForRelease(releasesBefore, maxPromotionInterval);
+      else
+        pool.wait_for_idle_thread();
+    };
+
+    while (true) {
+      connection.reset();
+      connection.emplace(connections.acquire());
+      c = connection->get();
+      if (c == NULL) {
+        std::cerr << "Failed to connect to Redis" << std::endl;
+        std::this_thread::sleep_for(maxPromotionInterval);
+        continue;
+      }
+
+      if (std::chrono::system_clock::now() >= nextPromotion) {
+        nextPromotion = std::chrono::system_clock::now() + maxPromotionInterval;
+        for (auto &shard : shardNames) {
+          Promotion promotion = promoteScheduled(c, shard);
+          if (promotion.nextDueMs.has_value())
+            nextPromotion = std::min(
+                nextPromotion,
+                std::chrono::system_clock::time_point(std::chrono::milliseconds(promotion.nextDueMs.value()))
+                );
+        }
+      }
+
+      // Start buffered tasks on idle workers, those over a concurrency cap go back to the end of the buffer. Buffered
+      // leases are not extended, so tasks held for half their lease go back to their queue, and so do capped ones that
+      // kept idle workers from fetching for a while.
+      uint64_t releasesBefore = limits.releaseCount();
+      uint64_t nowMs =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+      for (size_t n = buffer.size(); n > 0; n--) {
+        auto [task, shard] = buffer.pop();
+        std::string queue = logicalQueue(shard);
+        bool idle = pool.get_tasks_total() < pool.get_thread_count();
+        if (!idle || !limits.tryAcquire(queue, task.type)) {
+          uint64_t heldMs = nowMs - std::min(nowMs, task.dequeuedAtMs);
+          if (heldMs * 2 < leaseMs && (!idle || heldMs < static_cast<uint64_t>(maxPromotionInterval.count()))) {
+            buffer.push({ std::move(task), std::move(shard) });
+            continue;
+          }
+          requeue(c, shard, task);
+          bufferedByQueue[queue]--;
+          continue;
+        }
+        bufferedByQueue[queue]--;
+        selector->countDispatch(queue);
+        pool.push_task(
+            taskRunner,
+            std::ref(connections),
+            std::ref(acks),
+            std::ref(limits),
+            std::move(task),
+            std::move(shard),
+            leaseMs
+            );
+      }
+
+      // Fetch window: idle workers plus the lookahead, minus what is already buffered
+      size_t idle = pool.get_thread_count() - std::min<size_t>(pool.get_tasks_total(), pool.get_thread_count());
+      size_t window = std::min(idle + options.prefetchLookahead, buffer.capacity());
+      if (buffer.size() >= window) {
+        waitForProgress(releasesBefore);
+        continue;
+      }
+
+      pauses.refresh(c, listener.takePauseChange());
+
+      // Fill the window as the selector plans, then offer what is left to the queues that did not run dry,
+      // park when all of them are empty
+      size_t fetched = 0;
+      bool capped = false;
+      std::set<std::string> dry;
+      // Returns how many tasks were asked for and how many came back
+      auto fetch = [&](const std::string &queue, size_t quota) {
+        size_t room = limits.available(queue);
+        room -= std::min(room, bufferedByQueue[queue]);
+        capped = capped || room == 0;
+        size_t count = std::min({ quota, window - buffer.size(), options.maxFetchBatch, room });
+        if (count == 0)
+          return std::make_pair(count, count);
+        // Shards are tried in rotation, each fetch starting one further than the previous one
+        std::vector<std::string> &shards = shardsByQueue[queue];
+        size_t &cursor = shardCursors[queue];
+        size_t received = 0;
+        for (size_t i = 0; i < shards.size() && received < count; i++) {
+          const std::string &shard = shards[(cursor + i) % shards.size()];
+          std::vector<Task> tasks = dequeue(c, shard, count - received, leaseMs);
+          received += tasks.size();
+          for (auto &task : tasks)
+            buffer.push({ std::move(task), shard });
+        }
+        cursor = (cursor + 1) % shards.size();
+        if (received < count)
+          dry.insert(queue);
+        bufferedByQueue[queue] += received;
+        fetched += received;
+        return std::make_pair(count, received);
+      };
+      for (auto &[queue, quota] : selector->plan(window - buffer.size())) {
+        if (buffer.size() >= window)
+          break;
+        if (pauses.isPaused(queue) || quota == 0)
+          continue;
+        auto [requested, received] = fetch(queue, quota);
+        if (requested > 0)
+          selector->fetched(queue, requested, received);
+      }
+      for (auto &queue : queueNames) {
+        if (buffer.size() >= window)
+          break;
+        if (!pauses.isPaused(queue) && !dry.count(queue))
+          fetch(queue, window);
+      }
+
+      // Queues are drained or capped but workers are busy with what was fetched earlier
+      if (fetched == 0 && (!buffer.empty() || capped)) {
+        waitForProgress(releasesBefore);
+        continue;
+      }
+
+      // Bounded so that scheduled tasks of other producers and missed pause announcements are noticed
+      if (fetched == 0) {
+        auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(nextPromotion - std::chrono::system_clock::now());
+        timeout = std::clamp(timeout, std::chrono::milliseconds(0), maxPromotionInterval);
+        if (listener.wait(timeout))
+          nextPromotion = std::chrono::system_clock::now();
+      }
+    }
+  }
+
+  // Bounded lock-free multi-producer multi-consumer queue after Dmitry Vyukov: every cell carries a sequence number
+  // that tells producers and consumers whose turn it is, so each side only contends on one position counter
+  template <typename T>
+  class MPMCQueue {
+    public:
+      // Capacity is rounded up to a power of two
+      explicit MPMCQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity)
+          size <<= 1;
+        cells = std::make_unique<Cell[]>(size);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++)
+          cells[i].sequence.store(i, std::memory_order_relaxed);
+      }
+
+      MPMCQueue(const MPMCQueue&) = delete;
+      MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+      // Moves from `value` only if there was room
+      bool tryPush(T &value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        while (true) {
+          Cell &cell = cells[position & mask];
+          size_t sequence = cell.sequence.load(std::memory_order_acquire);
+          intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+          if (diff == 0) {
+            if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+              cell.value.emplace(std::move(value));
+              cell.sequence.store(position + 1, std::memory_order_release);
+              return true;
+            }
+          } else if (diff < 0) {
+            return false;
+          } else {
+            position = tail.load(std::memory_order_relaxed);
+          }
+        }
+      }
+
+      std::optional<T> tryPop() {
+        size_t position = head.load(std::memory_order_relaxed);
+        while (true) {
+          Cell &cell = cells[position & mask];
+          size_t sequence = cell.sequence.load(std::memory_order_acquire);
+          intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+          if (diff == 0) {
+            if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+              std::optional<T> value = std::move(cell.value);
+              cell.value.reset();
+              cell.sequence.store(position + mask + 1, std::memory_order_release);
+              return value;
+            }
+          } else if (diff < 0) {
+            return {};
+          } else {
+            position = head.load(std::memory_order_relaxed);
+          }
+        }
+      }
+
+      // Approximate while other threads push or pop
+      size_t size() const {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_relaxed);
+        return t > h ? t - h : 0;
+      }
+
+    private:
+      struct Cell {
+        std::atomic<size_t> sequence;
+        std::optional<T> value;
+      };
+
+      std::unique_ptr<Cell[]> cells;
+      size_t mask;
+      alignas(64) std::atomic<size_t> head = 0;
+      alignas(64) std::atomic<size_t> tail = 0;
+  };
+
+  uint32_t crc32(const char *data, size_t size) {
+    static const std::array<uint32_t, 256> table = [] {
+      std::array<uint32_t, 256> table = {};
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+          crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+        table[i] = crc;
+      }
+      return table;
+    }();
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; i++)
+      crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+    return ~crc;
+  }
+
+  // Write-ahead log of fixed-size segment files that are memory-mapped while appended to. An append is a copy into
+  // the mapping under a mutex; a syncer thread msyncs whatever was appended during the last groupCommitInterval in
+  // one go (group commit) and writers that need durability wait for it. Segments are rotated when full and deleted,
+  // oldest first, once every record retained in them is released.
+  // Segment layout: an 8 byte magic, then records of u32 body length, u32 CRC-32 of kind and body, u8 kind and the
+  // body. Files are zero-filled, so a zero length ends a segment; a torn record ends it too.
+  class WriteAheadLog {
+    public:
+      static constexpr const char *magic = "CPPQWAL1";
+      static const size_t recordHeaderSize = 9;
+
+      WriteAheadLog(std::string directory, size_t segmentSize, std::chrono::microseconds groupCommitInterval) :
+        directory(std::move(directory)), segmentSize(segmentSize), groupCommitInterval(groupCommitInterval) {
+        std::filesystem::create_directories(this->directory);
+      }
+
+      ~WriteAheadLog() {
+        {
+          const std::scoped_lock lock(mutex);
+          running = false;
+        }
+        sync_cv.notify_one();
+        if (syncer.joinable())
+          syncer.join();
+        if (current != nullptr)
+          msync(current->data, offset, MS_SYNC);
+      }
+
+      WriteAheadLog(const WriteAheadLog&) = delete;
+      WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+      // Calls `visit` with the kind and body of every intact record in the existing segments, oldest first. Call it
+      // before open(), whose first segment follows the replayed ones.
+      void replay(const std::function<void(uint8_t, const std::string&)> &visit) {
+        for (uint64_t id : segmentIds()) {
+          nextId = std::max(nextId, id + 1);
+          int fd = ::open(path(id).c_str(), O_RDONLY);
+          if (fd < 0)
+            throw std::runtime_error("Failed to open WAL segment " + path(id));
+          size_t size = lseek(fd, 0, SEEK_END);
+          void *mapped = size < 8 ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+          close(fd);
+          if (mapped == MAP_FAILED)
+            continue;
+          const char *data = static_cast<const char *>(mapped);
+          if (std::memcmp(data, magic, 8) == 0) {
+            for (size_t position = 8; position + recordHeaderSize <= size;) {
+              uint32_t length, crc;
+              std::memcpy(&length, data + position, 4);
+              std::memcpy(&crc, data + position + 4, 4);
+              if (length == 0 || position + recordHeaderSize + length > size)
+                break;
+              if (crc32(data + position + 8, length + 1) != crc)
+                break;
+              visit(static_cast<uint8_t>(data[position + 8]), std::string(data + position + recordHeaderSize, length));
+              position += recordHeaderSize + length;
+            }
+          }
+          munmap(mapped, size);
+        }
+      }
+
+      // Starts appending to a new segment and the syncer thread. Older segments stay until dropReplayed().
+      void open() {
+        const std::scoped_lock lock(mutex);
+        rotate();
+        syncer = std::thread(&WriteAheadLog::runSyncer, this);
+      }
+
+      // Deletes the segments that replay() read, once what is still needed from them has been appended again
+      void dropReplayed() {
+        uint64_t end;
+        {
+          const std::scoped_lock lock(mutex);
+          end = position();
+        }
+        sync(end);
+        const std::scoped_lock lock(mutex);
+        for (uint64_t id : segmentIds())
+          if (id < current->id)
+            std::filesystem::remove(path(id));
+      }
+
+      // Returns the segment the record went to, which must be released later if `retain` is set, and the log
+      // position right after it for sync()
+      std::pair<uint64_t, uint64_t> append(uint8_t kind, const std::string &body, bool retain) {
+        size_t size = recordHeaderSize + body.size();
+        if (8 + size > segmentSize)
+          throw std::runtime_error("Record does not fit in a WAL segment");
+
+        const std::scoped_lock lock(mutex);
+        if (offset + size > segmentSize)
+          rotate();
+        char *record = current->data + offset;
+        record[8] = static_cast<char>(kind);
+        std::memcpy(record + recordHeaderSize, body.data(), body.size());
+        uint32_t crc = crc32(record + 8, body.size() + 1);
+        uint32_t length = body.size();
+        std::memcpy(record + 4, &crc, 4);
+        std::memcpy(record, &length, 4);
+        offset += size;
+        if (retain)
+          live[current->id]++;
+        return { current->id, position() };
+      }
+
+      // Blocks until everything up to `position` is on disk
+      void sync(uint64_t position) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (synced >= position)
+          return;
+        syncRequested = true;
+        sync_cv.notify_one();
+        synced_cv.wait(lock, [this, position] { return synced >= position || !running; });
+      }
+
+      void release(uint64_t segment) {
+        const std::scoped_lock lock(mutex);
+        live[segment]--;
+        for (auto it = live.begin(); it != live.end() && it->first != current->id && it->second == 0;) {
+          std::filesystem::remove(path(it->first));
+          it = live.erase(it);
+        }
+      }
+
+    private:
+      struct Segment {
+        Segment(uint64_t id, int fd, char *data, size_t size) : id(id), fd(fd), data(data), size(size) {}
+
+        ~Segment() {
+          munmap(data, size);
+          close(fd);
+        }
+
+        uint64_t id;
+        int fd;
+        char *data;
+        size_t size;
+      };
+
+      std::string path(uint64_t id) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu.wal", (unsigned long long)id);
+        return directory + "/" + name;
+      }
+
+      std::vector<uint64_t> segmentIds() const {
+        std::vector<uint64_t> ids;
+        for (auto &entry : std::filesystem::directory_iterator(directory))
+          if (entry.path().extension() == ".wal")
+            ids.push_back(strtoull(entry.path().stem().c_str(), NULL, 10));
+        std::sort(ids.begin(), ids.end());
+        return ids;
+      }
+
+      // Global position of the end of the current segment's records
+      uint64_t position() const {
+        return current->id * segmentSize + offset;
+      }
+
+      // Called with the mutex held. The previous segment is synced right away, rotations are rare enough.
+      void rotate() {
+        if (current != nullptr) {
+          msync(current->data, offset, MS_SYNC);
+          synced = std::max(synced, position());
+          synced_cv.notify_all();
+        }
+
+        uint64_t id = nextId++;
+        int fd = ::open(path(id).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, segmentSize) != 0)
+          throw std::runtime_error("Failed to create WAL segment " + path(id));
+        void *data = mmap(NULL, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+          close(fd);
+          throw std::runtime_error("Failed to map WAL segment " + path(id));
+        }
+        current = std::make_shared<Segment>(id, fd, static_cast<char *>(data), segmentSize);
+        std::memcpy(current->data, magic, 8);
+        offset = 8;
+        live.emplace(id, 0);
+      }
+
+      void runSyncer() {
+        const size_t pageSize = sysconf(_SC_PAGESIZE);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running) {
+          sync_cv.wait_for(lock, groupCommitInterval, [this] { return syncRequested || !running; });
+          // Gather the writes of concurrent appenders into this sync
+          if (syncRequested) {
+            lock.unlock();
+            std::this_thread::sleep_for(groupCommitInterval);
+            lock.lock();
+          }
+          syncRequested = false;
+          uint64_t target = position();
+          if (target <= synced)
+            continue;
+
+          // The mapping stays valid through a concurrent rotation, which syncs the rest of it itself
+          std::shared_ptr<Segment> segment = current;
+          size_t from = synced > segment->id * segmentSize ? synced - segment->id * segmentSize : 0;
+          from -= from % pageSize;
+          size_t to = offset;
+          lock.unlock();
+          msync(segment->data + from, to - from, MS_SYNC);
+          lock.lock();
+          synced = std::max(synced, target);
+          synced_cv.notify_all();
+        }
+        synced_cv.notify_all();
+      }
+
+      const std::string directory;
+      const size_t segmentSize;
+      const std::chrono::microseconds groupCommitInterval;
+      std::shared_ptr<Segment> current = nullptr;
+      size_t offset = 0;
+      uint64_t nextId = 0;
+      uint64_t synced = 0;
+      bool syncRequested = false;
+      bool running = true;
+      // Retained records per segment, for deletion
+      std::map<uint64_t, uint64_t> live = {};
+      std::mutex mutex = {};
+      std::condition_variable sync_cv = {};
+      std::condition_variable synced_cv = {};
+      std::thread syncer;
+  };
+
+  typedef struct EmbeddedOptions {
+    // Size of each WAL segment file, a task (with its payload) must fit in one
+    size_t segmentSize = 64 << 20;
+    // How long the WAL gathers writes into one msync
+    std::chrono::microseconds groupCommitInterval = std::chrono::microseconds(1000);
+    // Whether enqueue returns only once its task is on disk; otherwise a crash can lose the last groupCommitInterval
+    bool waitForSync = true;
+    // Ready tasks each queue holds before enqueue waits for workers to catch up; recovered and retried tasks spill
+    // past it instead of waiting
+    size_t queueCapacity = 1 << 16;
+    // Called for every task that completed or failed for good, with the handler's result; nothing else keeps it
+    std::function<void(const Task&, const std::string&)> onFinished = nullptr;
+  } EmbeddedOptions;
+
+  // A task handed to a worker of the embedded broker, pass it back to EmbeddedBroker::finish()
+  struct Delivery {
+    Task task;
+    std::string queue;
+    // WAL segment holding the task's enqueue record
+    uint64_t segment;
+  };
+
+  // Queues within the process instead of Redis, for single-node deployments and local development. Tasks are handed
+  // to workers through a lock-free MPMCQueue per queue; durability comes from a WriteAheadLog in `directory` that is
+  // replayed on construction, so tasks that were pending, scheduled or running when the process stopped are run again.
+  // Results are not stored, see EmbeddedOptions::onFinished. Periodic tasks, pausing and concurrency caps need Redis.
+  class EmbeddedBroker {
+    public:
+      EmbeddedBroker(std::string directory, std::vector<std::string> queues, EmbeddedOptions options = EmbeddedOptions()) :
+        options(options), wal(std::move(directory), options.segmentSize, options.groupCommitInterval) {
+        for (auto &queue : queues)
+          this->queues.emplace(queue, std::make_unique<ReadyQueue>(options.queueCapacity));
+        recover();
+      }
+
+      EmbeddedBroker(const EmbeddedBroker&) = delete;
+      EmbeddedBroker& operator=(const EmbeddedBroker&) = delete;
+
+      // Throws std::runtime_error for queues the broker was not created with and for cron schedules
+      void enqueue(Task task, const std::string &queue, ScheduleOptions s) {
+        if (s.type == ScheduleType::Cron)
+          throw std::runtime_error("Periodic tasks need Redis");
+        if (queues.find(queue) == queues.end())
+          throw std::runtime_error("Unknown queue " + queue);
+
+        task.enqueuedAtMs = nowMs();
+        if (s.type == ScheduleType::TimePoint) {
+          task.state = TaskState::Scheduled;
+          task.schedule = std::chrono::duration_cast<std::chrono::milliseconds>(s.time.time_since_epoch()).count();
+        } else {
+          task.state = TaskState::Pending;
+        }
+
+        auto [segment, position] = wal.append(walEnqueue, enqueueRecord(task, queue), true);
+        bool scheduled = task.state == TaskState::Scheduled;
+        Delivery delivery{ std::move(task), queue, segment };
+        if (scheduled)
+          schedule(std::move(delivery));
+        else
+          push(std::move(delivery), true);
+        if (options.waitForSync)
+          wal.sync(position);
+      }
+
+      void enqueue(Task task, const std::string &queue) {
+        enqueue(std::move(task), queue, ScheduleOptions{ .cron = "", .type = ScheduleType::None });
+      }
+
+      // Tasks that spilled past queueCapacity go first, they were queued before the ones waiting in the ring
+      std::optional<Delivery> tryDequeue(const std::string &queue) {
+        auto it = queues.find(queue);
+        if (it == queues.end())
+          return {};
+        ReadyQueue &ready = *it->second;
+        std::optional<Delivery> delivery;
+        if (ready.overflowSize.load() > 0) {
+          const std::scoped_lock lock(ready.overflowMutex);
+          if (!ready.overflow.empty()) {
+            delivery = std::move(ready.overflow.front());
+            ready.overflow.pop_front();
+            ready.overflowSize.fetch_sub(1);
+          }
+        }
+        if (!delivery.has_value()) {
+          delivery = ready.ring.tryPop();
+          if (delivery.has_value() && ready.waiting.load() > 0) {
+            const std::scoped_lock lock(ready.roomMutex);
+            ready.room_cv.notify_one();
+          }
+        }
+        if (delivery.has_value()) {
+          delivery->task.state = TaskState::Active;
+          delivery->task.dequeuedAtMs = nowMs();
+        }
+        return delivery;
+      }
+
+      // Takes the task back with its state settled (see settleTask()): Pending ones are queued again, Scheduled ones
+      // (delayed retries) when their schedule is due
+      void finish(Delivery delivery) {
+        wal.append(walFinish, finishRecord(delivery.task), false);
+        if (delivery.task.state == TaskState::Pending || delivery.task.state == TaskState::Scheduled) {
+          delivery.task.enqueuedAtMs = nowMs();
+          if (delivery.task.state == TaskState::Scheduled)
+            schedule(std::move(delivery));
+          else
+            push(std::move(delivery), false);
+          return;
+        }
+        wal.release(delivery.segment);
+        if (options.onFinished)
+          options.onFinished(delivery.task, delivery.queue);
+      }
+
+      // Queues the scheduled tasks that are due, returns when the next one is
+      std::optional<std::chrono::system_clock::time_point> promoteScheduled() {
+        uint64_t now = nowMs();
+        std::vector<Delivery> due;
+        std::optional<std::chrono::system_clock::time_point> next;
+        {
+          const std::scoped_lock lock(scheduledMutex);
+          while (!scheduled.empty() && scheduled.begin()->first <= now) {
+            due.push_back(std::move(scheduled.begin()->second));
+            scheduled.erase(scheduled.begin());
+          }
+          if (!scheduled.empty())
+            next = std::chrono::system_clock::time_point(std::chrono::milliseconds(scheduled.begin()->first));
+        }
+        for (auto &delivery : due) {
+          delivery.task.state = TaskState::Pending;
+          push(std::move(delivery), false);
+        }
+        return next;
+      }
+
+      // Blocks until a task may have been queued since `pushesSeen` (see pushCount()), or for at most `timeout`
+      void waitForTasks(uint64_t pushesSeen, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        sleepers.fetch_add(1);
+        if (pushes.load() == pushesSeen)
+          idle_cv.wait_for(lock, timeout);
+        sleepers.fetch_sub(1);
+      }
+
+      uint64_t pushCount() const {
+        return pushes.load();
+      }
+
+      // Blocks until a scheduled task may be due or `timeout` passes
+      void waitForSchedule(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(scheduledMutex);
+        scheduled_cv.wait_for(lock, timeout);
+      }
+
+      // Set on threads that run handlers, whose enqueues go past queueCapacity instead of waiting for room that only
+      // workers make
+      inline static thread_local bool handlerThread = false;
+
+    private:
+      static const uint8_t walEnqueue = 1;
+      static const uint8_t walFinish = 2;
+
+      struct ReadyQueue {
+        explicit ReadyQueue(size_t capacity) : ring(capacity) {}
+
+        MPMCQueue<Delivery> ring;
+        // Unbounded, taken before the ring while not empty
+        std::deque<Delivery> overflow = {};
+        std::mutex overflowMutex = {};
+        std::atomic<size_t> overflowSize = 0;
+        // Enqueues waiting for room in the ring, woken by tryDequeue()
+        std::atomic<size_t> waiting = 0;
+        std::mutex roomMutex = {};
+        std::condition_variable room_cv = {};
+      };
+
+      static uint64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+      }
+
+      // 16 byte uuid, u32 queue length, queue, compact task record (see encodeTask())
+      static std::string enqueueRecord(const Task &task, const std::string &queue) {
+        std::string record(reinterpret_cast<const char *>(task.uuid), sizeof(uuid_t));
+        appendUInt(record, queue.size(), 4);
+        record += queue;
+        record += encodeTask(task);
+        return record;
+      }
+
+      // 16 byte uuid, u8 state, u64 retried, u64 schedule (logs of earlier versions end at retried)
+      static std::string finishRecord(const Task &task) {
+        std::string record(reinterpret_cast<const char *>(task.uuid), sizeof(uuid_t));
+        appendUInt(record, static_cast<uint8_t>(task.state), 1);
+        appendUInt(record, task.retried, 8);
+        appendUInt(record, task.schedule, 8);
+        return record;
+      }
+
+      // Rebuilds the unfinished tasks from the log, appends them to a fresh segment and drops the old ones, so a
+      // long-lived task does not keep segments of long-finished ones around
+      void recover() {
+        std::vector<std::pair<std::string, Task>> tasks;
+        std::map<std::string, size_t> index;
+        wal.replay([&](uint8_t kind, const std::string &record) {
+          if (kind == walEnqueue && record.size() >= sizeof(uuid_t) + 4) {
+            uuid_t uuid;
+            std::memcpy(uuid, record.data(), sizeof(uuid_t));
+            size_t length = readUInt(record, sizeof(uuid_t), 4);
+            std::string queue = record.substr(sizeof(uuid_t) + 4, length);
+            Task task(uuidToString(uuid), record.substr(sizeof(uuid_t) + 4 + length));
+            index[uuidToString(uuid)] = tasks.size();
+            tasks.emplace_back(std::move(queue), std::move(task));
+          } else if (kind == walFinish && (record.size() == sizeof(uuid_t) + 9 || record.size() == sizeof(uuid_t) + 17)) {
+            uuid_t uuid;
+            std::memcpy(uuid, record.data(), sizeof(uuid_t));
+            auto it = index.find(uuidToString(uuid));
+            if (it == index.end())
+              return;
+            TaskState state = static_cast<TaskState>(static_cast<uint8_t>(record[sizeof(uuid_t)]));
+            if (state == TaskState::Pending || state == TaskState::Scheduled) {
+              Task &task = tasks[it->second].second;
+              task.retried = readUInt(record, sizeof(uuid_t) + 1, 8);
+              task.state = state;
+              if (state == TaskState::Scheduled)
+                task.schedule = readUInt(record, sizeof(uuid_t) + 9, 8);
+            } else {
+              tasks[it->second].first.clear();
+              index.erase(it);
+            }
+          }
+        });
+
+        wal.open();
+        for (auto &[queue, task] : tasks) {
+          if (queue.empty())
+            continue;
+          if (queues.find(queue) == queues.end())
+            queues.emplace(queue, std::make_unique<ReadyQueue>(options.queueCapacity));
+          if (task.state != TaskState::Scheduled)
+            task.state = TaskState::Pending;
+          uint64_t segment = wal.append(walEnqueue, enqueueRecord(task, queue), true).first;
+          bool isScheduled = task.state == TaskState::Scheduled;
+          Delivery delivery{ std::move(task), queue, segment };
+          if (isScheduled)
+            schedule(std::move(delivery));
+          else
+            push(std::move(delivery), false);
+        }
+        wal.dropReplayed();
+      }
+
+      // Waits for room when workers fall behind and `wait` is set, otherwise spills to the overflow. Recovery, retries,
+      // promotion and enqueues from handlers must not wait: they may run on the workers that would make room, or hold
+      // more than fits.
+      void push(Delivery delivery, bool wait) {
+        ReadyQueue &ready = *queues.at(delivery.queue);
+        if (!ready.ring.tryPush(delivery)) {
+          if (wait && !handlerThread) {
+            std::unique_lock<std::mutex> lock(ready.roomMutex);
+            ready.waiting.fetch_add(1);
+            // Bounded, a dequeue between a failed push and the wait would otherwise go unnoticed
+            while (!ready.ring.tryPush(delivery))
+              ready.room_cv.wait_for(lock, std::chrono::milliseconds(10));
+            ready.waiting.fetch_sub(1);
+          } else {
+            const std::scoped_lock lock(ready.overflowMutex);
+            ready.overflow.push_back(std::move(delivery));
+            ready.overflowSize.fetch_add(1);
+          }
+        }
+        pushes.fetch_add(1);
+        if (sleepers.load() > 0) {
+          const std::scoped_lock lock(idleMutex);
+          idle_cv.notify_one();
+        }
+      }
+
+      void schedule(Delivery delivery) {
+        {
+          const std::scoped_lock lock(scheduledMutex);
+          scheduled.emplace(delivery.task.schedule, std::move(delivery));
+        }
+        scheduled_cv.notify_one();
+      }
+
+      EmbeddedOptions options;
+      WriteAheadLog wal;
+      // Not modified once recovered, so lookups need no lock
+      std::map<std::string, std::unique_ptr<ReadyQueue>> queues = {};
+      std::multimap<uint64_t, Delivery> scheduled = {};
+      std::mutex scheduledMutex = {};
+      std::condition_variable scheduled_cv = {};
+      std::atomic<uint64_t> pushes = 0;
+      std::atomic<uint64_t> sleepers = 0;
+      std::mutex idleMutex = {};
+      std::condition_variable idle_cv = {};
+  };
+
+  // runServer() for an EmbeddedBroker: `threads` workers (hardware concurrency when 0) each take the next task from
+  // the highest priority queue that has one and run its handler. Loops forever promoting scheduled tasks.
+  void runServer(EmbeddedBroker &broker, std::map<std::string, int> queues, size_t threads = 0) {
+    std::vector<std::pair<std::string, int>> queuesVector(queues.begin(), queues.end());
+    sort(
+        queuesVector.begin(),
+        queuesVector.end(),
+        [](std::pair<std::string, int> const& a, std::pair<std::string, int> const& b) { return a.second > b.second; }
+        );
+    std::vector<std::string> queueNames;
+    for (auto &it : queuesVector) queueNames.push_back(it.first);
+
+    std::atomic<bool> running = true;
+    auto work = [&broker, &running, queueNames] {
+      EmbeddedBroker::handlerThread = true;
+      while (running.load()) {
+        uint64_t pushesSeen = broker.pushCount();
+        std::optional<Delivery> delivery;
+        for (auto &queue : queueNames)
+          if ((delivery = broker.tryDequeue(queue)).has_value())
+            break;
+        if (!delivery.has_value()) {
+          broker.waitForTasks(pushesSeen, std::chrono::milliseconds(100));
+          continue;
+        }
+
+        Task &task = delivery->task;
+        MetricsShard &series = metrics.local(delivery->queue, task.type);
+        series.record(Metric::QueueWait, (task.dequeuedAtMs - std::min(task.dequeuedAtMs, std::max(task.enqueuedAtMs, task.schedule))) * 1000);
+        bool failed = false;
+        bool retryable = true;
+        auto startedAt = std::chrono::steady_clock::now();
+        try {
+          handlers.at(task.type)(task);
+        } catch(const std::exception &e) {
+          failed = true;
+          retryable = isRetryable(task, e);
+        }
+        series.record(
+            Metric::Execution,
+            std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startedAt).count()
+            );
+        if (uint64_t retryAtMs = settleTask(task, failed, retryable)) {
+          task.state = TaskState::Scheduled;
+          task.schedule = retryAtMs;
+        }
+        if (task.state == TaskState::Pending || task.state == TaskState::Scheduled) {
+          series.count(Outcome::Requeued);
+        } else {
+          series.count(task.state == TaskState::Completed ? Outcome::Completed : Outcome::Failed);
+          series.record(Metric::Retries, task.retried);
+        }
+        broker.finish(std::move(delivery.value()));
+      }
+    };
+
+    // Stopped and joined should the loop below throw, so that no worker outlives the broker
+    struct Workers {
+      std::atomic<bool> &running;
+      std::vector<std::thread> threads = {};
+
+      ~Workers() {
+        running = false;
+        for (auto &thread : threads)
+          thread.join();
+      }
+    } workers{ running };
+    if (threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < threads; i++)
+      workers.threads.emplace_back(work);
+
+    while (true) {
+      std::optional<std::chrono::system_clock::time_point> next = broker.promoteScheduled();
+      auto timeout = std::chrono::milliseconds(1000);
+      if (next.has_value())
+        timeout = std::clamp(
+            std::chrono::duration_cast<std::chrono::milliseconds>(next.value() - std::chrono::system_clock::now()),
+            std::chrono::milliseconds(0),
+            timeout
+            );
+      broker.waitForSchedule(timeout);
+    }
+  }
+}
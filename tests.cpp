@@ -112,7 +112,7 @@ void testDequeue() {
   assert(dequeued.value().retried == 0);
   assert(dequeued.value().dequeuedAtMs != 0);
 
-  redisReply *reply = (redisReply *)redisCommand(c, "LRANGE cppq:default:active -1 -1");
+  redisReply *reply = (redisReply *)redisCommand(c, "ZRANGE cppq:default:active 0 -1");
   if (reply->type != REDIS_REPLY_ARRAY)
     assert(false);
   if (reply->elements == 0)
@@ -123,6 +123,931 @@ void testDequeue() {
   assert(uuid.compare(cppq::uuidToString(dequeued.value().uuid)) == 0);
 }
 
+void testEnqueueBatch() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  std::vector<cppq::Task> tasks;
+  for (int i = 0; i < 100; i++)
+    tasks.push_back(NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = i, .TemplateID = "AH"}));
+
+  cppq::enqueueBatch(c, tasks, "default");
+
+  redisReply *reply = (redisReply *)redisCommand(c, "LLEN cppq:default:pending");
+  assert(reply->type == REDIS_REPLY_INTEGER && reply->integer == 100);
+
+  std::optional<cppq::Task> dequeued = cppq::dequeue(c, "default");
+  assert(dequeued.has_value());
+  assert(cppq::uuidToString(dequeued.value().uuid).compare(cppq::uuidToString(tasks[0].uuid)) == 0);
+}
+
+void testProducer() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  std::vector<std::future<void>> futures;
+  {
+    cppq::Producer producer(options, std::chrono::microseconds(500), 64);
+    for (int i = 0; i < 1000; i++)
+      futures.push_back(producer.enqueue(NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = i, .TemplateID = "AH"}), "default"));
+    producer.flush();
+  }
+
+  for (auto &future : futures)
+    future.get();
+
+  redisReply *reply = (redisReply *)redisCommand(c, "LLEN cppq:default:pending");
+  assert(reply->type == REDIS_REPLY_INTEGER && reply->integer == 1000);
+
+  // A lone enqueue is written once the linger passes, without a flush
+  cppq::Producer producer(options, std::chrono::milliseconds(50), 64);
+  std::future<void> enqueued = producer.enqueue(NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 0, .TemplateID = "BH"}), "default");
+  assert(enqueued.wait_for(std::chrono::milliseconds(500)) == std::future_status::ready);
+  enqueued.get();
+  reply = (redisReply *)redisCommand(c, "LLEN cppq:default:pending");
+  assert(reply->integer == 1001);
+}
+
+void testSchedule() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  cppq::Task due = NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 666, .TemplateID = "AH"});
+  cppq::Task later = NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 606, .TemplateID = "BH"});
+
+  cppq::enqueue(c, due, "default", cppq::scheduleOptions(std::chrono::system_clock::now() - std::chrono::seconds(1)));
+  cppq::enqueue(c, later, "default", cppq::scheduleOptions(std::chrono::system_clock::now() + std::chrono::minutes(1)));
+
+  assert(!cppq::dequeue(c, "default").has_value());
+
+  cppq::Promotion promotion = cppq::promoteScheduled(c, "default");
+  assert(promotion.promoted == 1);
+  assert(promotion.nextDueMs.has_value());
+
+  std::optional<cppq::Task> dequeued = cppq::dequeue(c, "default");
+  assert(dequeued.has_value());
+  assert(cppq::uuidToString(dequeued.value().uuid).compare(cppq::uuidToString(due.uuid)) == 0);
+  assert(dequeued.value().schedule != 0);
+
+  redisReply *reply = (redisReply *)redisCommand(c, "ZCARD cppq:default:scheduled");
+  assert(reply->type == REDIS_REPLY_INTEGER && reply->integer == 1);
+}
+
+void testLease() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  cppq::Task task = NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 666, .TemplateID = "AH"});
+
+  cppq::enqueue(c, task, "default");
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, "default", 1, 1);
+  assert(dequeued.size() == 1);
+
+  assert(cppq::extendLease(c, "default", dequeued[0], 60000));
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  assert(cppq::recoverExpired(c, "default") == 0);
+
+  assert(cppq::extendLease(c, "default", dequeued[0], 0));
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  assert(cppq::recoverExpired(c, "default") == 1);
+  assert(!cppq::extendLease(c, "default", dequeued[0], 60000));
+
+  // Handed back unrun, it goes behind the task enqueued since
+  cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 667, .TemplateID = "AH"}), "default");
+  dequeued = cppq::dequeue(c, "default", 1);
+  assert(dequeued.size() == 1);
+  assert(cppq::requeue(c, "default", dequeued[0]));
+  assert(!cppq::requeue(c, "default", dequeued[0]));
+  redisReply *reply = (redisReply *)redisCommand(c, "ZCARD cppq:default:active");
+  assert(reply->integer == 0);
+  dequeued = cppq::dequeue(c, "default", 2);
+  assert(dequeued.size() == 2);
+  assert(uuid_compare(dequeued[1].uuid, task.uuid) == 0);
+}
+
+void testAckWriter() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  for (int i = 0; i < 3; i++)
+    cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = i, .TemplateID = "AH"}), "default");
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, "default", 3);
+  assert(dequeued.size() == 3);
+
+  cppq::ConnectionPool connections(options, 1);
+  cppq::AckWriter acks(connections);
+  acks.push(cppq::Completion{ "default", cppq::uuidToString(dequeued[0].uuid), cppq::TaskState::Completed, 0, "{}" });
+  acks.push(cppq::Completion{ "default", cppq::uuidToString(dequeued[1].uuid), cppq::TaskState::Failed, 10, "" });
+  acks.push(cppq::Completion{ "default", cppq::uuidToString(dequeued[2].uuid), cppq::TaskState::Pending, 1, "" });
+  acks.flush();
+
+  redisReply *reply = (redisReply *)redisCommand(c, "ZCARD cppq:default:active");
+  assert(reply->integer == 0);
+  reply = (redisReply *)redisCommand(c, "LLEN cppq:default:completed");
+  assert(reply->integer == 1);
+  reply = (redisReply *)redisCommand(c, "LLEN cppq:default:failed");
+  assert(reply->integer == 1);
+  reply = (redisReply *)redisCommand(c, "LLEN cppq:default:pending");
+  assert(reply->integer == 1);
+  reply = (redisReply *)redisCommand(c, "HGET cppq:default:task:%s result", cppq::uuidToString(dequeued[0].uuid).c_str());
+  assert(std::string(reply->str).compare("{}") == 0);
+
+  // A lone acknowledgement is written once the linger passes, without a flush
+  cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 3, .TemplateID = "AH"}), "default");
+  dequeued = cppq::dequeue(c, "default", 1);
+  cppq::AckWriter lingering(connections, 256, std::chrono::milliseconds(50));
+  lingering.push(cppq::Completion{ "default", cppq::uuidToString(dequeued[0].uuid), cppq::TaskState::Completed, 0, "{}" });
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  reply = (redisReply *)redisCommand(c, "LLEN cppq:default:completed");
+  assert(reply->integer == 2);
+
+  // Acks for a lease that is gone change nothing: a repeated one, and one from before recovery took the task back
+  acks.push(cppq::Completion{ "default", cppq::uuidToString(dequeued[0].uuid), cppq::TaskState::Completed, 0, "{}" });
+  cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 4, .TemplateID = "AH"}), "default");
+  std::vector<cppq::Task> expired = cppq::dequeue(c, "default", 1, 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  assert(cppq::recoverExpired(c, "default") == 1);
+  assert(cppq::dequeue(c, "default", 2).size() == 2);
+  cppq::Completion stale{ "default", cppq::uuidToString(expired[0].uuid), cppq::TaskState::Completed, 0, "{}" };
+  stale.dequeuedAtMs = expired[0].dequeuedAtMs;
+  acks.push(stale);
+  acks.flush();
+  reply = (redisReply *)redisCommand(c, "LLEN cppq:default:completed");
+  assert(reply->integer == 2);
+  reply = (redisReply *)redisCommand(c, "ZCARD cppq:default:active");
+  assert(reply->integer == 2);
+}
+
+void testCompactEncoding() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  cppq::Task task = NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 666, .TemplateID = "AH"});
+  cppq::Task decoded(cppq::uuidToString(task.uuid), cppq::encodeTask(task));
+  assert(decoded.type.compare(task.type) == 0);
+  assert(decoded.payload.compare(task.payload) == 0);
+  assert(decoded.maxRetry == 10);
+
+  cppq::setTaskEncoding(cppq::TaskEncoding::Compact);
+  cppq::enqueue(c, task, "default");
+  std::string uuid = cppq::uuidToString(task.uuid);
+  redisReply *reply = (redisReply *)redisCommand(c, "TYPE cppq:default:task:%s", uuid.c_str());
+  assert(std::string(reply->str).compare("string") == 0);
+
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, "default", 1);
+  assert(dequeued.size() == 1);
+  assert(dequeued[0].payload.compare("{\"TemplateID\":\"AH\",\"UserID\":666}") == 0);
+  assert(dequeued[0].state == cppq::TaskState::Active);
+  assert(dequeued[0].maxRetry == 10);
+  assert(dequeued[0].dequeuedAtMs != 0);
+
+  assert(cppq::migrateTaskEncoding(c, "default", cppq::TaskEncoding::Hash) == 1);
+  reply = (redisReply *)redisCommand(c, "HGET cppq:default:task:%s state", uuid.c_str());
+  assert(std::string(reply->str).compare("Active") == 0);
+
+  // A result of "0" is a result, not an absent one
+  redisCommand(c, "FLUSHALL");
+  cppq::enqueue(c, task, "default");
+  dequeued = cppq::dequeue(c, "default", 1);
+  cppq::ConnectionPool connections(options, 1);
+  {
+    cppq::AckWriter acks(connections);
+    acks.push(cppq::Completion{ "default", uuid, cppq::TaskState::Completed, 0, "0" });
+  }
+  assert(cppq::migrateTaskEncoding(c, "default", cppq::TaskEncoding::Hash) == 1);
+  reply = (redisReply *)redisCommand(c, "HGET cppq:default:task:%s result", uuid.c_str());
+  assert(reply->type == REDIS_REPLY_STRING && std::string(reply->str).compare("0") == 0);
+  cppq::setTaskEncoding(cppq::TaskEncoding::Hash);
+}
+
+// Byte-wise run-length encoding, enough to exercise the compression path without codec libraries
+class RunLengthCodec : public cppq::Codec {
+  public:
+    uint8_t id() const override { return 15; }
+    std::string name() const override { return "rle"; }
+
+    std::string compress(const std::string &data) const override {
+      std::string out;
+      for (size_t i = 0; i < data.size();) {
+        size_t run = 1;
+        while (i + run < data.size() && run < 255 && data[i + run] == data[i])
+          run++;
+        out.push_back(static_cast<char>(run));
+        out.push_back(data[i]);
+        i += run;
+      }
+      return out;
+    }
+
+    std::string decompress(const std::string &data) const override {
+      std::string out;
+      for (size_t i = 0; i + 1 < data.size(); i += 2)
+        out.append(static_cast<uint8_t>(data[i]), data[i + 1]);
+      return out;
+    }
+};
+
+void testCompression() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  cppq::registerCodec(std::make_shared<RunLengthCodec>());
+  cppq::setCompression(15, 1024);
+
+  std::string payload(std::string(10000, 'a') + '\0' + std::string(10000, 'b'));
+  cppq::Task task(TypeEmailDelivery, payload, 10);
+  cppq::enqueue(c, task, "default");
+  std::string uuid = cppq::uuidToString(task.uuid);
+
+  redisReply *reply = (redisReply *)redisCommand(c, "HGET cppq:default:task:%s payloadCodec", uuid.c_str());
+  assert(std::string(reply->str).compare("15") == 0);
+  reply = (redisReply *)redisCommand(c, "HSTRLEN cppq:default:task:%s payload", uuid.c_str());
+  assert(reply->integer < 1000);
+
+  std::optional<cppq::Task> dequeued = cppq::dequeue(c, "default");
+  assert(dequeued.value().payloadCodec == 15);
+  cppq::decompressPayload(dequeued.value());
+  assert(dequeued.value().payloadCodec == cppq::codecNone);
+  assert(dequeued.value().payload == payload);
+
+  cppq::setCompression(cppq::codecNone);
+}
+
+void testRetention() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  for (int i = 0; i < 5; i++)
+    cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = i, .TemplateID = "AH"}), "default");
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, "default", 5);
+  assert(dequeued.size() == 5);
+
+  cppq::ConnectionPool connections(options, 1);
+  cppq::AckWriter acks(connections);
+  for (auto &task : dequeued)
+    acks.push(cppq::Completion{ "default", cppq::uuidToString(task.uuid), cppq::TaskState::Completed, 0, "{}" });
+  acks.flush();
+
+  std::remove("/tmp/cppq-archive.jsonl");
+  cppq::FileArchive archive("/tmp/cppq-archive.jsonl");
+  cppq::RetentionPolicy policy;
+  policy.maxCount = 2;
+  assert(cppq::trimFinished(c, "default", cppq::TaskState::Completed, policy, &archive, 2) == 3);
+
+  redisReply *reply = (redisReply *)redisCommand(c, "LLEN cppq:default:completed");
+  assert(reply->integer == 2);
+  // The oldest acknowledgements are evicted first
+  for (int i = 0; i < 3; i++) {
+    reply = (redisReply *)redisCommand(c, "EXISTS cppq:default:task:%s", cppq::uuidToString(dequeued[i].uuid).c_str());
+    assert(reply->integer == 0);
+  }
+
+  std::ifstream archived("/tmp/cppq-archive.jsonl");
+  std::string line;
+  int lines = 0;
+  while (std::getline(archived, line))
+    lines++;
+  assert(lines == 3);
+
+  policy.maxCount = 0;
+  policy.maxAge = std::chrono::milliseconds(1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  assert(cppq::trimFinished(c, "default", cppq::TaskState::Completed, policy) == 2);
+}
+
+void testPeriodic() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  // 2024-01-06 was a Saturday
+  int64_t saturday = cppq::daysFromCivil(2024, 1, 6) * 86400 + 10 * 3600;
+  assert(cppq::CronExpression("0 9 * * mon-fri").next(saturday).value() == saturday + 47 * 3600);
+  assert(cppq::CronExpression("*/15 * * * *").next(saturday).value() == saturday + 15 * 60);
+
+  cppq::registerPeriodic(c, "every-second", "* * * * * *", "periodic", NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 666, .TemplateID = "AH"}));
+
+  cppq::ConnectionPool connections(options, 1);
+  cppq::PeriodicScheduler scheduler(connections, { "periodic" });
+  scheduler.start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+  scheduler.stop();
+
+  redisReply *reply = (redisReply *)redisCommand(c, "LLEN cppq:periodic:pending");
+  assert(reply->integer >= 1 && reply->integer <= 3);
+  std::optional<cppq::Task> dequeued = cppq::dequeue(c, "periodic");
+  assert(dequeued.value().type.compare(TypeEmailDelivery) == 0);
+  assert(dequeued.value().cron.empty());
+  reply = (redisReply *)redisCommand(c, "HEXISTS cppq:periodic:periodic:fired every-second");
+  assert(reply->integer == 1);
+
+  cppq::unregisterPeriodic(c, "every-second", "periodic");
+}
+
+void testPause() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  cppq::WakeupListener listener(options, { "default" });
+  cppq::PauseCache pauses(std::chrono::hours(1));
+  pauses.refresh(c, listener.takePauseChange());
+  assert(!pauses.isPaused("default"));
+
+  cppq::pause(c, "default");
+  assert(cppq::isPaused(c, "default"));
+  // The announcement invalidates the cache long before it would go stale
+  assert(listener.wait(std::chrono::milliseconds(1000)));
+  pauses.refresh(c, listener.takePauseChange());
+  assert(pauses.isPaused("default"));
+
+  cppq::unpause(c, "default");
+  assert(!cppq::isPaused(c, "default"));
+  listener.wait(std::chrono::milliseconds(1000));
+  pauses.refresh(c, listener.takePauseChange());
+  assert(!pauses.isPaused("default"));
+
+  // Queues paused under the key from before it was hash-tagged stay paused
+  redisCommand(c, "SADD cppq:queues:paused default");
+  cppq::migratePaused(c);
+  assert(cppq::isPaused(c, "default"));
+  redisReply *reply = (redisReply *)redisCommand(c, "EXISTS cppq:queues:paused");
+  assert(reply->integer == 0);
+}
+
+void testQueueSelectors() {
+  std::vector<std::pair<std::string, int>> queues = { { "high", 20 }, { "default", 10 }, { "low", 5 } };
+  std::vector<std::shared_ptr<cppq::QueueSelector>> selectors = {
+    std::make_shared<cppq::WeightedRoundRobinSelector>(),
+    std::make_shared<cppq::DeficitRoundRobinSelector>()
+  };
+  for (auto &selector : selectors) {
+    selector->init(queues);
+    // Every queue is always full, so each window is taken exactly as planned
+    for (int round = 0; round < 1000; round++) {
+      size_t left = 7;
+      for (auto &[queue, quota] : selector->plan(7)) {
+        size_t count = std::min(quota, left);
+        if (count == 0)
+          continue;
+        selector->fetched(queue, count, count);
+        for (size_t i = 0; i < count; i++)
+          selector->countDispatch(queue);
+        left -= count;
+      }
+    }
+    std::map<std::string, uint64_t> counts = selector->dispatchCounts();
+    assert(counts["high"] == 4000);
+    assert(counts["default"] == 2000);
+    assert(counts["low"] == 1000);
+  }
+
+  cppq::ConcurrencyLimits limits({ { "default", 1 } }, { { TypeEmailDelivery, 2 } });
+  assert(limits.tryAcquire("default", TypeEmailDelivery));
+  assert(!limits.tryAcquire("default", TypeEmailDelivery));
+  assert(limits.available("default") == 0);
+  assert(limits.tryAcquire("high", TypeEmailDelivery));
+  assert(!limits.tryAcquire("low", TypeEmailDelivery));
+  limits.release("default", TypeEmailDelivery);
+  assert(limits.available("default") == 1);
+}
+
+void testMetrics() {
+  for (size_t bucket = 0; bucket + 1 < cppq::Histogram::bucketCount; bucket++) {
+    assert(cppq::Histogram::bucketOf(cppq::Histogram::lowerBound(bucket)) == bucket);
+    assert(cppq::Histogram::bucketOf(cppq::Histogram::lowerBound(bucket + 1) - 1) == bucket);
+  }
+  cppq::Histogram histogram;
+  for (uint64_t value = 1; value <= 1000; value++)
+    histogram.record(value);
+  assert(histogram.quantile(0.5) <= 500 && histogram.quantile(0.5) >= 500 - 500 / 16);
+  assert(histogram.max == 1000);
+
+  cppq::Metrics metrics;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++)
+    threads.emplace_back([&metrics] {
+      for (uint64_t value = 0; value < 1000; value++)
+        metrics.local("default", TypeEmailDelivery).record(cppq::Metric::Execution, value);
+      metrics.local("default", TypeEmailDelivery).count(cppq::Outcome::Completed);
+    });
+  for (auto &thread : threads)
+    thread.join();
+  cppq::MetricsSnapshot snapshot = metrics.snapshot();
+  cppq::MetricsSeries &series = snapshot[std::make_pair(std::string("default"), TypeEmailDelivery)];
+  assert(series.histograms[static_cast<size_t>(cppq::Metric::Execution)].count == 4000);
+  assert(series.outcomes[static_cast<size_t>(cppq::Outcome::Completed)] == 4);
+  std::string text = cppq::prometheusText(snapshot);
+  assert(text.find("cppq_execution_seconds_count{queue=\"default\",type=\"email:deliver\"} 4000") != std::string::npos);
+  // 100us shares its bucket with 101us to 103us, which must not count as at most 100us
+  assert(text.find("cppq_execution_seconds_bucket{queue=\"default\",type=\"email:deliver\",le=\"0.0001\"} 400\n") != std::string::npos);
+
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 666, .TemplateID = "AH"}), "default");
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, "default", 1);
+  assert(dequeued.size() == 1);
+  assert(dequeued[0].enqueuedAtMs != 0 && dequeued[0].enqueuedAtMs <= dequeued[0].dequeuedAtMs);
+
+  assert(cppq::writeMetrics(c, "test", snapshot, std::chrono::seconds(60)));
+  redisReply *reply = (redisReply *)redisCommand(c, "HGET cppq:default:metrics:test %s", TypeEmailDelivery.c_str());
+  assert(std::string(reply->str).find("\"completed\":4") != std::string::npos);
+  reply = (redisReply *)redisCommand(c, "PTTL cppq:default:metrics:test");
+  assert(reply->integer > 0);
+}
+
+void testStreamBackend() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  cppq::setQueueBackend("streamed", std::make_shared<cppq::StreamBackend>());
+  for (int i = 0; i < 3; i++)
+    cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = i, .TemplateID = "AH"}), "streamed");
+  cppq::enqueue(
+      c,
+      NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 3, .TemplateID = "AH"}),
+      "streamed",
+      cppq::scheduleOptions(std::chrono::system_clock::now() - std::chrono::seconds(1))
+      );
+  assert(cppq::promoteScheduled(c, "streamed").promoted == 1);
+  redisReply *reply = (redisReply *)redisCommand(c, "XLEN cppq:streamed:stream");
+  assert(reply->integer == 4);
+
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, "streamed", 2);
+  assert(dequeued.size() == 2);
+  assert(dequeued[0].payload.compare("{\"TemplateID\":\"AH\",\"UserID\":0}") == 0);
+  assert(dequeued[0].state == cppq::TaskState::Active);
+  reply = (redisReply *)redisCommand(c, "HLEN cppq:streamed:stream:entries");
+  assert(reply->integer == 2);
+  assert(cppq::extendLease(c, "streamed", dequeued[0], 1000));
+
+  cppq::ConnectionPool connections(options, 1);
+  {
+    cppq::AckWriter acks(connections);
+    acks.push(cppq::Completion{ "streamed", cppq::uuidToString(dequeued[0].uuid), cppq::TaskState::Completed, 0, "{}" });
+    acks.push(cppq::Completion{ "streamed", cppq::uuidToString(dequeued[1].uuid), cppq::TaskState::Pending, 1, "" });
+    acks.flush();
+  }
+  reply = (redisReply *)redisCommand(c, "XLEN cppq:streamed:stream");
+  assert(reply->integer == 3);
+  reply = (redisReply *)redisCommand(c, "LLEN cppq:streamed:completed");
+  assert(reply->integer == 1);
+
+  // Leased with no time left, every remaining entry is recovered as a new one
+  dequeued = cppq::dequeue(c, "streamed", 10);
+  assert(dequeued.size() == 3);
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  assert(cppq::recoverExpired(c, "streamed", 1000, 1) == 3);
+  reply = (redisReply *)redisCommand(c, "HLEN cppq:streamed:stream:entries");
+  assert(reply->integer == 0);
+  assert(cppq::dequeue(c, "streamed", 10).size() == 3);
+
+  // Expired entries behind many live ones are reached, one at a time
+  cppq::setQueueBackend("deep", std::make_shared<cppq::StreamBackend>());
+  for (int i = 0; i < 60; i++)
+    cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = i, .TemplateID = "AH"}), "deep");
+  dequeued = cppq::dequeue(c, "deep", 60);
+  assert(dequeued.size() == 60);
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  for (int i = 0; i < 50; i++)
+    assert(cppq::extendLease(c, "deep", dequeued[i], 1000));
+  assert(cppq::recoverExpired(c, "deep", 1, 100) == 10);
+  reply = (redisReply *)redisCommand(c, "HLEN cppq:deep:stream:entries");
+  assert(reply->integer == 50);
+}
+
+void testSharding() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  cppq::setKeyNaming(cppq::KeyNaming::HashTagged);
+  cppq::setQueueSharding("sharded", cppq::Sharding{ .shards = 4 });
+  assert(cppq::queueKey("sharded#1", "pending").compare("cppq:{sharded#1}:pending") == 0);
+  assert(cppq::logicalQueue("sharded#1").compare("sharded") == 0);
+  assert(cppq::logicalQueue("plain#1").compare("plain#1") == 0);
+
+  // Round-robin placement
+  for (int i = 0; i < 8; i++)
+    cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = i, .TemplateID = "AH"}), "sharded");
+  for (auto &shard : cppq::shardsOf("sharded")) {
+    redisReply *reply = (redisReply *)redisCommand(c, "LLEN %s", cppq::queueKey(shard, "pending").c_str());
+    assert(reply->integer == 2);
+  }
+
+  // Keyed placement keeps tasks with the same key together
+  cppq::setQueueSharding("keyed", cppq::Sharding{ .shards = 4, .key = [](const cppq::Task &task) { return task.payload; } });
+  std::vector<cppq::Task> tasks;
+  for (int i = 0; i < 3; i++)
+    tasks.push_back(NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 7, .TemplateID = "AH"}));
+  cppq::enqueueBatch(c, tasks, "keyed");
+  std::string shard = cppq::shardFor("keyed", tasks[0]);
+  redisReply *reply = (redisReply *)redisCommand(c, "LLEN %s", cppq::queueKey(shard, "pending").c_str());
+  assert(reply->integer == 3);
+
+  // Acknowledged on the shard it was dequeued from
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, shard, 1);
+  assert(dequeued.size() == 1);
+  cppq::ConnectionPool connections(options, 1);
+  {
+    cppq::AckWriter acks(connections);
+    acks.push(cppq::Completion{ shard, cppq::uuidToString(dequeued[0].uuid), cppq::TaskState::Completed, 0, "{}" });
+  }
+  reply = (redisReply *)redisCommand(c, "LLEN %s", cppq::queueKey(shard, "completed").c_str());
+  assert(reply->integer == 1);
+
+  cppq::setQueueSharding("sharded", cppq::Sharding{ .shards = 1 });
+  cppq::setQueueSharding("keyed", cppq::Sharding{ .shards = 1 });
+  cppq::setKeyNaming(cppq::KeyNaming::Plain);
+}
+
+void testResults() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  cppq::ResultListener results(options);
+  std::future<cppq::TaskResult> completed =
+    cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 1, .TemplateID = "AH"}), "awaited", results);
+  std::promise<cppq::TaskResult> failed;
+  cppq::enqueue(
+      c,
+      NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 2, .TemplateID = "AH"}),
+      "awaited",
+      results,
+      [&failed](const cppq::TaskResult &result) { failed.set_value(result); }
+      );
+  assert(results.outstanding() == 2);
+
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, "awaited", 2);
+  assert(dequeued.size() == 2);
+  cppq::ConnectionPool connections(options, 1);
+  {
+    cppq::AckWriter acks(connections);
+    // A retry is not an outcome
+    acks.push(cppq::Completion{ "awaited", cppq::uuidToString(dequeued[1].uuid), cppq::TaskState::Pending, 1, "" });
+    acks.push(cppq::Completion{ "awaited", cppq::uuidToString(dequeued[0].uuid), cppq::TaskState::Completed, 0, "{\"Sent\":true}" });
+    acks.flush();
+  }
+  assert(completed.wait_for(std::chrono::seconds(1)) == std::future_status::ready);
+  cppq::TaskResult result = completed.get();
+  assert(result.state == cppq::TaskState::Completed);
+  assert(result.result.compare("{\"Sent\":true}") == 0);
+  assert(results.outstanding() == 1);
+
+  dequeued = cppq::dequeue(c, "awaited", 1);
+  {
+    cppq::AckWriter acks(connections);
+    acks.push(cppq::Completion{ "awaited", cppq::uuidToString(dequeued[0].uuid), cppq::TaskState::Failed, 2, "" });
+  }
+  std::future<cppq::TaskResult> future = failed.get_future();
+  assert(future.wait_for(std::chrono::seconds(1)) == std::future_status::ready);
+  result = future.get();
+  assert(result.state == cppq::TaskState::Failed);
+  assert(result.retried == 2);
+  assert(results.outstanding() == 0);
+  redisReply *reply = (redisReply *)redisCommand(c, "KEYS cppq:awaited:reply:*");
+  assert(reply->elements == 0);
+}
+
+void testStats() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  auto nowMs = [] {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  };
+  uint64_t startedAtMs = nowMs();
+  for (int i = 0; i < 3; i++)
+    cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = i, .TemplateID = "AH"}), "default");
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, "default", 3);
+  assert(dequeued.size() == 3);
+
+  cppq::ConnectionPool connections(options, 1);
+  cppq::AckWriter acks(connections);
+  auto uuid = [&](int i) { return cppq::uuidToString(dequeued[i].uuid); };
+  acks.push(cppq::Completion{ "default", uuid(0), cppq::TaskState::Completed, 0, "{}", cppq::codecNone, "", {}, 1500 });
+  acks.push(cppq::Completion{ "default", uuid(1), cppq::TaskState::Failed, 10, "", cppq::codecNone, "", {}, 500 });
+  acks.push(cppq::Completion{ "default", uuid(2), cppq::TaskState::Pending, 1, "", cppq::codecNone, "", {}, 1000 });
+  acks.flush();
+
+  // The run may have crossed into the next minute
+  std::set<std::string> buckets = { cppq::statsKey("default", startedAtMs), cppq::statsKey("default", nowMs()) };
+  auto counter = [&](const char *field) {
+    long long total = 0;
+    for (auto &bucket : buckets) {
+      redisReply *reply = (redisReply *)redisCommand(c, "HGET %s %s", bucket.c_str(), field);
+      if (reply->type == REDIS_REPLY_STRING)
+        total += std::stoll(reply->str);
+    }
+    return total;
+  };
+  assert(counter("enqueued") == 3);
+  assert(counter("processed") == 3);
+  assert(counter("failed") == 1);
+  assert(counter("retried") == 1);
+  assert(counter("handler_us") == 3000);
+
+  redisReply *reply = (redisReply *)redisCommand(c, "TTL %s", cppq::statsKey("default", startedAtMs).c_str());
+  assert(reply->integer > 0 && reply->integer <= 24 * 3600);
+
+  cppq::setStatsHistory(std::chrono::seconds(0));
+  redisCommand(c, "FLUSHALL");
+  cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 3, .TemplateID = "AH"}), "default");
+  reply = (redisReply *)redisCommand(c, "KEYS cppq:default:stats:*");
+  assert(reply->elements == 0);
+  cppq::setStatsHistory(std::chrono::hours(24));
+}
+
+void testRetryPolicy() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  cppq::RetryPolicy policy;
+  policy.initialDelay = std::chrono::seconds(1);
+  policy.maxDelay = std::chrono::seconds(5);
+  policy.jitter = 0;
+  assert(cppq::retryDelay(policy, 1) == std::chrono::seconds(1));
+  assert(cppq::retryDelay(policy, 3) == std::chrono::seconds(4));
+  assert(cppq::retryDelay(policy, 10) == std::chrono::seconds(5));
+  policy.jitter = 0.5;
+  for (int i = 0; i < 100; i++) {
+    std::chrono::milliseconds delay = cppq::retryDelay(policy, 2);
+    assert(delay >= std::chrono::seconds(1) && delay <= std::chrono::seconds(3));
+  }
+  assert(cppq::retryDelay(cppq::RetryPolicy{}, 3).count() == 0);
+
+  policy.retryOn = cppq::retryOnly<std::runtime_error>();
+  cppq::registerRetryPolicy(TypeEmailDelivery, policy);
+  cppq::Task task = NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 1, .TemplateID = "AH"});
+  assert(cppq::isRetryable(task, std::runtime_error("timeout")));
+  assert(!cppq::isRetryable(task, std::logic_error("bad payload")));
+  assert(cppq::settleTask(task, true, false) == 0 && task.state == cppq::TaskState::Failed);
+
+  cppq::enqueue(c, task, "default");
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, "default", 1);
+  assert(dequeued.size() == 1);
+  uint64_t retryAtMs = cppq::settleTask(dequeued[0], true);
+  assert(dequeued[0].state == cppq::TaskState::Pending && retryAtMs > 0);
+  cppq::retryPolicies.clear();
+
+  // A delayed retry waits in the scheduled set instead of going back to pending
+  cppq::ConnectionPool connections(options, 1);
+  cppq::AckWriter acks(connections);
+  std::string uuid = cppq::uuidToString(dequeued[0].uuid);
+  acks.push(cppq::Completion{ "default", uuid, cppq::TaskState::Pending, 1, "", cppq::codecNone, "", {}, 0, retryAtMs });
+  acks.flush();
+
+  redisReply *reply = (redisReply *)redisCommand(c, "LLEN cppq:default:pending");
+  assert(reply->integer == 0);
+  reply = (redisReply *)redisCommand(c, "ZSCORE cppq:default:scheduled %s", uuid.c_str());
+  assert(std::stoull(reply->str) == retryAtMs);
+  reply = (redisReply *)redisCommand(c, "HGET cppq:default:task:%s state", uuid.c_str());
+  assert(std::string(reply->str).compare("Scheduled") == 0);
+
+  cppq::Promotion promotion = cppq::promoteScheduled(c, "default");
+  assert(promotion.promoted == 0);
+}
+
+void testFailedBulk() {
+  redisOptions options = {0};
+  REDIS_OPTIONS_SET_TCP(&options, "127.0.0.1", 6379);
+  redisContext *c = redisConnectWithOptions(&options);
+  if (c == NULL || c->err) {
+    std::cerr << "Failed to connect to Redis" << std::endl;
+    assert(false);
+  }
+
+  redisCommand(c, "FLUSHALL");
+
+  for (int i = 0; i < 6; i++) {
+    if (i % 2 == 0)
+      cppq::enqueue(c, NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = i, .TemplateID = "AH"}), "default");
+    else
+      cppq::enqueue(c, cppq::Task{ "report:build", "{}", 1 }, "default");
+  }
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, "default", 6);
+  assert(dequeued.size() == 6);
+  cppq::ConnectionPool connections(options, 1);
+  cppq::AckWriter acks(connections);
+  for (auto &task : dequeued)
+    acks.push(cppq::Completion{ "default", cppq::uuidToString(task.uuid), cppq::TaskState::Failed, 1, "" });
+  acks.flush();
+
+  // Batches of 2 rotate the tasks that stay to the other end of the list
+  std::vector<cppq::FailedProgress> reports;
+  cppq::FailedProgress done = cppq::processFailed(
+      c, "default", "requeue", TypeEmailDelivery, 0, [&](const cppq::FailedProgress &p) { reports.push_back(p); }, 2);
+  assert(done.examined == 6 && done.matched == 3 && done.total == 6);
+  assert(reports.size() == 3 && reports[0].examined == 2);
+
+  redisReply *reply = (redisReply *)redisCommand(c, "LLEN cppq:default:pending");
+  assert(reply->integer == 3);
+  reply = (redisReply *)redisCommand(c, "LRANGE cppq:default:failed 0 -1");
+  assert(reply->elements == 3);
+  assert(cppq::uuidToString(dequeued[5].uuid).compare(reply->element[0]->str) == 0);
+  assert(cppq::uuidToString(dequeued[1].uuid).compare(reply->element[2]->str) == 0);
+  reply = (redisReply *)redisCommand(c, "HGET cppq:default:task:%s retried", cppq::uuidToString(dequeued[0].uuid).c_str());
+  assert(std::string(reply->str).compare("0") == 0);
+
+  assert(cppq::deleteFailedBefore(c, "default", std::chrono::system_clock::now() - std::chrono::hours(1)) == 0);
+  assert(cppq::deleteFailed(c, "default") == 3);
+  reply = (redisReply *)redisCommand(c, "EXISTS cppq:default:task:%s", cppq::uuidToString(dequeued[1].uuid).c_str());
+  assert(reply->integer == 0);
+  reply = (redisReply *)redisCommand(c, "LLEN cppq:default:failed");
+  assert(reply->integer == 0);
+}
+
+void testEmbedded() {
+  std::string directory = (std::filesystem::temp_directory_path() / "cppq-test-wal").string();
+  std::filesystem::remove_all(directory);
+
+  cppq::Task retried = NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 1, .TemplateID = "AH"});
+  {
+    cppq::EmbeddedBroker broker(directory, {"default", "high"});
+    broker.enqueue(NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 0, .TemplateID = "AH"}), "default");
+    broker.enqueue(retried, "high");
+    broker.enqueue(
+        NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 2, .TemplateID = "AH"}),
+        "default",
+        cppq::scheduleOptions(std::chrono::system_clock::now() - std::chrono::seconds(1))
+        );
+
+    std::optional<cppq::Delivery> delivery = broker.tryDequeue("default");
+    assert(delivery.has_value());
+    assert(delivery->task.state == cppq::TaskState::Active);
+    cppq::settleTask(delivery->task, false);
+    broker.finish(std::move(delivery.value()));
+    assert(!broker.tryDequeue("default").has_value());
+
+    delivery = broker.tryDequeue("high");
+    cppq::settleTask(delivery->task, true);
+    broker.finish(std::move(delivery.value()));
+    // Dropped with the broker, it stays pending in the log
+    assert(broker.tryDequeue("high").has_value());
+  }
+
+  // The finished task is gone, the failed one comes back with its retry count and the scheduled one is due
+  cppq::EmbeddedBroker broker(directory, {"default", "high"});
+  std::optional<cppq::Delivery> delivery = broker.tryDequeue("high");
+  assert(delivery.has_value());
+  assert(uuid_compare(delivery->task.uuid, retried.uuid) == 0);
+  assert(delivery->task.retried == 1);
+  assert(delivery->task.payload.compare(retried.payload) == 0);
+  assert(!broker.tryDequeue("default").has_value());
+  assert(!broker.promoteScheduled().has_value());
+  delivery = broker.tryDequeue("default");
+  assert(delivery.has_value());
+  assert(delivery->task.payload.compare("{\"TemplateID\":\"AH\",\"UserID\":2}") == 0);
+  assert(std::distance(std::filesystem::directory_iterator(directory), std::filesystem::directory_iterator()) == 1);
+  std::filesystem::remove_all(directory);
+
+  // More unfinished tasks than the queues hold spill over on recovery, and so does a retry into a full queue
+  {
+    cppq::EmbeddedBroker large(directory, {"default"});
+    for (int i = 0; i < 10; i++)
+      large.enqueue(NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = i, .TemplateID = "AH"}), "default");
+  }
+  cppq::EmbeddedOptions small;
+  small.queueCapacity = 4;
+  cppq::EmbeddedBroker recovered(directory, {"default"}, small);
+  delivery = recovered.tryDequeue("default");
+  assert(delivery.has_value());
+  cppq::settleTask(delivery->task, true);
+  recovered.finish(std::move(delivery.value()));
+  int dequeued = 0;
+  while (recovered.tryDequeue("default").has_value())
+    dequeued++;
+  assert(dequeued == 10);
+
+  // A full queue holds enqueue back until a dequeue makes room, while enqueues from handlers go past it
+  auto followUp = [] { return NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 10, .TemplateID = "AH"}); };
+  for (int i = 0; i < 4; i++)
+    recovered.enqueue(followUp(), "default");
+  std::future<void> blocked = std::async(std::launch::async, [&] { recovered.enqueue(followUp(), "default"); });
+  assert(blocked.wait_for(std::chrono::milliseconds(50)) == std::future_status::timeout);
+  assert(recovered.tryDequeue("default").has_value());
+  assert(blocked.wait_for(std::chrono::seconds(1)) == std::future_status::ready);
+  cppq::EmbeddedBroker::handlerThread = true;
+  recovered.enqueue(followUp(), "default");
+  cppq::EmbeddedBroker::handlerThread = false;
+  dequeued = 0;
+  while (recovered.tryDequeue("default").has_value())
+    dequeued++;
+  assert(dequeued == 5);
+
+  std::filesystem::remove_all(directory);
+}
+
 void testRecovery() {
   cppq::registerHandler(TypeEmailDelivery, &HandleEmailDeliveryTask);
 
@@ -139,32 +1064,53 @@ void testRecovery() {
   cppq::Task task = NewEmailDeliveryTask(EmailDeliveryPayload{.UserID = 666, .TemplateID = "AH"});
 
   cppq::enqueue(c, task, "default");
-  std::optional<cppq::Task> dequeued = cppq::dequeue(c, "default");
+  std::vector<cppq::Task> dequeued = cppq::dequeue(c, "default", 1, 1);
 
-  redisReply *reply = (redisReply *)redisCommand(c, "LRANGE cppq:default:active -1 -1");
+  redisReply *reply = (redisReply *)redisCommand(c, "ZRANGE cppq:default:active 0 -1");
   if (reply->type != REDIS_REPLY_ARRAY)
     assert(false);
   if (reply->elements == 0)
     assert(false);
 
-  cppq::thread_pool pool;
-  pool.push_task(cppq::recovery, options, (std::map<std::string, int>){{"default", 5}}, 1, 10);
-
-  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  cppq::ConnectionPool connections(options, 1);
+  {
+    // Stopped and joined on leaving the scope
+    cppq::BackgroundThreads background;
+    background.threads.emplace_back([&] {
+      cppq::recovery(connections, {{"default", 5}}, 10, cppq::defaultLeaseMs, &background.signal);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
 
   reply = (redisReply *)redisCommand(c, "LRANGE cppq:default:pending -1 -1");
   if (reply->type != REDIS_REPLY_ARRAY)
     assert(false);
   if (reply->elements == 0)
     assert(false);
-
-  exit(0);
 }
 
 int main(int argc, char *argv[]) {
   testEnqueue();
   testDequeue();
-  // TODO: Add scheduled task test
+  testEnqueueBatch();
+  testProducer();
+  testSchedule();
+  testLease();
+  testAckWriter();
+  testCompactEncoding();
+  testCompression();
+  testRetention();
+  testPeriodic();
+  testPause();
+  testQueueSelectors();
+  testMetrics();
+  testStreamBackend();
+  testSharding();
+  testResults();
+  testStats();
+  testRetryPolicy();
+  testFailedBulk();
+  testEmbedded();
   testRecovery();
 }
 
@@ -1,7 +1,18 @@
 from flask import Flask
 from flask import request
+from flask import Response
 from flask_cors import CORS
 import redis
+import os
+import sys
+import time
+import threading
+from uuid import uuid4
+
+# The Redis helpers are shared with the CLI
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'cli'))
+from cppq_admin import (OUTCOMES, dashboard, page_tasks, get_tasks, process_failed, bucket_upper_bound, get_metrics,
+                        summarize_metrics, set_paused)
 
 app = Flask(__name__)
 CORS(app)
@@ -9,23 +20,6 @@ CORS(app)
 redisClient = redis.Redis()
 
 
-def decode_redis(src):
-    if isinstance(src, list):
-        rv = list()
-        for key in src:
-            rv.append(decode_redis(key))
-        return rv
-    elif isinstance(src, dict):
-        rv = dict()
-        for key in src:
-            rv[key.decode()] = decode_redis(src[key])
-        return rv
-    elif isinstance(src, bytes):
-        return src.decode()
-    else:
-        raise Exception("type not handled: " + type(src))
-
-
 @app.route('/redis/connect', methods = ['POST', 'GET'])
 def connect():
     global redisClient
@@ -50,50 +44,152 @@ def listLength(key):
     return { 'result': redisClient.llen(key) }
 
 
-@app.route('/redis/llrangeAll/<key>', methods = ['GET'])
-def llrangeAll(key):
-    return { 'result': redisClient.lrange(key, 0, -1) }
+@app.route('/redis/lrange/<key>', methods = ['GET'])
+def lrange(key):
+    start = request.args.get('start', 0, type=int)
+    count = min(request.args.get('count', 100, type=int), 1000)
+    return { 'result': [x.decode() for x in redisClient.lrange(key, start, start + count - 1)] }
 
 
 @app.route('/queue/<queue>/memory', methods = ['GET'])
 def getMemoryUsage(queue):
-    pending = redisClient.memory_usage('cppq:' + queue + ':pending') or 0
-    scheduled = redisClient.memory_usage('cppq:' + queue + ':scheduled') or 0
-    active = redisClient.memory_usage('cppq:' + queue + ':active') or 0
-    completed = redisClient.memory_usage('cppq:' + queue + ':completed') or 0
-    failed = redisClient.memory_usage('cppq:' + queue + ':failed') or 0
-    return { 'result': pending + scheduled + active + completed + failed }
+    return { 'result': dashboard(redisClient, [queue], minutes=0, memory=True)[0]['memory'] }
 
 
 @app.route('/queue/<queue>/stats', methods = ['GET'])
 def queueStats(queue):
-    pending = redisClient.llen('cppq:' + queue + ':pending')
-    scheduled = redisClient.llen('cppq:' + queue + ':scheduled')
-    active = redisClient.llen('cppq:' + queue + ':active')
-    completed = redisClient.llen('cppq:' + queue + ':completed')
-    failed = redisClient.llen('cppq:' + queue + ':failed')
-    paused = redisClient.sismember('cppq:queues:paused', queue);
-    return { 'pending': pending, 'scheduled': scheduled, 'active': active, 'completed': completed, 'failed': failed, 'paused': paused }
+    stats = dashboard(redisClient, [queue], minutes=0)[0]
+    return { state: stats[state] for state in ('pending', 'scheduled', 'active', 'completed', 'failed', 'paused') }
+
+
+@app.route('/queue/<queue>/history', methods = ['GET'])
+def queueHistory(queue):
+    return { 'result': dashboard(redisClient, [queue], minutes=request.args.get('minutes', 60, type=int))[0]['history'] }
+
+
+# Every queue's counts, memory usage and per-minute throughput in one go, for the dashboard
+@app.route('/dashboard', methods = ['GET'])
+def getDashboard():
+    try:
+        return { 'connected': True, 'queues': dashboard(redisClient, minutes=request.args.get('minutes', 60, type=int), memory=True) }
+    except redis.exceptions.ConnectionError:
+        return { 'connected': False }
+
+
+@app.route('/queue/<queue>/metrics', methods = ['GET'])
+def queueMetrics(queue):
+    return { 'result': summarize_metrics(get_metrics(redisClient, queue)) }
+
+
+# Prometheus exposition of every queue's merged metrics, the same families as cppq::prometheusText
+@app.route('/metrics', methods = ['GET'])
+def prometheusMetrics():
+    families = (
+        ('queue_wait_us', 'cppq_queue_wait_seconds', 'Time from enqueue to dequeue.', 1e-6),
+        ('execution_us', 'cppq_execution_seconds', 'Handler run time.', 1e-6),
+        ('ack_latency_us', 'cppq_ack_latency_seconds', 'Time from handler return to acknowledgement.', 1e-6),
+        ('retries', 'cppq_retries', 'Retries of tasks that completed or failed for good.', 1)
+    )
+    secondBounds = (0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60, 300)
+    series = {}
+    for queue in redisClient.smembers('cppq:queues'):
+        name = queue.decode().split(':')[0]
+        for type, metrics in get_metrics(redisClient, name).items():
+            series[(name, type)] = metrics
+
+    def labels(queue, type):
+        escape = lambda value: value.replace('\\', '\\\\').replace('"', '\\"').replace('\n', '\\n')
+        return 'queue="' + escape(queue) + '",type="' + escape(type) + '"'
+
+    lines = []
+    for key, family, help, scale in families:
+        lines.append('# HELP ' + family + ' ' + help)
+        lines.append('# TYPE ' + family + ' histogram')
+        for (queue, type), metrics in sorted(series.items()):
+            histogram = metrics[key]
+            for bound in (secondBounds if scale != 1 else (0, 1, 2, 3, 5, 10)):
+                count = sum(n for bucket, n in histogram['buckets'].items() if bucket_upper_bound(bucket) * scale <= bound)
+                lines.append(family + '_bucket{' + labels(queue, type) + ',le="' + str(bound) + '"} ' + str(count))
+            lines.append(family + '_bucket{' + labels(queue, type) + ',le="+Inf"} ' + str(histogram['count']))
+            lines.append(family + '_sum{' + labels(queue, type) + '} ' + str(histogram['sum'] * scale))
+            lines.append(family + '_count{' + labels(queue, type) + '} ' + str(histogram['count']))
+    lines.append('# HELP cppq_tasks_total Acknowledged tasks by outcome.')
+    lines.append('# TYPE cppq_tasks_total counter')
+    for (queue, type), metrics in sorted(series.items()):
+        for outcome in OUTCOMES:
+            lines.append('cppq_tasks_total{' + labels(queue, type) + ',outcome="' + outcome + '"} ' + str(metrics[outcome]))
+    return Response('\n'.join(lines) + '\n', mimetype='text/plain; version=0.0.4')
 
 
 @app.route('/queue/<queue>/<state>/tasks', methods = ['GET'])
 def queueTasks(queue, state):
-    taskUuids = [x.decode('ascii') for x in redisClient.lrange('cppq:' + queue + ':' + state, 0, -1)]
-    tasks = []
-    for uuid in taskUuids:
-        tasks.append(decode_redis(redisClient.hgetall('cppq:' + queue + ':task:' + uuid)))
-    return { 'result': tasks }
+    page, cursor = page_tasks(
+        redisClient,
+        queue,
+        state,
+        request.args.get('cursor'),
+        min(request.args.get('count', 50, type=int), 1000),
+        request.args.get('type') or None,
+        request.args.get('offset', 0, type=int)
+    )
+    return { 'result': get_tasks(redisClient, page), 'cursor': cursor }
+
+
+# Bulk operations on failed tasks run in the background, their progress is polled from /jobs/<id>
+jobs = {}
+
+
+def start_job(work):
+    id = str(uuid4())
+    job = jobs[id] = { 'examined': 0, 'matched': 0, 'total': 0, 'done': False, 'error': None, 'startedAt': time.time() }
+
+    def progress(done):
+        job.update(done)
+
+    def run():
+        try:
+            job.update(work(progress))
+        except Exception as e:
+            job['error'] = str(e)
+        job['done'] = True
+
+    threading.Thread(target=run, daemon=True).start()
+    return id
+
+
+@app.route('/queue/<queue>/failed/requeue', methods = ['POST'])
+def requeueFailed(queue):
+    type = request.args.get('type') or None
+    return { 'job': start_job(lambda progress: process_failed(redisClient, queue, 'requeue', type, progress=progress)) }
+
+
+# olderThan is in seconds
+@app.route('/queue/<queue>/failed/delete', methods = ['POST'])
+def deleteFailed(queue):
+    type = request.args.get('type') or None
+    olderThan = request.args.get('olderThan', type=float)
+    before_ms = max(int((time.time() - olderThan) * 1000), 1) if olderThan is not None else 0
+    return { 'job': start_job(lambda progress: process_failed(redisClient, queue, 'delete', type, before_ms, progress=progress)) }
+
+
+@app.route('/jobs/<id>', methods = ['GET'])
+def getJob(id):
+    if id not in jobs:
+        return { 'error': 'unknown job' }, 404
+    job = jobs[id]
+    elapsed = max(time.time() - job['startedAt'], 1e-3)
+    return dict(job, perMinute=int(job['examined'] / elapsed * 60))
 
 
 @app.route('/queue/<queue>/pause', methods = ['POST'])
 def pauseQueue(queue):
-    redisClient.sadd('cppq:queues:paused', queue)
+    set_paused(redisClient, queue, True)
     return { 'success': True }
 
 
 @app.route('/queue/<queue>/unpause', methods = ['POST'])
 def unpauseQueue(queue):
-    redisClient.srem('cppq:queues:paused', queue)
+    set_paused(redisClient, queue, False)
     return { 'success': True }
 
 
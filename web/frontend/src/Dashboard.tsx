@@ -2,26 +2,25 @@ import { useState, useEffect } from 'react';
 import { useNavigate } from 'react-router-dom';
 import { Button, Table } from 'antd';
 import { PauseOutlined, CaretRightOutlined } from '@ant-design/icons';
+import Throughput, { Rollup } from './Throughput';
 
 function Dashboard(props: { refetch: Date, setRefetch: (date: Date) => void }) {
-  const [queues, setQueues] = useState<{ name: string, priority: string, memory: string, failureRate: string, paused: boolean }[]>([]);
+  const [queues, setQueues] = useState<{ name: string, priority: string, memory: string, failureRate: string, paused: boolean, history: Rollup[] }[]>([]);
   const navigate = useNavigate();
 
   useEffect(() => {
     async function fetchQueues() {
-      await fetch('http://localhost:5000/queue', { method: 'GET' })
+      await fetch('http://localhost:5000/dashboard', { method: 'GET' })
         .then((response) => response.json())
         .then(async (body) => {
           if (!body.connected) navigate('/');
-          let processedQueues = [];
           let key = 1;
-          for (const queue of body.queues) {
-            const queueParts = queue.split(':');
-            const stats = await (await fetch('http://localhost:5000/queue/' + queueParts[0] + '/stats')).json();
-            const memory = await (await fetch('http://localhost:5000/queue/' + queueParts[0] + '/memory')).json();
-            processedQueues.push({ memory: String(memory.result / 1024) + ' MB', ...stats, failureRate: stats.completed ? String((stats.failed / stats.completed) * 100) + '%' : stats.failed ? '100%' : '0%', name: queueParts[0], priority: queueParts[1], paused: stats.paused, key: key++ });
-          }
-          setQueues(processedQueues);
+          setQueues(body.queues.map((stats: any) => ({
+            ...stats,
+            memory: String(stats.memory / 1024) + ' MB',
+            failureRate: stats.completed ? String((stats.failed / stats.completed) * 100) + '%' : stats.failed ? '100%' : '0%',
+            key: key++
+          })));
         });
     }
     fetchQueues();
@@ -88,6 +87,12 @@ function Dashboard(props: { refetch: Date, setRefetch: (date: Date) => void }) {
       dataIndex: 'failureRate',
       key: 'failureRate',
     },
+    {
+      title: 'Throughput (1h)',
+      dataIndex: 'history',
+      key: 'history',
+      render: (history: Rollup[]) => <Throughput history={history} width={120} height={30} />
+    },
     {
       title: 'Actions',
       dataIndex: 'name',
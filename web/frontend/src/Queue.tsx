@@ -1,17 +1,38 @@
 import { useState, useEffect } from 'react';
 import { useParams } from 'react-router-dom';
-import { Tabs, Tag, Table } from 'antd';
+import { Tabs, Tag, Table, Input, Button, Progress, Popconfirm } from 'antd';
+import Throughput, { Rollup } from './Throughput';
 
 function Queue(props: { refetch: Date }) {
   const [currentTab, setCurrentTab] = useState('pending');
   const [tasks, setTasks] = useState([]);
+  const [page, setPage] = useState(1);
+  const [pageSize, setPageSize] = useState(50);
+  const [type, setType] = useState('');
+  const [total, setTotal] = useState(0);
+  const [job, setJob] = useState<{ examined: number, matched: number, total: number, done: boolean, error: string | null, perMinute: number } | null>(null);
+  const [history, setHistory] = useState<Rollup[]>([]);
   const { name } = useParams();
 
+  useEffect(() => {
+    async function fetchHistory() {
+      await fetch('http://localhost:5000/queue/' + name + '/history', { method: 'GET' })
+        .then((response) => response.json())
+        .then((body) => setHistory(body.result));
+    }
+    fetchHistory();
+  }, [props.refetch, name]);
+
   useEffect(() => {
     async function fetchQueues() {
-      await fetch('http://localhost:5000/queue/' + name + '/' + currentTab + '/tasks', { method: 'GET' })
+      const offset = (page - 1) * pageSize;
+      const query = '?offset=' + offset + '&count=' + pageSize + (type ? '&type=' + encodeURIComponent(type) : '');
+      const stats = await (await fetch('http://localhost:5000/queue/' + name + '/stats')).json();
+      await fetch('http://localhost:5000/queue/' + name + '/' + currentTab + '/tasks' + query, { method: 'GET' })
         .then((response) => response.json())
         .then(async (body) => {
+          // Without a type filter the state's length is known, with one there is a next page as long as there is a cursor
+          setTotal(type ? offset + body.result.length + (body.cursor ? pageSize : 0) : stats[currentTab]);
           setTasks(body.result.map((e: any) => {
             if (e.schedule)
               e.schedule = new Date(Number(e.schedule)).toISOString();
@@ -22,11 +43,12 @@ function Queue(props: { refetch: Date }) {
         });
     }
     fetchQueues();
-  }, [props.refetch, currentTab, name]);
+  }, [props.refetch, currentTab, name, page, pageSize, type]);
 
   useEffect(() => {
     setTasks([]);
-  }, [currentTab]);
+    setPage(1);
+  }, [currentTab, type]);
 
   const commonColumns = [
     {
@@ -94,16 +116,55 @@ function Queue(props: { refetch: Date }) {
     },
   ];
 
+  // Starts a bulk operation on the failed tasks (of the filtered type) and follows its progress
+  const onFailedAction = async (action: string) => {
+    const response = await fetch('http://localhost:5000/queue/' + name + '/failed/' + action + (type ? '?type=' + encodeURIComponent(type) : ''), { method: 'POST' });
+    const id = (await response.json()).job;
+    const poll = setInterval(async () => {
+      const progress = await (await fetch('http://localhost:5000/jobs/' + id)).json();
+      setJob(progress);
+      if (progress.done) {
+        clearInterval(poll);
+        setPage(1);
+        setTasks([]);
+      }
+    }, 500);
+  };
+
+  const failedActions = (<div style={{ marginBottom: '10px' }}>
+    <Button onClick={() => onFailedAction('requeue')} style={{ marginRight: '10px' }}>Requeue {type ? type : 'all'}</Button>
+    <Popconfirm title={'Delete ' + (type ? 'failed ' + type + ' tasks' : 'all failed tasks') + '?'} onConfirm={() => onFailedAction('delete')}>
+      <Button danger>Delete {type ? type : 'all'}</Button>
+    </Popconfirm>
+    {job && <div style={{ width: '400px' }}>
+      <Progress percent={job.total ? Math.floor((job.examined / job.total) * 100) : 100} status={job.error ? 'exception' : job.done ? 'success' : 'active'} />
+      {job.error ? job.error : job.matched + ' of ' + job.examined + ' examined tasks, ' + job.perMinute + ' tasks/min'}
+    </div>}
+  </div>);
+
+  const pagination = {
+    current: page,
+    pageSize: pageSize,
+    total: total,
+    onChange: (current: number, size: number) => {
+      setPage(size === pageSize ? current : 1);
+      setPageSize(size);
+    },
+  };
+  const table = (columns: any[]) => <Table dataSource={tasks} columns={columns} rowKey="uuid" pagination={pagination} />;
+
   const items = [
-    { label: 'Pending', key: 'pending', children: <Table dataSource={tasks} columns={pendingColumns} /> },
-    { label: 'Scheduled', key: 'scheduled', children: <Table dataSource={tasks} columns={scheduledColumns} /> },
-    { label: 'Active', key: 'active', children: <Table dataSource={tasks} columns={activeColumns} /> },
-    { label: 'Completed', key: 'completed', children: <Table dataSource={tasks} columns={completedColumns} /> },
-    { label: 'Failed', key: 'failed', children: <Table dataSource={tasks} columns={failedColumns} /> },
+    { label: 'Pending', key: 'pending', children: table(pendingColumns) },
+    { label: 'Scheduled', key: 'scheduled', children: table(scheduledColumns) },
+    { label: 'Active', key: 'active', children: table(activeColumns) },
+    { label: 'Completed', key: 'completed', children: table(completedColumns) },
+    { label: 'Failed', key: 'failed', children: <>{failedActions}{table(failedColumns)}</> },
   ];
 
   return (<>
   <Tag color="green" style={{ marginLeft: '10px', marginTop: '10px' }}>Queue: {name}</Tag>
+  <div style={{ marginLeft: '10px', marginTop: '10px' }}><Throughput history={history} legend /></div>
+  <Input.Search placeholder="Task type" allowClear onSearch={setType} style={{ marginLeft: '10px', marginTop: '10px', width: '300px' }} />
   <Tabs items={items} onChange={setCurrentTab} style={{ marginLeft: '10px', marginRight: '10px' }} />
 </>);
 }
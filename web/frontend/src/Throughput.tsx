@@ -0,0 +1,49 @@
+export type Rollup = {
+  minuteMs: number,
+  enqueued: number,
+  processed: number,
+  failed: number,
+  retried: number,
+  handler_us: number,
+};
+
+const series: { key: 'enqueued' | 'processed' | 'failed' | 'retried', color: string }[] = [
+  { key: 'enqueued', color: '#1890ff' },
+  { key: 'processed', color: '#52c41a' },
+  { key: 'failed', color: '#f5222d' },
+  { key: 'retried', color: '#faad14' },
+];
+
+// Tasks per minute from the queue's per-minute rollups, drawn as plain SVG polylines
+function Throughput(props: { history: Rollup[], width?: number, height?: number, legend?: boolean }) {
+  const width = props.width ?? 600;
+  const height = props.height ?? 150;
+  const history = props.history;
+  const max = Math.max(1, ...history.flatMap((point) => series.map((s) => point[s.key])));
+  const x = (i: number) => history.length > 1 ? (i / (history.length - 1)) * width : width / 2;
+  const y = (value: number) => height - (value / max) * (height - 2) - 1;
+  const last = history[history.length - 1];
+  const handlerMs = last && last.processed ? (last.handler_us / last.processed / 1000).toFixed(2) : '-';
+
+  return (<div>
+  <svg width={width} height={height} style={{ border: '1px solid #f0f0f0' }}>
+    {series.map((s) =>
+      <polyline
+        key={s.key}
+        fill="none"
+        stroke={s.color}
+        strokeWidth={1.5}
+        points={history.map((point, i) => x(i) + ',' + y(point[s.key])).join(' ')}
+      />
+    )}
+  </svg>
+  {props.legend &&
+    <div>
+      {series.map((s) => <span key={s.key} style={{ color: s.color, marginRight: '10px' }}>{s.key}: {last ? last[s.key] : 0}/min</span>)}
+      <span>mean handler time: {handlerMs} ms</span>
+      <span style={{ marginLeft: '10px', color: '#999' }}>peak {max}/min</span>
+    </div>}
+</div>);
+}
+
+export default Throughput;